@@ -1,244 +1,336 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <memory>
 #include <numeric>
-#include <vector>
-#include <chrono>
 #include <random>
-#include <algorithm>
-#include <functional>
+#include <string>
+#include <vector>
 
 #include "trees/avl_tree.hpp"
+#include "trees/b_tree.hpp"
 #include "trees/bb_alpha_tree.hpp"
+#include "trees/parent_free_red_black_tree.hpp"
 #include "trees/red_black_tree.hpp"
 #include "trees/scapegoat_tree.hpp"
 #include "trees/splay_tree.hpp"
+#include "trees/string_key.hpp"
+#include "trees/top_down_splay_tree.hpp"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "harness.hpp"
+
+// Every tree runs with the default heap allocator, with the slab pool and
+// with compact 32-bit index storage.
+template <template <typename, typename> class Tree, typename... Args>
+void addSubjects(std::vector<Subject>& subjects, const std::string& name, Args... args) {
+    subjects.push_back(makeSubject<Tree<int, std::allocator<int>>>(name, "heap", args...));
+    subjects.push_back(makeSubject<Tree<int, PoolAllocator<int>>>(name, "pool", args...));
+    subjects.push_back(makeSubject<Tree<int, CompactAllocator<int>>>(name, "compact", args...));
+}
+
+template <template <typename, typename> class Tree>
+void addStringSubjects(std::vector<Subject>& subjects, const std::string& name) {
+    subjects.push_back(makeStringSubject<Tree<std::string, std::allocator<std::string>>>(name + " (std::string)", "heap"));
+    subjects.push_back(makeStringSubject<Tree<StringKey, std::allocator<StringKey>>>(name + " (StringKey)", "heap"));
+}
+
+std::vector<Subject> makeSubjects() {
+    std::vector<Subject> subjects;
+    addSubjects<AVLTree>(subjects, "AVL Tree");
+    addSubjects<BTree>(subjects, "B-Tree");
+    addSubjects<BBAlphaTree>(subjects, "BB-alpha Tree (alpha=0.25)", 0.25);
+    addSubjects<BBAlphaTree>(subjects, "BB-alpha Tree (alpha=0.33)", 0.33);
+    addSubjects<RedBlackTree>(subjects, "Red Black Tree");
+    addSubjects<ParentFreeRedBlackTree>(subjects, "Parent-Free Red Black Tree");
+    addSubjects<ScapegoatTree>(subjects, "Scapegoat Tree (alpha=0.5)", 0.5);
+    addSubjects<ScapegoatTree>(subjects, "Scapegoat Tree (alpha=0.7)", 0.7);
+    addSubjects<SplayTree>(subjects, "Splay Tree");
+    addSubjects<TopDownSplayTree>(subjects, "Top-Down Splay Tree");
 
-enum EType {
-    INSERT,
-    REMOVE,
-    SEARCH
-};
+    // Splay policies for read-mostly traffic, against the fully splaying
+    // pool rows above.
+    using PolicySplayTree = SplayTree<int, PoolAllocator<int>>;
+    using SplayMode = SplayPolicy::Mode;
+    subjects.push_back(makeSubject<PolicySplayTree>("Splay Tree (semi)", "pool", SplayPolicy{.mode = SplayMode::SEMI}));
+    subjects.push_back(makeSubject<PolicySplayTree>("Splay Tree (p=0.05)", "pool",
+                                                    SplayPolicy{.mode = SplayMode::PROBABILISTIC, .probability = 0.05}));
+    subjects.push_back(makeSubject<PolicySplayTree>("Splay Tree (depth>32)", "pool", SplayPolicy{.mode = SplayMode::DEPTH, .depth = 32}));
+    subjects.push_back(makeSubject<PolicySplayTree>("Splay Tree (every 32nd)", "pool", SplayPolicy{.mode = SplayMode::PERIODIC, .period = 32}));
 
-struct Operation {
-    int value;
-    EType type;
-};
+    // The snapshot does not depend on the source tree, so one is enough.
+    subjects.push_back(makeFrozenSubject<AVLTree<int>>("Frozen (Eytzinger)", FrozenLayout::EYTZINGER));
+    subjects.push_back(makeFrozenSubject<AVLTree<int>>("Frozen (van Emde Boas)", FrozenLayout::VEB));
 
-uint64_t measureOperationsTime(const std::vector<int>& preliminaryValues, const std::vector<Operation>& operations, std::function<BinarySearchTree<int>*()> treeCreator) {
-    std::unique_ptr<BinarySearchTree<int>> tree(treeCreator());
+    // Batched lookups against the scalar rows above.
+    subjects.push_back(makeBatchSubject<AVLTree<int, PoolAllocator<int>>>("AVL Tree (batched)", "pool"));
+    subjects.push_back(makeBatchSubject<BTree<int, PoolAllocator<int>>>("B-Tree (batched)", "pool"));
+    subjects.push_back(makeBatchSubject<RedBlackTree<int, PoolAllocator<int>>>("Red Black Tree (batched)", "pool"));
+    subjects.push_back(makeFrozenBatchSubject<AVLTree<int>>("Frozen (Eytzinger, batched)", FrozenLayout::EYTZINGER));
 
-    for (const auto value : preliminaryValues) {
-        tree->insert(value);
+    // String keys, plain and with the inline prefix the server uses.
+    addStringSubjects<AVLTree>(subjects, "AVL Tree");
+    addStringSubjects<BTree>(subjects, "B-Tree");
+    addStringSubjects<RedBlackTree>(subjects, "Red Black Tree");
+    addStringSubjects<ParentFreeRedBlackTree>(subjects, "Parent-Free Red Black Tree");
+    addStringSubjects<SplayTree>(subjects, "Splay Tree");
+    addStringSubjects<TopDownSplayTree>(subjects, "Top-Down Splay Tree");
+    return subjects;
+}
+
+std::vector<int> shuffledKeys(size_t N, std::mt19937& gen) {
+    std::vector<int> data(2 * N);
+    std::iota(data.begin(), data.end(), 1);
+    std::shuffle(data.begin(), data.end(), gen);
+    return data;
+}
+
+Workload hotKeysWorkload(size_t N, size_t Q, std::mt19937& gen) {
+    std::vector<int> data = shuffledKeys(N, gen);
+
+    Workload workload;
+    workload.preliminaryValues.assign(data.begin(), data.begin() + N);
+
+    const size_t HOT_KEYS_COUNT = std::max<size_t>(1, 0.1 * N);
+    std::vector<int> hotKeys(workload.preliminaryValues.begin(), workload.preliminaryValues.begin() + HOT_KEYS_COUNT);
+
+    std::uniform_int_distribution<size_t> hotKeysDis(0, HOT_KEYS_COUNT - 1);
+    for (size_t i = 0; i < Q * 0.9; i++) {
+        workload.operations.push_back({hotKeys[hotKeysDis(gen)], SEARCH});
     }
-    
-    auto start = std::chrono::high_resolution_clock::now();
-    for (const auto& op : operations) {
-        int value = op.value;
-        EType type = op.type;
-        
-        switch (type) {
-            case EType::INSERT:
-                tree->insert(value);
-                break;
-            case EType::REMOVE:
-                tree->remove(value);
-                break;
-            case EType::SEARCH:
-                volatile bool found = tree->search(op.value);
-                (void)found;
-                break;
-        }
+
+    std::uniform_int_distribution<int> anyKeyDis(1, 2 * N);
+    for (size_t i = 0; i < Q * 0.1; i++) {
+        workload.operations.push_back({anyKeyDis(gen), SEARCH});
     }
-    
-    auto end = std::chrono::high_resolution_clock::now();    
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-    return duration.count();
+    return workload;
 }
 
-void runOperations(const std::vector<int>& preliminaryValues, const std::vector<Operation>& operations) {
-    std::cout << "AVL Tree: " 
-              << measureOperationsTime(
-                   preliminaryValues, operations, 
-                   []() { return new AVLTree<int>(); }
-                 ) << " ms\n";
-    
-    std::cout << "BB-alpha Tree (alpha=0.25): " 
-              << measureOperationsTime(
-                   preliminaryValues, operations, 
-                   []() { return new BBAlphaTree<int>(0.25); }
-                 ) << " ms\n";
-                 
-    std::cout << "BB-alpha Tree (alpha=0.33): " 
-              << measureOperationsTime(
-                   preliminaryValues, operations, 
-                   []() { return new BBAlphaTree<int>(0.33); }
-                 ) << " ms\n";
-    
-    std::cout << "Red Black Tree: " 
-              << measureOperationsTime(
-                   preliminaryValues, operations, 
-                   []() { return new RedBlackTree<int>(); }
-                 ) << " ms\n";
-    
-    std::cout << "Scapegoat Tree (alpha=0.5): " 
-              << measureOperationsTime(
-                   preliminaryValues, operations, 
-                   []() { return new ScapegoatTree<int>(0.5); }
-                 ) << " ms\n";
-                 
-    std::cout << "Scapegoat Tree (alpha=0.7): " 
-              << measureOperationsTime(
-                   preliminaryValues, operations, 
-                   []() { return new ScapegoatTree<int>(0.7); }
-                 ) << " ms\n";
-    
-    std::cout << "Splay Tree: " 
-              << measureOperationsTime(
-                   preliminaryValues, operations, 
-                   []() { return new SplayTree<int>(); }
-                 ) << " ms\n\n";
+Workload uniformSearchWorkload(size_t N, size_t Q, std::mt19937& gen) {
+    std::vector<int> data = shuffledKeys(N, gen);
+
+    Workload workload;
+    workload.preliminaryValues.assign(data.begin(), data.begin() + N);
+
+    std::uniform_int_distribution<int> dis(1, 2 * N);
+    for (size_t i = 0; i < Q; i++) {
+        workload.operations.push_back({dis(gen), SEARCH});
+    }
+    return workload;
 }
 
-int main() {
-    std::mt19937 gen;
+Workload mixedWorkload(size_t N, size_t Q, std::mt19937& gen) {
+    std::vector<int> data = shuffledKeys(N, gen);
+
+    Workload workload;
+    workload.preliminaryValues.assign(data.begin(), data.begin() + N);
+
+    std::vector<int> availableForInsert(data.begin() + N, data.end());
+    std::vector<int> availableForDelete(workload.preliminaryValues);
+
+    std::uniform_int_distribution<int> operationDis(0, 2);
+    std::uniform_int_distribution<int> valueDis(1, 2 * N);
+
+    for (size_t i = 0; i < Q; i++) {
+        int op = operationDis(gen);
+
+        if (op == 0 && !availableForInsert.empty()) {
+            std::uniform_int_distribution<size_t> insertDis(0, availableForInsert.size() - 1);
+            size_t index = insertDis(gen);
+            int value = availableForInsert[index];
 
+            std::swap(availableForInsert[index], availableForInsert.back());
+            availableForInsert.pop_back();
+            availableForDelete.push_back(value);
 
-    {
-        const int N = 1'000'000, Q = 10'000'000;
-        std::vector<int> data(2 * N);
-        std::iota(data.begin(), data.end(), 1);
-        std::shuffle(data.begin(), data.end(), gen);
+            workload.operations.push_back({value, INSERT});
+        } else if (op == 2 && !availableForDelete.empty()) {
+            std::uniform_int_distribution<size_t> deleteDis(0, availableForDelete.size() - 1);
+            size_t index = deleteDis(gen);
+            int value = availableForDelete[index];
 
-        std::vector<int> preliminaryValues;
-        std::vector<Operation> operations;
-        for (int i = 0; i < N; i++) {
-            preliminaryValues.push_back(data[i]);
+            std::swap(availableForDelete[index], availableForDelete.back());
+            availableForDelete.pop_back();
+            availableForInsert.push_back(value);
+
+            workload.operations.push_back({value, REMOVE});
+        } else {
+            workload.operations.push_back({valueDis(gen), SEARCH});
         }
-        std::uniform_int_distribution<int> dis(1, 2 * N);
-        for (int i = 0; i < Q; i++) {
-            operations.push_back({dis(gen), SEARCH});
+    }
+    return workload;
+}
+
+// A 16-character id spelled from a scrambled value, so that keys spread
+// over the whole first byte range like hashes or UUIDs do.
+std::string randomId(int value) {
+    static const char DIGITS[] = "0123456789abcdefghijklmnopqrstuv";
+    uint64_t x = static_cast<uint64_t>(value) + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    std::string id(16, '0');
+    for (char& c : id) {
+        c = DIGITS[x & 31];
+        x >>= 4;
+    }
+    return id;
+}
+
+// Keys that all share their first eight bytes, where the inline prefix never
+// decides a comparison.
+std::string prefixedId(int value) {
+    char id[32];
+    std::snprintf(id, sizeof(id), "customer/%010d", value);
+    return id;
+}
+
+std::vector<BenchmarkCase> makeCases() {
+    std::vector<BenchmarkCase> cases;
+
+    cases.push_back({"uniform_search", "Search only with uniformly distributed queries", uniformSearchWorkload});
+
+    cases.push_back({"hot_keys", "Search only with hot keys", hotKeysWorkload});
+
+    cases.push_back({"hot_keys_sorted", "Search only with hot keys and sorted queries", [](size_t N, size_t Q, std::mt19937& gen) {
+        Workload workload = hotKeysWorkload(N, Q, gen);
+        std::sort(workload.operations.begin(), workload.operations.end(), [](Operation l, Operation r) { return l.value < r.value; });
+        return workload;
+    }});
+
+    cases.push_back({"mixed", "Mixed operations with uniform distribution", mixedWorkload});
+
+    cases.push_back({"string_uniform_search", "Search only over random string ids", [](size_t N, size_t Q, std::mt19937& gen) {
+        Workload workload = uniformSearchWorkload(N, Q, gen);
+        workload.stringKey = randomId;
+        return workload;
+    }});
+
+    cases.push_back({"string_shared_prefix_search", "Search only over string ids with a common 9-byte prefix", [](size_t N, size_t Q, std::mt19937& gen) {
+        Workload workload = uniformSearchWorkload(N, Q, gen);
+        workload.stringKey = prefixedId;
+        return workload;
+    }});
+
+    cases.push_back({"string_mixed", "Mixed operations over random string ids", [](size_t N, size_t Q, std::mt19937& gen) {
+        Workload workload = mixedWorkload(N, Q, gen);
+        workload.stringKey = randomId;
+        return workload;
+    }});
+
+    return cases;
+}
+
+// Usage: benchmark [--case NAME]... [--tree NAME]... [--keys N] [--ops Q]
+//                  [--warmup N] [--reps N] [--sample-every K]
+//                  [--format text|json|csv] [--output FILE] [--list] [--memory]
+// --case and --tree select by substring and may be repeated. --memory
+// reports the resident bytes per key of each subject holding --keys keys
+// instead of timing the cases. Tree subjects also report comparisons,
+// rotations and splay steps per operation and the scapegoat and BB-alpha
+// rebuilds, counted in one extra untimed pass.
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    try {
+        options = parseOptions(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    std::vector<BenchmarkCase> cases = makeCases();
+    std::vector<Subject> subjects = makeSubjects();
+
+    if (options.list) {
+        for (const auto& benchmarkCase : cases) {
+            std::cout << benchmarkCase.name << ": " << benchmarkCase.description << "\n";
         }
+        return 0;
+    }
 
-        std::cout << "Search only with uniformly distributed queries\n";
-        runOperations(preliminaryValues, operations);
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
     }
+    std::ostream& out = options.output.empty() ? std::cout : file;
+
+    if (options.memory) {
+        std::mt19937 gen;
+        std::vector<int> keys = shuffledKeys(options.keys, gen);
+        keys.resize(options.keys);
 
-    {
-        const int N = 1'000'000, Q = 10'000'000;
-        std::vector<int> data(2 * N);
-        std::iota(data.begin(), data.end(), 1);
-        std::shuffle(data.begin(), data.end(), gen);
-
-        std::vector<int> preliminaryValues(data.begin(), data.begin() + N);
-
-        const int HOT_KEYS_COUNT = 0.1 * N;
-        std::vector<int> hotKeys(preliminaryValues.begin(), preliminaryValues.begin() + HOT_KEYS_COUNT);
-        
-        std::vector<Operation> operations;
-        
-        std::uniform_int_distribution<int> hotKeysDis(0, HOT_KEYS_COUNT - 1);
-        for (int i = 0; i < Q * 0.9; i++) {
-            int hotKeyIndex = hotKeysDis(gen);
-            operations.push_back({hotKeys[hotKeyIndex], SEARCH});
+        if (options.format == "text") {
+            out << "Resident memory for " << options.keys << " keys\n";
+        } else if (options.format == "csv") {
+            writeMemoryCsvHeader(out);
         }
-        
-        std::uniform_int_distribution<int> anyKeyDis(1, 2 * N);
-        for (int i = 0; i < Q * 0.1; i++) {
-            operations.push_back({anyKeyDis(gen), SEARCH});
+
+        std::vector<MemorySummary> summaries;
+        for (const auto& subject : subjects) {
+            if (!selected(options.trees, subject.name) || !subject.build) {
+                continue;
+            }
+
+            MemorySummary summary = measureMemory(subject, keys);
+            if (options.format == "text") {
+                writeMemoryText(out, summary);
+            } else if (options.format == "csv") {
+                writeMemoryCsv(out, summary);
+            }
+            out.flush();
+            summaries.push_back(summary);
         }
-                
-        std::cout << "Search only with hot keys:\n";
-        runOperations(preliminaryValues, operations);
+
+        if (options.format == "json") {
+            writeMemoryJson(out, summaries);
+        }
+        return 0;
+    }
+
+    if (options.format == "csv") {
+        writeCsvHeader(out);
     }
 
-    {
-        const int N = 1'000'000, Q = 10'000'000;
-        std::vector<int> data(2 * N);
-        std::iota(data.begin(), data.end(), 1);
-        std::shuffle(data.begin(), data.end(), gen);
-
-        std::vector<int> preliminaryValues(data.begin(), data.begin() + N);
-        
-        const int HOT_KEYS_COUNT = 0.1 * N;
-        std::vector<int> hotKeys(preliminaryValues.begin(), preliminaryValues.begin() + HOT_KEYS_COUNT);
-        
-        std::vector<Operation> operations;
-        
-        std::uniform_int_distribution<int> hotKeysDis(0, HOT_KEYS_COUNT - 1);
-        for (int i = 0; i < Q * 0.9; i++) {
-            int hotKeyIndex = hotKeysDis(gen);
-            operations.push_back({hotKeys[hotKeyIndex], SEARCH});
+    std::vector<Summary> summaries;
+    for (const auto& benchmarkCase : cases) {
+        if (!selected(options.cases, benchmarkCase.name)) {
+            continue;
         }
-        
-        std::uniform_int_distribution<int> anyKeyDis(1, 2 * N);
-        for (int i = 0; i < Q * 0.1; i++) {
-            operations.push_back({anyKeyDis(gen), SEARCH});
+
+        std::mt19937 gen;
+        Workload workload = benchmarkCase.generate(options.keys, options.ops, gen);
+        bool writes = hasWrites(workload);
+        bool strings = static_cast<bool>(workload.stringKey);
+
+        if (options.format == "text") {
+            out << benchmarkCase.description << " [" << benchmarkCase.name << "]\n";
         }
-        
-        std::sort(operations.begin(), operations.end(), [](Operation l, Operation r) { return l.value < r.value; });
-        
-        std::cout << "Search only with hot keys and sorted queries:\n";
-        runOperations(preliminaryValues, operations);
-    }
 
-    {
-        const int N = 1'000'000, Q = 10'000'000;
-        std::vector<int> data(2 * N);
-        std::iota(data.begin(), data.end(), 1);
-        std::shuffle(data.begin(), data.end(), gen);
-    
-        std::vector<int> preliminaryValues(data.begin(), data.begin() + N);
-        
-        std::vector<int> availableForInsert(data.begin() + N, data.end());
-        std::vector<int> availableForDelete(preliminaryValues);
-        
-        std::vector<Operation> operations;
-        
-        std::uniform_int_distribution<int> operationDis(0, 2);
-                std::uniform_int_distribution<int> valueDis(1, 2 * N);
-        
-        for (int i = 0; i < Q; i++) {
-            int op = operationDis(gen);
-            
-            if (op == 0) {
-                if (!availableForInsert.empty()) {
-                    std::uniform_int_distribution<int> insertDis(0, availableForInsert.size() - 1);
-                    int index = insertDis(gen);
-                    int value = availableForInsert[index];
-                    
-                    std::swap(availableForInsert[index], availableForInsert.back());
-                    availableForInsert.pop_back();
-                    availableForDelete.push_back(value);
-                    
-                    operations.push_back({value, INSERT});
-                }
-                else {
-                    operations.push_back({valueDis(gen), SEARCH});
-                }
+        for (const auto& subject : subjects) {
+            if (!selected(options.trees, subject.name) || (subject.readOnly && writes) || subject.stringKeys != strings) {
+                continue;
             }
-            else if (op == 1) {
-                int value = valueDis(gen);
-                operations.push_back({value, SEARCH});
-            }
-            else {
-                if (!availableForDelete.empty()) {
-                    std::uniform_int_distribution<int> deleteDis(0, availableForDelete.size() - 1);
-                    int index = deleteDis(gen);
-                    int value = availableForDelete[index];
-                    
-                    std::swap(availableForDelete[index], availableForDelete.back());
-                    availableForDelete.pop_back();
-                    availableForInsert.push_back(value);
-                    
-                    operations.push_back({value, REMOVE});
-                }
-                else {
-                    operations.push_back({valueDis(gen), SEARCH});
-                }
+
+            Summary summary = measure(benchmarkCase, workload, subject, options);
+            if (options.format == "text") {
+                writeText(out, summary);
+            } else if (options.format == "csv") {
+                writeCsv(out, summary);
             }
+            out.flush();
+            summaries.push_back(summary);
         }
-        
-        std::cout << "Mixed operations with uniform distribution:\n";
-        runOperations(preliminaryValues, operations);
+
+        if (options.format == "text") {
+            out << "\n";
+        }
+    }
+
+    if (options.format == "json") {
+        writeJson(out, summaries);
     }
 
     return 0;
@@ -0,0 +1,621 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "trees/instrumentation.hpp"
+
+enum EType {
+    INSERT,
+    REMOVE,
+    SEARCH
+};
+
+struct Operation {
+    int value;
+    EType type;
+};
+
+// The same operation on a key of another type.
+template <typename Key>
+struct KeyedOperation {
+    Key value;
+    EType type;
+};
+
+// stringKey, when set, makes this a string workload: every int value stands
+// for the string it maps to, and only string subjects run it.
+struct Workload {
+    std::vector<int> preliminaryValues;
+    std::vector<Operation> operations;
+    std::function<std::string(int)> stringKey;
+};
+
+struct BenchmarkCase {
+    std::string name;
+    std::string description;
+    std::function<Workload(size_t keys, size_t ops, std::mt19937& gen)> generate;
+};
+
+struct BenchmarkOptions {
+    std::vector<std::string> cases;
+    std::vector<std::string> trees;
+    size_t keys = 1'000'000;
+    size_t ops = 10'000'000;
+    int warmup = 1;
+    int repetitions = 5;
+    size_t sampleEvery = 64;
+    std::string format = "text";
+    std::string output;
+    bool list = false;
+    bool memory = false;
+};
+
+// One timed pass over a workload.
+struct RunResult {
+    double operationsNs = 0;
+    double teardownNs = 0;
+    std::vector<uint64_t> latencySamplesNs;
+};
+
+struct Summary {
+    std::string caseName;
+    std::string subject;
+    std::string allocator;
+    size_t operations = 0;
+    int repetitions = 0;
+    double meanMs = 0;
+    double stddevMs = 0;
+    double nsPerOp = 0;
+    double teardownMs = 0;
+    uint64_t p50Ns = 0;
+    uint64_t p99Ns = 0;
+    uint64_t p999Ns = 0;
+    uint64_t maxNs = 0;
+    // Event counts over one untimed pass, for subjects that can count.
+    std::optional<InstrumentationCounters> counters;
+};
+
+// Something the harness can time: a tree configuration under a given
+// allocator. run() builds a fresh instance, loads the preliminary values and
+// times the operations. Read-only subjects are skipped on workloads that
+// insert or remove. build(), when set, constructs the same structure over
+// the given keys and keeps it alive for as long as the result is held, for
+// memory measurements. count(), when set, replays the workload once more on
+// a copy of the tree built with CountingInstrumentation, so the timed runs
+// never pay for the counters. String subjects run the string workloads and
+// nothing else.
+struct Subject {
+    std::string name;
+    std::string allocator;
+    std::function<RunResult(const Workload&, size_t sampleEvery)> run;
+    bool readOnly = false;
+    std::function<std::shared_ptr<void>(const std::vector<int>& keys)> build;
+    std::function<InstrumentationCounters(const Workload&)> count;
+    bool stringKeys = false;
+};
+
+// Tree with CountingInstrumentation in place of its own policy.
+template <typename Tree>
+struct CountedTree;
+
+template <template <typename, typename, typename> class Tree, typename T, typename Allocator, typename Instrumentation>
+struct CountedTree<Tree<T, Allocator, Instrumentation>> {
+    using type = Tree<T, Allocator, CountingInstrumentation>;
+};
+
+struct MemorySummary {
+    std::string subject;
+    std::string allocator;
+    size_t keys = 0;
+    size_t bytes = 0;
+    double bytesPerKey = 0;
+};
+
+template <typename Tree, typename Op>
+inline void applyOperation(Tree& tree, const Op& op) {
+    switch (op.type) {
+        case EType::INSERT:
+            tree.insert(op.value);
+            break;
+        case EType::REMOVE:
+            tree.remove(op.value);
+            break;
+        case EType::SEARCH:
+            volatile bool found = tree.search(op.value);
+            (void)found;
+            break;
+    }
+}
+
+inline bool hasWrites(const Workload& workload) {
+    return std::any_of(workload.operations.begin(), workload.operations.end(), [](const Operation& op) {
+        return op.type != EType::SEARCH;
+    });
+}
+
+// Times every operation in bulk and, for every sampleEvery-th one, also on its
+// own. The per-op samples add one clock read pair per sample, which at the
+// default rate is well under a percent of the total. The structure is
+// destroyed by teardown(), which is timed separately.
+template <typename Op, typename Apply, typename Teardown>
+RunResult timeOperations(const std::vector<Op>& operations, size_t sampleEvery, Apply apply, Teardown teardown) {
+    using Clock = std::chrono::steady_clock;
+
+    RunResult result;
+    result.latencySamplesNs.reserve(operations.size() / sampleEvery + 1);
+
+    auto start = Clock::now();
+    for (size_t i = 0; i < operations.size(); i++) {
+        if (i % sampleEvery == 0) {
+            auto before = Clock::now();
+            apply(operations[i]);
+            auto after = Clock::now();
+            result.latencySamplesNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+        } else {
+            apply(operations[i]);
+        }
+    }
+    auto end = Clock::now();
+    teardown();
+    auto destroyed = Clock::now();
+
+    result.operationsNs = std::chrono::duration<double, std::nano>(end - start).count();
+    result.teardownNs = std::chrono::duration<double, std::nano>(destroyed - end).count();
+    return result;
+}
+
+template <typename Tree, typename... Args>
+RunResult runWorkload(const Workload& workload, size_t sampleEvery, Args... args) {
+    auto tree = std::make_unique<Tree>(args...);
+    tree->bulkLoad(workload.preliminaryValues.begin(), workload.preliminaryValues.end());
+
+    return timeOperations(workload.operations, sampleEvery,
+        [&](const Operation& op) { applyOperation(*tree, op); },
+        [&]() { tree.reset(); });
+}
+
+template <typename Tree, typename... Args>
+InstrumentationCounters countWorkload(const Workload& workload, Args... args) {
+    auto tree = std::make_unique<typename CountedTree<Tree>::type>(args...);
+    tree->bulkLoad(workload.preliminaryValues.begin(), workload.preliminaryValues.end());
+    for (const Operation& op : workload.operations) {
+        applyOperation(*tree, op);
+    }
+    return tree->instrumentation().counters();
+}
+
+// Loads a tree, freezes it and runs the searches against the snapshot only;
+// the tree itself is gone before the clock starts.
+template <typename Tree, typename Layout, typename... Args>
+RunResult runFrozenWorkload(const Workload& workload, size_t sampleEvery, Layout layout, Args... args) {
+    auto tree = std::make_unique<Tree>(args...);
+    tree->bulkLoad(workload.preliminaryValues.begin(), workload.preliminaryValues.end());
+    auto frozen = std::make_unique<decltype(tree->freeze(layout))>(tree->freeze(layout));
+    tree.reset();
+
+    return timeOperations(workload.operations, sampleEvery,
+        [&](const Operation& op) {
+            volatile bool found = frozen->search(op.value);
+            (void)found;
+        },
+        [&]() { frozen.reset(); });
+}
+
+// Keys are inserted one at a time so that nodes end up as full as they are
+// in a tree that has been serving writes, not as packed as after bulkLoad.
+template <typename Tree, typename... Args>
+Subject makeSubject(const std::string& name, const std::string& allocator, Args... args) {
+    return {name, allocator, [=](const Workload& workload, size_t sampleEvery) {
+        return runWorkload<Tree>(workload, sampleEvery, args...);
+    }, false, [=](const std::vector<int>& keys) {
+        auto tree = std::make_shared<Tree>(args...);
+        for (int key : keys) {
+            tree->insert(key);
+        }
+        return std::shared_ptr<void>(tree);
+    }, [=](const Workload& workload) {
+        return countWorkload<Tree>(workload, args...);
+    }};
+}
+
+// The string form of a workload, converted before the clock starts so that
+// formatting the keys is not timed.
+template <typename Key>
+struct StringWorkload {
+    std::vector<Key> preliminaryValues;
+    std::vector<KeyedOperation<Key>> operations;
+
+    explicit StringWorkload(const Workload& workload) {
+        preliminaryValues.reserve(workload.preliminaryValues.size());
+        for (int value : workload.preliminaryValues) {
+            preliminaryValues.push_back(Key(workload.stringKey(value)));
+        }
+        operations.reserve(workload.operations.size());
+        for (const Operation& op : workload.operations) {
+            operations.push_back({Key(workload.stringKey(op.value)), op.type});
+        }
+    }
+};
+
+// A tree over std::string or StringKey, for the string workloads.
+template <typename Tree, typename... Args>
+Subject makeStringSubject(const std::string& name, const std::string& allocator, Args... args) {
+    using Key = typename Tree::value_type;
+
+    Subject subject{name, allocator, [=](const Workload& workload, size_t sampleEvery) {
+        StringWorkload<Key> keyed(workload);
+        auto tree = std::make_unique<Tree>(args...);
+        tree->bulkLoad(keyed.preliminaryValues.begin(), keyed.preliminaryValues.end());
+
+        return timeOperations(keyed.operations, sampleEvery,
+            [&](const KeyedOperation<Key>& op) { applyOperation(*tree, op); },
+            [&]() { tree.reset(); });
+    }, false, nullptr, [=](const Workload& workload) {
+        StringWorkload<Key> keyed(workload);
+        auto tree = std::make_unique<typename CountedTree<Tree>::type>(args...);
+        tree->bulkLoad(keyed.preliminaryValues.begin(), keyed.preliminaryValues.end());
+        for (const KeyedOperation<Key>& op : keyed.operations) {
+            applyOperation(*tree, op);
+        }
+        return tree->instrumentation().counters();
+    }};
+    subject.stringKeys = true;
+    return subject;
+}
+
+// Keys per searchBatch call in the batched subjects.
+constexpr size_t BENCHMARK_BATCH_SIZE = 256;
+
+// Like timeOperations for search-only workloads, but hands the keys to
+// searchBatch(keys, out) in chunks. Every chunk is sampled, as its mean
+// per-key latency, since one chunk already amortizes the clock reads.
+template <typename SearchBatch, typename Teardown>
+RunResult timeBatches(const Workload& workload, SearchBatch searchBatch, Teardown teardown) {
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<int> keys;
+    keys.reserve(workload.operations.size());
+    for (const Operation& op : workload.operations) {
+        keys.push_back(op.value);
+    }
+    std::unique_ptr<bool[]> found(new bool[BENCHMARK_BATCH_SIZE]);
+
+    RunResult result;
+    result.latencySamplesNs.reserve(keys.size() / BENCHMARK_BATCH_SIZE + 1);
+
+    auto start = Clock::now();
+    for (size_t first = 0; first < keys.size(); first += BENCHMARK_BATCH_SIZE) {
+        size_t count = std::min(BENCHMARK_BATCH_SIZE, keys.size() - first);
+        auto before = Clock::now();
+        searchBatch(std::span<const int>(keys.data() + first, count), std::span<bool>(found.get(), count));
+        auto after = Clock::now();
+        result.latencySamplesNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count() / count);
+    }
+    auto end = Clock::now();
+    teardown();
+    auto destroyed = Clock::now();
+
+    result.operationsNs = std::chrono::duration<double, std::nano>(end - start).count();
+    result.teardownNs = std::chrono::duration<double, std::nano>(destroyed - end).count();
+    return result;
+}
+
+template <typename Tree, typename... Args>
+Subject makeBatchSubject(const std::string& name, const std::string& allocator, Args... args) {
+    return {name, allocator, [=](const Workload& workload, size_t) {
+        auto tree = std::make_unique<Tree>(args...);
+        tree->bulkLoad(workload.preliminaryValues.begin(), workload.preliminaryValues.end());
+        return timeBatches(workload,
+            [&](std::span<const int> keys, std::span<bool> out) { tree->searchBatch(keys, out); },
+            [&]() { tree.reset(); });
+    }, true, nullptr, [=](const Workload& workload) {
+        auto tree = std::make_unique<typename CountedTree<Tree>::type>(args...);
+        tree->bulkLoad(workload.preliminaryValues.begin(), workload.preliminaryValues.end());
+        timeBatches(workload,
+            [&](std::span<const int> keys, std::span<bool> out) { tree->searchBatch(keys, out); },
+            [&]() {});
+        return tree->instrumentation().counters();
+    }};
+}
+
+template <typename Tree, typename Layout>
+Subject makeFrozenBatchSubject(const std::string& name, Layout layout) {
+    return {name, "array", [=](const Workload& workload, size_t) {
+        auto tree = std::make_unique<Tree>();
+        tree->bulkLoad(workload.preliminaryValues.begin(), workload.preliminaryValues.end());
+        auto frozen = std::make_unique<decltype(tree->freeze(layout))>(tree->freeze(layout));
+        tree.reset();
+        return timeBatches(workload,
+            [&](std::span<const int> keys, std::span<bool> out) { frozen->searchBatch(keys, out); },
+            [&]() { frozen.reset(); });
+    }, true};
+}
+
+template <typename Tree, typename Layout, typename... Args>
+Subject makeFrozenSubject(const std::string& name, Layout layout, Args... args) {
+    return {name, "array", [=](const Workload& workload, size_t sampleEvery) {
+        return runFrozenWorkload<Tree>(workload, sampleEvery, layout, args...);
+    }, true, [=](const std::vector<int>& keys) {
+        // Built straight from the keys: a source tree freed first would
+        // leave its pages resident and be counted.
+        using Frozen = decltype(std::declval<Tree&>().freeze(layout));
+        std::vector<int> sorted(keys);
+        std::sort(sorted.begin(), sorted.end());
+        return std::shared_ptr<void>(std::make_shared<Frozen>(sorted, layout));
+    }};
+}
+
+// Resident set size of this process in bytes.
+inline size_t residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Growth of the resident set while subject.build(keys) runs and its result
+// is alive. Each measurement happens in a forked child, so memory that an
+// earlier subject returned to a free list or kept in a pool cannot be reused
+// and hide part of the cost. Allocator headers and padding count, which is
+// the point: they are what the tree costs on a real box.
+inline MemorySummary measureMemory(const Subject& subject, const std::vector<int>& keys) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::runtime_error("pipe failed");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("fork failed");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        size_t before = residentBytes();
+        std::shared_ptr<void> structure = subject.build(keys);
+        size_t grown = residentBytes() - before;
+        ssize_t written = write(fds[1], &grown, sizeof(grown));
+        _exit(written == sizeof(grown) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    size_t bytes = 0;
+    ssize_t received = read(fds[0], &bytes, sizeof(bytes));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (received != sizeof(bytes) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error("Memory measurement failed for " + subject.name);
+    }
+
+    MemorySummary summary;
+    summary.subject = subject.name;
+    summary.allocator = subject.allocator;
+    summary.keys = keys.size();
+    summary.bytes = bytes;
+    summary.bytesPerKey = keys.empty() ? 0 : static_cast<double>(bytes) / keys.size();
+    return summary;
+}
+
+inline uint64_t percentile(const std::vector<uint64_t>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, index == 0 ? 0 : index - 1)];
+}
+
+inline Summary measure(const BenchmarkCase& benchmarkCase, const Workload& workload, const Subject& subject, const BenchmarkOptions& options) {
+    for (int i = 0; i < options.warmup; i++) {
+        subject.run(workload, options.sampleEvery);
+    }
+
+    std::vector<double> runsMs;
+    std::vector<uint64_t> samples;
+    double teardownMs = 0;
+    for (int i = 0; i < options.repetitions; i++) {
+        RunResult run = subject.run(workload, options.sampleEvery);
+        runsMs.push_back(run.operationsNs / 1e6);
+        teardownMs += run.teardownNs / 1e6;
+        samples.insert(samples.end(), run.latencySamplesNs.begin(), run.latencySamplesNs.end());
+    }
+    std::sort(samples.begin(), samples.end());
+
+    Summary summary;
+    summary.caseName = benchmarkCase.name;
+    summary.subject = subject.name;
+    summary.allocator = subject.allocator;
+    summary.operations = workload.operations.size();
+    summary.repetitions = options.repetitions;
+
+    double sum = 0;
+    for (double ms : runsMs) {
+        sum += ms;
+    }
+    summary.meanMs = sum / runsMs.size();
+
+    double squares = 0;
+    for (double ms : runsMs) {
+        squares += (ms - summary.meanMs) * (ms - summary.meanMs);
+    }
+    summary.stddevMs = runsMs.size() > 1 ? std::sqrt(squares / (runsMs.size() - 1)) : 0;
+    summary.nsPerOp = workload.operations.empty() ? 0 : summary.meanMs * 1e6 / workload.operations.size();
+    summary.teardownMs = teardownMs / options.repetitions;
+
+    summary.p50Ns = percentile(samples, 0.5);
+    summary.p99Ns = percentile(samples, 0.99);
+    summary.p999Ns = percentile(samples, 0.999);
+    summary.maxNs = samples.empty() ? 0 : samples.back();
+
+    if (subject.count) {
+        summary.counters = subject.count(workload);
+    }
+    return summary;
+}
+
+inline BenchmarkOptions parseOptions(int argc, char** argv) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value for " + arg);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--case") {
+            options.cases.push_back(value());
+        } else if (arg == "--tree") {
+            options.trees.push_back(value());
+        } else if (arg == "--keys") {
+            options.keys = std::stoul(value());
+        } else if (arg == "--ops") {
+            options.ops = std::stoul(value());
+        } else if (arg == "--warmup") {
+            options.warmup = std::stoi(value());
+        } else if (arg == "--reps") {
+            options.repetitions = std::max(1, std::stoi(value()));
+        } else if (arg == "--sample-every") {
+            options.sampleEvery = std::max<size_t>(1, std::stoul(value()));
+        } else if (arg == "--format") {
+            options.format = value();
+            if (options.format != "text" && options.format != "json" && options.format != "csv") {
+                throw std::invalid_argument("Unsupported format: " + options.format);
+            }
+        } else if (arg == "--output") {
+            options.output = value();
+        } else if (arg == "--list") {
+            options.list = true;
+        } else if (arg == "--memory") {
+            options.memory = true;
+        } else {
+            throw std::invalid_argument("Unknown option: " + arg);
+        }
+    }
+    return options;
+}
+
+inline bool selected(const std::vector<std::string>& filters, const std::string& name) {
+    if (filters.empty()) {
+        return true;
+    }
+    return std::any_of(filters.begin(), filters.end(), [&](const std::string& filter) {
+        return name.find(filter) != std::string::npos;
+    });
+}
+
+inline std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+inline void writeText(std::ostream& out, const Summary& s) {
+    out << std::fixed << std::setprecision(1)
+        << "  " << std::left << std::setw(42) << s.subject << std::setw(6) << s.allocator << std::right
+        << std::setw(10) << s.meanMs << " ms +- " << std::setw(7) << s.stddevMs << " ms"
+        << std::setw(9) << s.nsPerOp << " ns/op"
+        << "  p50 " << s.p50Ns << "  p99 " << s.p99Ns << "  p99.9 " << s.p999Ns << "  max " << s.maxNs << " ns"
+        << "  teardown " << s.teardownMs << " ms";
+    if (s.counters) {
+        const InstrumentationCounters& c = *s.counters;
+        double ops = std::max<size_t>(1, s.operations);
+        out << std::setprecision(2)
+            << "  cmp/op " << c.comparisons / ops << "  rot/op " << c.rotations / ops
+            << "  splay/op " << c.splaySteps / ops << "  rebuilds " << c.rebuilds;
+        if (c.rebuilds > 0) {
+            out << " (avg " << static_cast<double>(c.rebuiltNodes) / c.rebuilds << ", max " << c.largestRebuild << " nodes)";
+        }
+    }
+    out << "\n";
+}
+
+inline void writeCsvHeader(std::ostream& out) {
+    out << "case,subject,allocator,operations,repetitions,mean_ms,stddev_ms,ns_per_op,p50_ns,p99_ns,p999_ns,max_ns,teardown_ms,"
+        << "comparisons,rotations,splay_steps,rebuilds,rebuilt_nodes,largest_rebuild\n";
+}
+
+inline void writeCsv(std::ostream& out, const Summary& s) {
+    out << s.caseName << ",\"" << s.subject << "\"," << s.allocator << "," << s.operations << "," << s.repetitions << ","
+        << s.meanMs << "," << s.stddevMs << "," << s.nsPerOp << ","
+        << s.p50Ns << "," << s.p99Ns << "," << s.p999Ns << "," << s.maxNs << "," << s.teardownMs;
+    if (s.counters) {
+        const InstrumentationCounters& c = *s.counters;
+        out << "," << c.comparisons << "," << c.rotations << "," << c.splaySteps << ","
+            << c.rebuilds << "," << c.rebuiltNodes << "," << c.largestRebuild << "\n";
+    } else {
+        out << ",,,,,,\n";
+    }
+}
+
+inline void writeJson(std::ostream& out, const std::vector<Summary>& summaries) {
+    out << "[\n";
+    for (size_t i = 0; i < summaries.size(); i++) {
+        const Summary& s = summaries[i];
+        out << "  {\"case\": \"" << jsonEscape(s.caseName) << "\", \"subject\": \"" << jsonEscape(s.subject)
+            << "\", \"allocator\": \"" << s.allocator << "\", \"operations\": " << s.operations
+            << ", \"repetitions\": " << s.repetitions << ", \"mean_ms\": " << s.meanMs
+            << ", \"stddev_ms\": " << s.stddevMs << ", \"ns_per_op\": " << s.nsPerOp
+            << ", \"p50_ns\": " << s.p50Ns << ", \"p99_ns\": " << s.p99Ns << ", \"p999_ns\": " << s.p999Ns
+            << ", \"max_ns\": " << s.maxNs << ", \"teardown_ms\": " << s.teardownMs << ", \"counters\": ";
+        if (s.counters) {
+            const InstrumentationCounters& c = *s.counters;
+            out << "{\"comparisons\": " << c.comparisons << ", \"rotations\": " << c.rotations
+                << ", \"splay_steps\": " << c.splaySteps << ", \"rebuilds\": " << c.rebuilds
+                << ", \"rebuilt_nodes\": " << c.rebuiltNodes << ", \"largest_rebuild\": " << c.largestRebuild << "}";
+        } else {
+            out << "null";
+        }
+        out << "}" << (i + 1 < summaries.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
+
+inline void writeMemoryText(std::ostream& out, const MemorySummary& s) {
+    out << std::fixed << std::setprecision(1)
+        << "  " << std::left << std::setw(42) << s.subject << std::setw(8) << s.allocator << std::right
+        << std::setw(12) << s.bytes << " bytes" << std::setw(9) << s.bytesPerKey << " bytes/key\n";
+}
+
+inline void writeMemoryCsvHeader(std::ostream& out) {
+    out << "subject,allocator,keys,bytes,bytes_per_key\n";
+}
+
+inline void writeMemoryCsv(std::ostream& out, const MemorySummary& s) {
+    out << "\"" << s.subject << "\"," << s.allocator << "," << s.keys << "," << s.bytes << "," << s.bytesPerKey << "\n";
+}
+
+inline void writeMemoryJson(std::ostream& out, const std::vector<MemorySummary>& summaries) {
+    out << "[\n";
+    for (size_t i = 0; i < summaries.size(); i++) {
+        const MemorySummary& s = summaries[i];
+        out << "  {\"subject\": \"" << jsonEscape(s.subject) << "\", \"allocator\": \"" << s.allocator
+            << "\", \"keys\": " << s.keys << ", \"bytes\": " << s.bytes << ", \"bytes_per_key\": " << s.bytesPerKey << "}"
+            << (i + 1 < summaries.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tree_service.h"
+
+// Read throughput of TreeManager under concurrent searches. Every search goes
+// through getTree and the per-tree lock exactly like the HTTP handlers do, so
+// shared-lock trees should scale with threads while the splay tree, whose
+// searches need the exclusive lock, should not. Splay policies that leave
+// most hits in place answer those under the shared lock.
+
+double measureSearchThroughput(TreeManager& treeManager, const std::string& id, unsigned threads, int searchesPerThread, int keyRange) {
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            std::mt19937 gen(t + 1);
+            std::uniform_int_distribution<int> dis(1, keyRange);
+            for (int i = 0; i < searchesPerThread; i++) {
+                std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+                volatile bool found = static_cast<KeyedTreeWrapper<int>&>(*tree).search(dis(gen));
+                (void)found;
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return threads * static_cast<double>(searchesPerThread) / seconds / 1e6;
+}
+
+int main() {
+    const int N = 1'000'000, SEARCHES_PER_THREAD = 2'000'000;
+
+    std::vector<int> values(N);
+    std::iota(values.begin(), values.end(), 1);
+
+    std::vector<unsigned> threadCounts;
+    unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threads = 1; threads < maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(maxThreads);
+
+    TreeManager treeManager;
+
+    std::cout << "Concurrent searches, million ops/s by thread count\n";
+    std::vector<std::pair<std::string, std::string>> subjects = {
+        {"avl", ""}, {"btree", ""}, {"red_black", ""}, {"parent_free_red_black", ""}, {"bb_alpha", ""}, {"scapegoat", ""},
+        {"splay", ""}, {"splay", "semi"}, {"splay", "probabilistic:0.05"}, {"splay", "depth:32"}, {"splay", "periodic:32"},
+        {"top_down_splay", ""}
+    };
+    for (const auto& [type, splayPolicy] : subjects) {
+        std::string id = treeManager.createTree(type, "pointer", "int", false, splayPolicy);
+        static_cast<KeyedTreeWrapper<int>&>(*treeManager.getTree(id)).bulkLoad(values);
+
+        std::cout << type << (splayPolicy.empty() ? "" : " " + splayPolicy) << ":";
+        for (unsigned threads : threadCounts) {
+            std::cout << "  " << threads << "t="
+                      << measureSearchThroughput(treeManager, id, threads, SEARCHES_PER_THREAD, 2 * N);
+        }
+        std::cout << "\n";
+
+        treeManager.removeTree(id);
+    }
+
+    return 0;
+}
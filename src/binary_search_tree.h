@@ -1,16 +1,178 @@
 #pragma once
 
 #include "tree_visitor.h"
+#include "trees/frozen_tree.hpp"
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <span>
 #include <string>
+#include <vector>
 
-template <typename T>
+enum class SetOperation {
+    UNION,
+    INTERSECTION,
+    DIFFERENCE
+};
+
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
 class BinarySearchTree {
 public:
+    using value_type = T;
+    using allocator_type = Allocator;
+    using instrumentation_type = Instrumentation;
+
     virtual ~BinarySearchTree() = default;
 
     virtual bool search(const T& value) = 0;
     virtual void insert(const T &value) = 0;
     virtual void remove(const T& value) = 0;
+    // Whether insert adds another copy of a key that is already there.
+    // bulkLoad follows the same rule.
+    virtual bool keepsDuplicates() const = 0;
+
+    // The stored key equal to value, or nullptr. Keys that carry a payload,
+    // such as the entries of a TreeMap, compare by their key part only, and
+    // this is how the payload is read. The pointer is good until the next
+    // call on the tree.
+    virtual const T* find(const T& value) = 0;
+    // Overwrites the stored key equal to value with value and returns true,
+    // or returns false if there is none. The two compare equal, so the shape
+    // of the tree does not change.
+    virtual bool assign(const T& value) = 0;
+
+    // Looks up keys[i] into out[i] for every key; out must be at least as
+    // long as keys. Trees override this to overlap the cache misses of the
+    // independent lookups. Trees whose searches restructure them keep this
+    // loop so a batch behaves exactly like the same searches one by one.
+    virtual void searchBatch(std::span<const T> keys, std::span<bool> out) {
+        for (size_t i = 0; i < keys.size(); i++) {
+            out[i] = search(keys[i]);
+        }
+    }
+
+    // Number of keys strictly less than value.
+    virtual size_t rank(const T& value) = 0;
+    // The k-th smallest key, counting from zero. Throws std::out_of_range
+    // when k is not less than the number of keys.
+    virtual T select(size_t k) = 0;
+    // Number of keys in the closed range [lo, hi].
+    virtual size_t countRange(const T& lo, const T& hi) = 0;
+
+    // Number of keys, in O(1).
+    virtual size_t size() const = 0;
+    // Bytes of node memory the tree holds.
+    virtual size_t bytesAllocated() const = 0;
+    // Number of nodes a search for value visits. Unlike search() it never
+    // restructures the tree, so it can measure a splay tree too.
+    virtual size_t searchDepth(const T& value) const = 0;
+
+    // How many times the tree or one of its subtrees was rebuilt from its
+    // sorted keys: by bulkLoad, by combine, or to restore balance.
+    size_t rebuilds() const {
+        return rebuilds_;
+    }
+
+    // Event counts when Instrumentation is a counting policy; see
+    // trees/instrumentation.hpp.
+    const Instrumentation& instrumentation() const {
+        return instrumentation_;
+    }
+
+    // Adds every value in [first, last) in O(n) when the input is sorted, or
+    // O(n log n) for the initial sort otherwise, with the same result as
+    // inserting them one by one: a tree that keeps duplicates keeps every
+    // copy, old and new, and any other tree ends up with each key once. Keys
+    // already in the tree are kept as they are. The tree is rebuilt into a
+    // perfectly balanced shape.
+    template <typename InputIt>
+    void bulkLoad(InputIt first, InputIt last) {
+        std::vector<T> values(first, last);
+        if (!std::is_sorted(values.begin(), values.end())) {
+            std::sort(values.begin(), values.end());
+        }
+        if (!keepsDuplicates()) {
+            values.erase(std::unique(values.begin(), values.end()), values.end());
+        }
+
+        std::vector<T> existing;
+        appendKeys(existing);
+        if (!existing.empty()) {
+            std::vector<T> merged;
+            merged.reserve(existing.size() + values.size());
+            if (keepsDuplicates()) {
+                std::merge(existing.begin(), existing.end(), values.begin(), values.end(), std::back_inserter(merged));
+            } else {
+                std::set_union(existing.begin(), existing.end(), values.begin(), values.end(), std::back_inserter(merged));
+            }
+            values = std::move(merged);
+        }
+
+        rebuilds_++;
+        buildFromSorted(values);
+    }
+
+    // Copies the keys into an immutable snapshot for read-only phases. The
+    // snapshot never touches the tree's nodes and does not see later changes.
+    FrozenTree<T> freeze(FrozenLayout layout = FrozenLayout::EYTZINGER) const {
+        std::vector<T> keys;
+        appendKeys(keys);
+        return FrozenTree<T>(keys, layout);
+    }
+
+    // Replaces the keys with their union, intersection or difference with
+    // other's keys. other is left unchanged and may be this tree. The default
+    // merges the two sorted key lists in O(n + m) and rebuilds; trees that
+    // can split and join override it for another tree of their own type.
+    virtual void combine(SetOperation op, const BinarySearchTree& other) {
+        std::vector<T> keys;
+        other.appendKeys(keys);
+        combineSorted(op, keys);
+    }
+
+    // combine with the other operand given as strictly increasing keys.
+    void combineSorted(SetOperation op, const std::vector<T>& keys) {
+        std::vector<T> existing;
+        appendKeys(existing);
+
+        std::vector<T> result;
+        switch (op) {
+            case SetOperation::UNION:
+                result.reserve(existing.size() + keys.size());
+                std::set_union(existing.begin(), existing.end(), keys.begin(), keys.end(), std::back_inserter(result));
+                break;
+            case SetOperation::INTERSECTION:
+                std::set_intersection(existing.begin(), existing.end(), keys.begin(), keys.end(), std::back_inserter(result));
+                break;
+            case SetOperation::DIFFERENCE:
+                std::set_difference(existing.begin(), existing.end(), keys.begin(), keys.end(), std::back_inserter(result));
+                break;
+        }
+        rebuilds_++;
+        buildFromSorted(result);
+    }
+
+    void unionWith(const BinarySearchTree& other) {
+        combine(SetOperation::UNION, other);
+    }
+
+    void intersectWith(const BinarySearchTree& other) {
+        combine(SetOperation::INTERSECTION, other);
+    }
+
+    void differenceWith(const BinarySearchTree& other) {
+        combine(SetOperation::DIFFERENCE, other);
+    }
+
+    virtual void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const = 0;
+
+protected:
+    size_t rebuilds_ = 0;
+    [[no_unique_address]] Instrumentation instrumentation_;
+
+    // Appends the keys in sorted order.
+    virtual void appendKeys(std::vector<T>& out) const = 0;
 
-    virtual void accept(TreeVisitor<T>& visitor) const = 0;
+    // Replaces the contents with a balanced tree over strictly increasing values.
+    virtual void buildFromSorted(const std::vector<T>& values) = 0;
 };
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+
+// Compact node storage. Every node of a given type lives in one contiguous
+// region and nodes link to each other through 32-bit slot indices instead of
+// 64-bit pointers. The region is reserved once as address space and only the
+// pages that hold nodes are ever committed, so nodes never move and a slot
+// index converts to an address with one add.
+//
+// Trees opt in by being instantiated with CompactAllocator; NodeStorage then
+// gives them CompactLink for their child links and a 32-bit subtree size
+// whose spare bits hold the balance factor or colour. The tree algorithms
+// themselves are the same, since a link converts to and from Node*.
+
+// Address space reserved per node type. Only touched pages cost memory.
+#ifndef COMPACT_ARENA_BYTES
+#define COMPACT_ARENA_BYTES (size_t(64) << 30)
+#endif
+
+// Slots for one node type, shared by every tree that uses it. Slot 0 is never
+// handed out so that index 0 can mean null. Freed slots are recycled through
+// an intrusive free list. Once every slot is free again the arena starts over
+// from the front and hands its pages back, so a tree rebuilt after the last
+// one was destroyed is laid out in allocation order rather than in the
+// reverse of the order the old nodes were freed.
+template <typename Node>
+class CompactArena {
+public:
+    // Never destroyed, so trees that outlive static destruction at exit
+    // can still free into it.
+    static CompactArena& instance() {
+        static CompactArena* arena = new CompactArena();
+        return *arena;
+    }
+
+    static Node* address(uint32_t index) {
+        return index == 0 ? nullptr : base_ + index;
+    }
+
+    static uint32_t indexOf(const Node* node) {
+        return node == nullptr ? 0 : static_cast<uint32_t>(node - base_);
+    }
+
+    Node* allocate() {
+        std::lock_guard lock(mutex_);
+        uint32_t index;
+        if (free_list_ != 0) {
+            index = free_list_;
+            free_list_ = *reinterpret_cast<uint32_t*>(base_ + index);
+        } else {
+            if (next_ == capacity_) {
+                throw std::bad_alloc();
+            }
+            index = next_++;
+        }
+        live_++;
+        return base_ + index;
+    }
+
+    void deallocate(Node* node) {
+        std::lock_guard lock(mutex_);
+        *reinterpret_cast<uint32_t*>(node) = free_list_;
+        free_list_ = indexOf(node);
+        if (--live_ == 0) {
+            madvise(base_, next_ * sizeof(Node), MADV_DONTNEED);
+            next_ = 1;
+            free_list_ = 0;
+        }
+    }
+
+    // Bytes of slots handed out since the arena was last empty, including
+    // ones now on the free list.
+    size_t bytesUsed() const {
+        std::lock_guard lock(mutex_);
+        return next_ * sizeof(Node);
+    }
+
+private:
+    static_assert(sizeof(Node) >= sizeof(uint32_t), "A free slot stores the next free index");
+
+    static inline Node* base_ = nullptr;
+
+    mutable std::mutex mutex_;
+    size_t capacity_;
+    uint32_t next_ = 1;
+    uint32_t free_list_ = 0;
+    uint32_t live_ = 0;
+
+    CompactArena() : capacity_(std::min<size_t>(UINT32_MAX, COMPACT_ARENA_BYTES / sizeof(Node))) {
+        void* region = mmap(nullptr, capacity_ * sizeof(Node), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        base_ = static_cast<Node*>(region);
+    }
+};
+
+// A 32-bit link to a node in its CompactArena. It converts implicitly to and
+// from Node*, so code written against raw pointers works on it unchanged,
+// including comparisons with nullptr. Descents should pick the link before
+// following it (less ? node->left : node->right): the choice then compiles
+// to a conditional move on the index, where converting in each branch arm
+// leaves an unpredictable branch per level.
+template <typename Node>
+class CompactLink {
+public:
+    CompactLink() = default;
+    CompactLink(std::nullptr_t) {}
+    CompactLink(Node* node) : index_(CompactArena<Node>::indexOf(node)) {}
+
+    operator Node*() const {
+        return CompactArena<Node>::address(index_);
+    }
+
+    Node* operator->() const {
+        return CompactArena<Node>::address(index_);
+    }
+
+private:
+    uint32_t index_ = 0;
+};
+
+template <typename T>
+class CompactAllocator {
+public:
+    using value_type = T;
+
+    CompactAllocator() = default;
+
+    template <typename U>
+    CompactAllocator(const CompactAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        }
+        return CompactArena<T>::instance().allocate();
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) {
+            ::operator delete(p, std::align_val_t(alignof(T)));
+            return;
+        }
+        CompactArena<T>::instance().deallocate(p);
+    }
+
+    friend bool operator==(const CompactAllocator&, const CompactAllocator&) {
+        return true;
+    }
+};
+
+// Node layout chosen by the allocator a tree is instantiated with: the type
+// of a link between nodes and of the subtree size. Trees declare the size
+// as a bit-field of SIZE_BITS minus whatever per-node metadata they keep,
+// so the metadata shares the size's word.
+template <typename Allocator>
+struct NodeStorage {
+    template <typename Node>
+    using Link = Node*;
+    using Size = size_t;
+    static constexpr int SIZE_BITS = 64;
+};
+
+template <typename T>
+struct NodeStorage<CompactAllocator<T>> {
+    template <typename Node>
+    using Link = CompactLink<Node>;
+    using Size = uint32_t;
+    static constexpr int SIZE_BITS = 32;
+};
@@ -5,36 +5,48 @@
 
 using json = nlohmann::json;
 
-template <typename T>
-class JsonSerializer : public TreeVisitor<T> {
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class JsonSerializer : public TreeVisitor<T, Allocator, Instrumentation> {
 public:
     JsonSerializer() = default;
 
-    void visit(const AVLTree<T>& tree) override {
+    void visit(const AVLTree<T, Allocator, Instrumentation>& tree) override {
         json_ = {{"type", "avl_tree"}};
         json nodes = json::array();
         
         if (tree.getRoot()) {
             serializeNode(nodes, tree.getRoot(), [](auto* node, json& node_obj) {
-                node_obj["height"] = node->height;
+                node_obj["balance"] = static_cast<int>(node->balance);
             });
         }
         json_["nodes"] = nodes;
     }
 
-    void visit(const RedBlackTree<T>& tree) override {
+    void visit(const RedBlackTree<T, Allocator, Instrumentation>& tree) override {
         json_ = {{"type", "red_black_tree"}};
         json nodes = json::array();
         
         if (tree.getRoot()) {
             serializeNode(nodes, tree.getRoot(), [](auto* node, json& node_obj) {
-                node_obj["color"] = node->color == RedBlackTree<T>::RED ? "red" : "black";
+                node_obj["color"] = node->color == RedBlackTree<T, Allocator, Instrumentation>::RED ? "red" : "black";
             });
         }
         json_["nodes"] = nodes;
     }
 
-    void visit(const SplayTree<T>& tree) override {
+    void visit(const ParentFreeRedBlackTree<T, Allocator, Instrumentation>& tree) override {
+        json_ = {{"type", "parent_free_red_black_tree"}};
+        json nodes = json::array();
+        
+        if (tree.getRoot()) {
+            serializeNode(nodes, tree.getRoot(), [](auto* node, json& node_obj) {
+                node_obj["color"] = node->color == ParentFreeRedBlackTree<T, Allocator, Instrumentation>::RED ? "red" : "black";
+            });
+        }
+        json_["nodes"] = nodes;
+    }
+
+    void visit(const SplayTree<T, Allocator, Instrumentation>& tree) override {
         json_ = {{"type", "splay_tree"}};
         json nodes = json::array();
         
@@ -44,7 +56,17 @@ public:
         json_["nodes"] = nodes;
     }
 
-    void visit(const ScapegoatTree<T>& tree) override {
+    void visit(const TopDownSplayTree<T, Allocator, Instrumentation>& tree) override {
+        json_ = {{"type", "top_down_splay_tree"}};
+        json nodes = json::array();
+        
+        if (tree.getRoot()) {
+            serializeNode(nodes, tree.getRoot(), [](auto* node, json& node_obj) {});
+        }
+        json_["nodes"] = nodes;
+    }
+
+    void visit(const ScapegoatTree<T, Allocator, Instrumentation>& tree) override {
         json_ = {{"type", "scapegoat"}};
         json nodes = json::array();
         
@@ -54,7 +76,7 @@ public:
         json_["nodes"] = nodes;
     }
 
-    void visit(const BBAlphaTree<T>& tree) override {
+    void visit(const BBAlphaTree<T, Allocator, Instrumentation>& tree) override {
         json_ = {{"type", "bb_alpha"}};
         json nodes = json::array();
         
@@ -64,6 +86,16 @@ public:
         json_["nodes"] = nodes;
     }
 
+    void visit(const BTree<T, Allocator, Instrumentation>& tree) override {
+        json_ = {{"type", "btree"}};
+        json nodes = json::array();
+
+        if (tree.getRoot()) {
+            serializeMultiwayNode(nodes, tree.getRoot());
+        }
+        json_["nodes"] = nodes;
+    }
+
     json getJson() const {
         return json_;
     }
@@ -82,8 +114,33 @@ private:
 
         nodes.push_back(node_obj);
 
-        nodes[current_id]["left"] = node->left ? serializeNode(nodes, node->left, processNode) : -1;
-        nodes[current_id]["right"] = node->right ? serializeNode(nodes, node->right, processNode) : -1;
+        nodes[current_id]["left"] = node->left ? serializeNode<NodeType>(nodes, node->left, processNode) : -1;
+        nodes[current_id]["right"] = node->right ? serializeNode<NodeType>(nodes, node->right, processNode) : -1;
+
+        return current_id;
+    }
+
+    // B-tree nodes carry a sorted key array and, unless they are leaves, one
+    // more child id than keys.
+    template <typename NodeType>
+    int serializeMultiwayNode(json& nodes, NodeType* node) {
+        json node_obj;
+        node_obj["keys"] = json::array();
+        for (uint32_t i = 0; i < node->count; i++) {
+            node_obj["keys"].push_back(node->keys[i]);
+        }
+        node_obj["children"] = json::array();
+
+        int current_id = nodes.size();
+
+        nodes.push_back(node_obj);
+
+        if (!node->leaf) {
+            for (uint32_t i = 0; i <= node->count; i++) {
+                int child_id = serializeMultiwayNode<NodeType>(nodes, node->children[i]);
+                nodes[current_id]["children"].push_back(child_id);
+            }
+        }
 
         return current_id;
     }
@@ -1,20 +1,62 @@
 #include <iostream>
+#include <string>
 #include <httplib.h>
 #include "tree_visitor.h"
 #include "trees/splay_tree.hpp"
 #include "trees/avl_tree.hpp"
 #include "trees/red_black_tree.hpp"
 #include "json_serializer.hpp"
+#include "persistence.h"
 #include "tree_service.h"
 
-int main() {
+// Trees are kept in memory only unless --data-dir is given:
+//   --data-dir DIR              write-ahead log and snapshots, restored on start
+//   --fsync always|interval|never
+//   --fsync-interval-ms N       for interval and never (default 100)
+//   --snapshot-interval SECONDS 0 disables periodic snapshots (default 300)
+// Requests slower than --slow-request-ms N are logged to stderr (0, the
+// default, logs none).
+int main(int argc, char* argv[]) {
+    DurabilityOptions durability;
+    ServerOptions serverOptions;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (i + 1 == argc) {
+                throw std::invalid_argument("Missing value for " + arg);
+            }
+            std::string value = argv[++i];
+            if (arg == "--data-dir") {
+                durability.dataDir = value;
+            } else if (arg == "--fsync") {
+                durability.fsync = parseFsyncPolicy(value);
+            } else if (arg == "--fsync-interval-ms") {
+                durability.fsyncInterval = std::chrono::milliseconds(std::stoul(value));
+            } else if (arg == "--snapshot-interval") {
+                durability.snapshotInterval = std::chrono::seconds(std::stoul(value));
+            } else if (arg == "--slow-request-ms") {
+                serverOptions.slowRequest = std::chrono::milliseconds(std::stoul(value));
+            } else {
+                throw std::invalid_argument("Unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
     TreeManager treeManager;
+    if (!durability.dataDir.empty()) {
+        treeManager.enableDurability(durability);
+        std::cout << "Restored " << treeManager.listTrees().size() << " trees from " << durability.dataDir << std::endl;
+    }
+
     httplib::Server server;
 
-    setupTreeServer(server, treeManager);
+    setupTreeServer(server, treeManager, serverOptions);
 
     std::cout << "Server started on port 8080..." << std::endl;
     server.listen("0.0.0.0", 8080);
-    
+
     return 0;
 }
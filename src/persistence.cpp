@@ -0,0 +1,570 @@
+#include "persistence.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Record layout, little-endian:
+//   u32 body size, u32 CRC-32 of the body,
+//   body: u64 lsn, u64 tree, u8 op, u8 arg, u32 key count, then either the
+//         keys, up to the end of the body, or for CREATE the type, storage
+//         and key type as u16 length + bytes, a u8 that is 1 for a tree
+//         with values and the splay policy, empty for none. CREATE records
+//         written before key types existed end after the storage and are int
+//         trees; those written before values existed end after the key type,
+//         and those written before splay policies after the values flag.
+constexpr size_t RECORD_HEADER = 8;
+constexpr size_t RECORD_FIXED = 8 + 8 + 1 + 1 + 4;
+
+// Version 01 snapshots only held int keys and have no key type or key byte
+// count, version 02 ones have no values flag and version 03 ones no splay
+// policy; all of them are still loaded.
+constexpr char SNAPSHOT_MAGIC[8] = {'B', 'T', 'S', 'N', 'A', 'P', '0', '4'};
+constexpr char SNAPSHOT_MAGIC_V3[8] = {'B', 'T', 'S', 'N', 'A', 'P', '0', '3'};
+constexpr char SNAPSHOT_MAGIC_V2[8] = {'B', 'T', 'S', 'N', 'A', 'P', '0', '2'};
+constexpr char SNAPSHOT_MAGIC_V1[8] = {'B', 'T', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr uint8_t SNAPSHOT_TREE = 1;
+constexpr uint8_t SNAPSHOT_END = 0;
+
+constexpr auto CRC_TABLE = [] {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int bit = 0; bit < 8; bit++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}();
+
+// Pass the previous result as crc to continue a checksum across calls.
+uint32_t crc32(const void* data, size_t size, uint32_t crc = 0) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = CRC_TABLE[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+[[noreturn]] void throwErrno(const std::string& what, const fs::path& path) {
+    throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+}
+
+template <typename Value>
+void put(std::vector<uint8_t>& out, Value value) {
+    size_t at = out.size();
+    out.resize(at + sizeof(Value));
+    std::memcpy(out.data() + at, &value, sizeof(Value));
+}
+
+void putString(std::vector<uint8_t>& out, const std::string& value) {
+    put<uint16_t>(out, static_cast<uint16_t>(value.size()));
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// Bounds-checked reads from a file loaded into memory. A read past the end
+// marks the reader failed instead of throwing, since a short record is the
+// expected result of a crash mid-write.
+class Reader {
+public:
+    Reader(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+    template <typename Value>
+    Value get() {
+        Value value{};
+        if (take(sizeof(Value))) {
+            std::memcpy(&value, data_ + pos_ - sizeof(Value), sizeof(Value));
+        }
+        return value;
+    }
+
+    std::string getString() {
+        auto length = get<uint16_t>();
+        if (!take(length)) {
+            return {};
+        }
+        return std::string(reinterpret_cast<const char*>(data_ + pos_ - length), length);
+    }
+
+    void getBytes(std::vector<uint8_t>& bytes, uint64_t size) {
+        if (!take(size)) {
+            return;
+        }
+        bytes.assign(data_ + pos_ - size, data_ + pos_);
+    }
+
+    bool take(size_t size) {
+        if (failed_ || size > remaining()) {
+            failed_ = true;
+            return false;
+        }
+        pos_ += size;
+        return true;
+    }
+
+    const uint8_t* here() const { return data_ + pos_; }
+    size_t remaining() const { return size_ - pos_; }
+    bool failed() const { return failed_; }
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t pos_ = 0;
+    bool failed_ = false;
+};
+
+std::vector<uint8_t> readFile(const fs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throwErrno("Cannot open", path);
+    }
+    std::vector<uint8_t> data(fs::file_size(path));
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::read(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ::close(fd);
+            throwErrno("Cannot read", path);
+        }
+        done += n;
+    }
+    ::close(fd);
+    return data;
+}
+
+void writeAll(int fd, const uint8_t* data, size_t size, const fs::path& path) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throwErrno("Cannot write", path);
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+// Makes a file created or renamed in dir survive a crash.
+void syncDirectory(const fs::path& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throwErrno("Cannot open", dir);
+    }
+    ::fsync(fd);
+    ::close(fd);
+}
+
+// Files named <prefix><20-digit lsn><suffix>, in LSN order.
+std::vector<std::pair<uint64_t, fs::path>> listFiles(const fs::path& dir, const std::string& prefix, const std::string& suffix) {
+    std::vector<std::pair<uint64_t, fs::path>> files;
+    if (!fs::exists(dir)) {
+        return files;
+    }
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        std::string name = entry.path().filename().string();
+        if (name.size() != prefix.size() + 20 + suffix.size() || !name.starts_with(prefix) || !name.ends_with(suffix)) {
+            continue;
+        }
+        std::string digits = name.substr(prefix.size(), 20);
+        if (!std::all_of(digits.begin(), digits.end(), ::isdigit)) {
+            continue;
+        }
+        files.emplace_back(std::stoull(digits), entry.path());
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+fs::path numberedFile(const fs::path& dir, const std::string& prefix, uint64_t lsn, const std::string& suffix) {
+    std::string digits = std::to_string(lsn);
+    return dir / (prefix + std::string(20 - digits.size(), '0') + digits + suffix);
+}
+
+} // namespace
+
+FsyncPolicy parseFsyncPolicy(const std::string& name) {
+    if (name == "always") {
+        return FsyncPolicy::ALWAYS;
+    }
+    if (name == "interval") {
+        return FsyncPolicy::INTERVAL;
+    }
+    if (name == "never") {
+        return FsyncPolicy::NEVER;
+    }
+    throw std::invalid_argument("Unknown fsync policy: " + name);
+}
+
+WriteAheadLog::WriteAheadLog(const DurabilityOptions& options, uint64_t nextLsn)
+    : dir_(options.dataDir), policy_(options.fsync), interval_(options.fsyncInterval),
+      nextLsn_(nextLsn), segmentFirstLsn_(nextLsn), durableLsn_(nextLsn - 1) {
+    openSegment(nextLsn);
+    if (policy_ != FsyncPolicy::ALWAYS) {
+        flusher_ = std::thread([this] {
+            std::unique_lock lock(mutex_);
+            while (!stopping_) {
+                cv_.wait_for(lock, interval_, [this] { return stopping_; });
+                if (!flushing_ && !failed_ && !buffer_.empty()) {
+                    try {
+                        flushLocked(lock);
+                    } catch (const std::exception&) {
+                        // Writers see failed_ on their next append.
+                    }
+                }
+            }
+        });
+    }
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    if (flusher_.joinable()) {
+        flusher_.join();
+    }
+
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this] { return !flushing_; });
+    if (!failed_ && !buffer_.empty()) {
+        try {
+            flushLocked(lock);
+        } catch (const std::exception&) {
+        }
+    }
+    ::close(fd_);
+}
+
+uint64_t WriteAheadLog::append(WalOp op, uint64_t tree, uint8_t arg, uint32_t keyCount, std::span<const uint8_t> keys) {
+    std::lock_guard lock(mutex_);
+    return appendLocked(op, tree, arg, keyCount, keys, {});
+}
+
+uint64_t WriteAheadLog::appendCreate(uint64_t tree, const std::string& type, const std::string& storage, const std::string& keyType,
+                                     bool values, const std::string& splayPolicy) {
+    std::vector<uint8_t> extra;
+    putString(extra, type);
+    putString(extra, storage);
+    putString(extra, keyType);
+    put<uint8_t>(extra, values);
+    putString(extra, splayPolicy);
+    std::lock_guard lock(mutex_);
+    return appendLocked(WalOp::CREATE, tree, 0, 0, {}, extra);
+}
+
+uint64_t WriteAheadLog::appendLocked(WalOp op, uint64_t tree, uint8_t arg, uint32_t keyCount, std::span<const uint8_t> keys,
+                                     const std::vector<uint8_t>& extra) {
+    if (failed_) {
+        throw std::runtime_error("Write-ahead log is unavailable after a write error");
+    }
+
+    uint64_t lsn = nextLsn_++;
+    size_t start = buffer_.size();
+    buffer_.resize(start + RECORD_HEADER);
+    put<uint64_t>(buffer_, lsn);
+    put<uint64_t>(buffer_, tree);
+    put<uint8_t>(buffer_, static_cast<uint8_t>(op));
+    put<uint8_t>(buffer_, arg);
+    put<uint32_t>(buffer_, keyCount);
+    buffer_.insert(buffer_.end(), keys.begin(), keys.end());
+    buffer_.insert(buffer_.end(), extra.begin(), extra.end());
+
+    uint32_t size = static_cast<uint32_t>(buffer_.size() - start - RECORD_HEADER);
+    uint32_t crc = crc32(buffer_.data() + start + RECORD_HEADER, size);
+    std::memcpy(buffer_.data() + start, &size, 4);
+    std::memcpy(buffer_.data() + start + 4, &crc, 4);
+    return lsn;
+}
+
+void WriteAheadLog::commit(uint64_t lsn) {
+    if (policy_ != FsyncPolicy::ALWAYS || lsn == 0) {
+        return;
+    }
+    std::unique_lock lock(mutex_);
+    while (durableLsn_ < lsn) {
+        if (failed_) {
+            throw std::runtime_error("Write-ahead log is unavailable after a write error");
+        }
+        if (flushing_) {
+            cv_.wait(lock);
+        } else {
+            flushLocked(lock);
+        }
+    }
+}
+
+// The caller becomes the flush leader: it takes everything buffered so far
+// and writes it without the lock, so writers can keep appending meanwhile.
+void WriteAheadLog::flushLocked(std::unique_lock<std::mutex>& lock) {
+    flushing_ = true;
+    std::vector<uint8_t> pending;
+    pending.swap(buffer_);
+    uint64_t upTo = nextLsn_ - 1;
+    int fd = fd_;
+
+    lock.unlock();
+    try {
+        writeAll(fd, pending.data(), pending.size(), dir_);
+        if (policy_ != FsyncPolicy::NEVER && ::fdatasync(fd) != 0) {
+            throwErrno("Cannot sync the write-ahead log in", dir_);
+        }
+    } catch (...) {
+        lock.lock();
+        flushing_ = false;
+        failed_ = true;
+        cv_.notify_all();
+        throw;
+    }
+    lock.lock();
+
+    flushing_ = false;
+    durableLsn_ = std::max(durableLsn_, upTo);
+    cv_.notify_all();
+}
+
+uint64_t WriteAheadLog::rotate() {
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this] { return !flushing_; });
+    if (failed_) {
+        throw std::runtime_error("Write-ahead log is unavailable after a write error");
+    }
+    uint64_t last = nextLsn_ - 1;
+    if (nextLsn_ == segmentFirstLsn_) {
+        return last;
+    }
+
+    // Appends wait for the switch so no record lands in the old segment
+    // after it was synced.
+    try {
+        writeAll(fd_, buffer_.data(), buffer_.size(), dir_);
+        if (::fdatasync(fd_) != 0) {
+            throwErrno("Cannot sync the write-ahead log in", dir_);
+        }
+    } catch (...) {
+        failed_ = true;
+        cv_.notify_all();
+        throw;
+    }
+    buffer_.clear();
+    durableLsn_ = last;
+    ::close(fd_);
+    openSegment(nextLsn_);
+    cv_.notify_all();
+    return last;
+}
+
+void WriteAheadLog::openSegment(uint64_t firstLsn) {
+    fs::path path = numberedFile(dir_, "wal-", firstLsn, ".log");
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        failed_ = true;
+        throwErrno("Cannot create", path);
+    }
+    segmentFirstLsn_ = firstLsn;
+    syncDirectory(dir_);
+}
+
+uint64_t WriteAheadLog::replay(const fs::path& dir, uint64_t after, const std::function<void(const WalRecord&)>& apply) {
+    uint64_t last = after;
+    for (const auto& [first, path] : listFiles(dir, "wal-", ".log")) {
+        std::vector<uint8_t> data = readFile(path);
+        Reader file(data.data(), data.size());
+        uint64_t previous = first - 1;
+
+        while (file.remaining() >= RECORD_HEADER) {
+            auto size = file.get<uint32_t>();
+            auto crc = file.get<uint32_t>();
+            const uint8_t* body = file.here();
+            if (size < RECORD_FIXED || !file.take(size) || crc32(body, size) != crc) {
+                break;
+            }
+
+            Reader reader(body, size);
+            WalRecord record;
+            record.lsn = reader.get<uint64_t>();
+            record.tree = reader.get<uint64_t>();
+            record.op = static_cast<WalOp>(reader.get<uint8_t>());
+            record.arg = reader.get<uint8_t>();
+            record.keyCount = reader.get<uint32_t>();
+            if (record.op == WalOp::CREATE) {
+                record.type = reader.getString();
+                record.storage = reader.getString();
+                record.keyType = reader.remaining() > 0 ? reader.getString() : "int";
+                record.values = reader.remaining() > 0 && reader.get<uint8_t>() != 0;
+                record.splayPolicy = reader.remaining() > 0 ? reader.getString() : "";
+            } else {
+                reader.getBytes(record.keys, reader.remaining());
+            }
+            if (reader.failed() || record.lsn != previous + 1) {
+                break;
+            }
+            previous = record.lsn;
+
+            if (record.lsn > after) {
+                apply(record);
+                last = std::max(last, record.lsn);
+            }
+        }
+    }
+    return last;
+}
+
+void WriteAheadLog::removeSegmentsUpTo(const fs::path& dir, uint64_t lsn) {
+    auto segments = listFiles(dir, "wal-", ".log");
+    for (size_t i = 0; i + 1 < segments.size() && segments[i + 1].first <= lsn + 1; i++) {
+        fs::remove(segments[i].second);
+    }
+}
+
+SnapshotWriter::SnapshotWriter(const fs::path& dir, uint64_t lsn, uint64_t lastTreeId)
+    : dir_(dir), path_(numberedFile(dir, "snapshot-", lsn, ".bin")) {
+    tmpPath_ = path_;
+    tmpPath_ += ".tmp";
+    fd_ = ::open(tmpPath_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        throwErrno("Cannot create", tmpPath_);
+    }
+    write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    write(&lsn, sizeof(lsn));
+    write(&lastTreeId, sizeof(lastTreeId));
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        std::error_code ignored;
+        fs::remove(tmpPath_, ignored);
+    }
+}
+
+void SnapshotWriter::add(const TreeCheckpoint& tree) {
+    std::vector<uint8_t> header;
+    put<uint8_t>(header, SNAPSHOT_TREE);
+    put<uint64_t>(header, tree.id);
+    put<uint64_t>(header, tree.lsn);
+    putString(header, tree.type);
+    putString(header, tree.storage);
+    putString(header, tree.keyType);
+    put<uint8_t>(header, tree.values);
+    putString(header, tree.splayPolicy);
+    put<uint64_t>(header, tree.keyCount);
+    put<uint64_t>(header, tree.keys.size());
+    write(header.data(), header.size());
+    write(tree.keys.data(), tree.keys.size());
+}
+
+void SnapshotWriter::commit() {
+    uint8_t end = SNAPSHOT_END;
+    write(&end, 1);
+    uint32_t crc = crc_;
+    write(&crc, sizeof(crc));
+    flush();
+
+    if (::fsync(fd_) != 0) {
+        throwErrno("Cannot sync", tmpPath_);
+    }
+    ::close(fd_);
+    fd_ = -1;
+    fs::rename(tmpPath_, path_);
+    syncDirectory(dir_);
+
+    for (const auto& [lsn, path] : listFiles(dir_, "snapshot-", ".bin")) {
+        if (path != path_) {
+            fs::remove(path);
+        }
+    }
+}
+
+void SnapshotWriter::write(const void* data, size_t size) {
+    crc_ = crc32(data, size, crc_);
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    buffer_.insert(buffer_.end(), bytes, bytes + size);
+    if (buffer_.size() >= (1 << 20)) {
+        flush();
+    }
+}
+
+void SnapshotWriter::flush() {
+    writeAll(fd_, buffer_.data(), buffer_.size(), tmpPath_);
+    buffer_.clear();
+}
+
+bool SnapshotWriter::load(const fs::path& dir, uint64_t& lsn, uint64_t& lastTreeId,
+                          const std::function<void(TreeCheckpoint&&)>& load) {
+    // A crash while writing a snapshot leaves its .tmp behind.
+    if (fs::exists(dir)) {
+        for (const auto& entry : fs::directory_iterator(dir)) {
+            if (entry.path().extension() == ".tmp") {
+                fs::remove(entry.path());
+            }
+        }
+    }
+
+    auto snapshots = listFiles(dir, "snapshot-", ".bin");
+    if (snapshots.empty()) {
+        return false;
+    }
+
+    // Only the newest snapshot is trusted: older ones are deleted once a
+    // newer one is safely on disk, so a damaged newest one means the log it
+    // replaced is gone too.
+    const fs::path& path = snapshots.back().second;
+    std::vector<uint8_t> data = readFile(path);
+    if (data.size() < sizeof(SNAPSHOT_MAGIC) + 16 + 1 + 4) {
+        throw std::runtime_error("Damaged snapshot " + path.string());
+    }
+    bool v1 = std::memcmp(data.data(), SNAPSHOT_MAGIC_V1, sizeof(SNAPSHOT_MAGIC_V1)) == 0;
+    bool v2 = std::memcmp(data.data(), SNAPSHOT_MAGIC_V2, sizeof(SNAPSHOT_MAGIC_V2)) == 0;
+    bool v3 = std::memcmp(data.data(), SNAPSHOT_MAGIC_V3, sizeof(SNAPSHOT_MAGIC_V3)) == 0;
+    if (!v1 && !v2 && !v3 && std::memcmp(data.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        throw std::runtime_error("Damaged snapshot " + path.string());
+    }
+    uint32_t crc;
+    std::memcpy(&crc, data.data() + data.size() - 4, 4);
+    if (crc32(data.data(), data.size() - 4) != crc) {
+        throw std::runtime_error("Damaged snapshot " + path.string());
+    }
+
+    Reader reader(data.data() + sizeof(SNAPSHOT_MAGIC), data.size() - sizeof(SNAPSHOT_MAGIC) - 4);
+    lsn = reader.get<uint64_t>();
+    lastTreeId = reader.get<uint64_t>();
+    while (reader.get<uint8_t>() == SNAPSHOT_TREE && !reader.failed()) {
+        TreeCheckpoint tree;
+        tree.id = reader.get<uint64_t>();
+        tree.lsn = reader.get<uint64_t>();
+        tree.type = reader.getString();
+        tree.storage = reader.getString();
+        tree.keyType = v1 ? "int" : reader.getString();
+        tree.values = !v1 && !v2 && reader.get<uint8_t>() != 0;
+        tree.splayPolicy = v1 || v2 || v3 ? "" : reader.getString();
+        tree.keyCount = reader.get<uint64_t>();
+        reader.getBytes(tree.keys, v1 ? tree.keyCount * sizeof(int32_t) : reader.get<uint64_t>());
+        if (reader.failed()) {
+            break;
+        }
+        load(std::move(tree));
+    }
+    if (reader.failed()) {
+        throw std::runtime_error("Damaged snapshot " + path.string());
+    }
+    return true;
+}
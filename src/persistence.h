@@ -0,0 +1,254 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "trees/string_key.hpp"
+
+// Durability for TreeManager. Every write is appended to a binary write-ahead
+// log before it is applied, and every so often all trees are written out as
+// sorted keys so the log can be cut short. On startup the latest snapshot is
+// bulk loaded in linear time and the log written after it is replayed.
+//
+// The data directory holds wal-<first lsn>.log segments and at most one
+// snapshot-<lsn>.bin. Records carry a CRC, so a write torn by a crash ends
+// the replay of its segment instead of corrupting a tree.
+
+enum class FsyncPolicy {
+    // A write returns once its record is on disk. Writers waiting at the
+    // same time share one fsync (group commit).
+    ALWAYS,
+    // Records are written and fsynced every fsyncInterval; a crash loses at
+    // most that much.
+    INTERVAL,
+    // Records are written every fsyncInterval and left to the page cache.
+    NEVER
+};
+
+FsyncPolicy parseFsyncPolicy(const std::string& name);
+
+struct DurabilityOptions {
+    std::filesystem::path dataDir;
+    FsyncPolicy fsync = FsyncPolicy::ALWAYS;
+    std::chrono::milliseconds fsyncInterval{100};
+    // Zero turns periodic snapshots off; the log then grows until restart.
+    std::chrono::seconds snapshotInterval{300};
+};
+
+enum class WalOp : uint8_t {
+    CREATE = 0,
+    DROP = 1,
+    INSERT = 2,
+    REMOVE = 3,
+    // keys as passed to bulkLoad.
+    BULK = 4,
+    // The writes of a batch as (op, key) pairs.
+    BATCH = 5,
+    // arg is the SetOperation and keys the other tree's keys at the time,
+    // so replay does not depend on the state of any other tree.
+    COMBINE = 6,
+    // One key followed by its value, for trees with values.
+    PUT = 7
+};
+
+// Keys are stored little-endian in the tree's own key type: int and int64_t
+// as two's complement, double as its IEEE 754 bits and StringKey as a u32
+// length followed by the bytes. Trees with int keys get the same bytes as
+// before the other key types existed, so older logs and snapshots load.
+// Values are std::strings and are stored like StringKey.
+inline const std::string& keyText(const StringKey& key) {
+    return key.str();
+}
+
+inline const std::string& keyText(const std::string& text) {
+    return text;
+}
+
+template <typename Key>
+void putKey(std::vector<uint8_t>& out, const Key& key) {
+    size_t at = out.size();
+    if constexpr (std::is_same_v<Key, StringKey> || std::is_same_v<Key, std::string>) {
+        const std::string& text = keyText(key);
+        uint32_t length = static_cast<uint32_t>(text.size());
+        out.resize(at + sizeof(length) + length);
+        std::memcpy(out.data() + at, &length, sizeof(length));
+        std::memcpy(out.data() + at + sizeof(length), text.data(), length);
+    } else {
+        static_assert(std::is_arithmetic_v<Key>);
+        out.resize(at + sizeof(Key));
+        std::memcpy(out.data() + at, &key, sizeof(Key));
+    }
+}
+
+// Reads one key off the front of in. Throws if in is too short.
+template <typename Key>
+Key takeKey(std::span<const uint8_t>& in) {
+    auto take = [&in](size_t size) {
+        if (size > in.size()) {
+            throw std::runtime_error("Truncated key");
+        }
+        std::span<const uint8_t> bytes = in.first(size);
+        in = in.subspan(size);
+        return bytes;
+    };
+    if constexpr (std::is_same_v<Key, StringKey> || std::is_same_v<Key, std::string>) {
+        uint32_t length;
+        std::memcpy(&length, take(sizeof(length)).data(), sizeof(length));
+        std::span<const uint8_t> bytes = take(length);
+        return Key(std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+    } else {
+        Key key;
+        std::memcpy(&key, take(sizeof(Key)).data(), sizeof(Key));
+        return key;
+    }
+}
+
+template <typename Key>
+std::vector<uint8_t> encodeKeys(std::span<const Key> keys) {
+    std::vector<uint8_t> out;
+    if constexpr (std::is_arithmetic_v<Key>) {
+        out.reserve(keys.size_bytes());
+    }
+    for (const Key& key : keys) {
+        putKey(out, key);
+    }
+    return out;
+}
+
+template <typename Key>
+std::vector<Key> decodeKeys(std::span<const uint8_t> in, uint64_t count) {
+    std::vector<Key> keys;
+    keys.reserve(std::min<uint64_t>(count, in.size()));
+    for (uint64_t i = 0; i < count; i++) {
+        keys.push_back(takeKey<Key>(in));
+    }
+    return keys;
+}
+
+struct WalRecord {
+    uint64_t lsn = 0;
+    uint64_t tree = 0;
+    WalOp op = WalOp::INSERT;
+    uint8_t arg = 0;
+    // keyCount keys, encoded as above.
+    uint32_t keyCount = 0;
+    std::vector<uint8_t> keys;
+    // CREATE only.
+    std::string type;
+    std::string storage;
+    std::string keyType;
+    bool values = false;
+    // Empty unless the tree was created with a splay policy.
+    std::string splayPolicy;
+};
+
+// The log sequence numbers (LSNs) grow by one per record across all trees.
+class WriteAheadLog {
+public:
+    // Starts a new segment whose first record gets nextLsn.
+    WriteAheadLog(const DurabilityOptions& options, uint64_t nextLsn);
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Buffers a record and returns its LSN. Callers append while holding the
+    // lock of the tree they write, so the log orders each tree's writes the
+    // way they were applied.
+    uint64_t append(WalOp op, uint64_t tree, uint8_t arg, uint32_t keyCount, std::span<const uint8_t> keys);
+    uint64_t appendCreate(uint64_t tree, const std::string& type, const std::string& storage, const std::string& keyType,
+                          bool values, const std::string& splayPolicy);
+
+    // Under FsyncPolicy::ALWAYS, blocks until the record is on disk. The
+    // first waiter writes and fsyncs everything buffered so far while the
+    // others wait for it. Call this after releasing the tree's lock.
+    void commit(uint64_t lsn);
+
+    // Writes out the current segment and starts the next one. Returns the
+    // last LSN in the finished segments.
+    uint64_t rotate();
+
+    // Calls apply for every intact record with an LSN above after, oldest
+    // first, and returns the largest LSN seen (after if there was none).
+    // Replay of a segment stops at its first torn or corrupt record.
+    static uint64_t replay(const std::filesystem::path& dir, uint64_t after,
+                           const std::function<void(const WalRecord&)>& apply);
+
+    // Deletes the segments that only hold records up to lsn.
+    static void removeSegmentsUpTo(const std::filesystem::path& dir, uint64_t lsn);
+
+private:
+    std::filesystem::path dir_;
+    FsyncPolicy policy_;
+    std::chrono::milliseconds interval_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<uint8_t> buffer_;
+    uint64_t nextLsn_;
+    uint64_t segmentFirstLsn_;
+    uint64_t durableLsn_;
+    bool flushing_ = false;
+    bool stopping_ = false;
+    bool failed_ = false;
+    int fd_ = -1;
+    std::thread flusher_;
+
+    uint64_t appendLocked(WalOp op, uint64_t tree, uint8_t arg, uint32_t keyCount, std::span<const uint8_t> keys,
+                          const std::vector<uint8_t>& extra);
+    void flushLocked(std::unique_lock<std::mutex>& lock);
+    void openSegment(uint64_t firstLsn);
+};
+
+// One tree in a snapshot: its keys in order and the last record they include.
+// A tree with values has each key followed by its value.
+struct TreeCheckpoint {
+    uint64_t id = 0;
+    std::string type;
+    std::string storage;
+    std::string keyType;
+    bool values = false;
+    std::string splayPolicy;
+    uint64_t lsn = 0;
+    uint64_t keyCount = 0;
+    std::vector<uint8_t> keys;
+};
+
+// Streams trees into snapshot-<lsn>.bin.tmp and on commit makes it the
+// snapshot, replacing the previous one. lsn is the last record the snapshot
+// covers; a tree's own checkpoint LSN may be later.
+class SnapshotWriter {
+public:
+    SnapshotWriter(const std::filesystem::path& dir, uint64_t lsn, uint64_t lastTreeId);
+    ~SnapshotWriter();
+
+    void add(const TreeCheckpoint& tree);
+    void commit();
+
+    // Loads the snapshot in dir, if any, into lsn and lastTreeId and passes
+    // each tree to load. Throws if the snapshot is damaged.
+    static bool load(const std::filesystem::path& dir, uint64_t& lsn, uint64_t& lastTreeId,
+                     const std::function<void(TreeCheckpoint&&)>& load);
+
+private:
+    std::filesystem::path dir_;
+    std::filesystem::path path_;
+    std::filesystem::path tmpPath_;
+    int fd_ = -1;
+    uint32_t crc_ = 0;
+    std::vector<uint8_t> buffer_;
+
+    void write(const void* data, size_t size);
+    void flush();
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Slab allocator for tree nodes. Nodes are carved out of large, cache-line
+// aligned slabs and recycled through an intrusive free list, so inserts and
+// removes never touch malloc once the pool is warm. release() drops every
+// slab at once, which is how the trees tear down without visiting each node.
+template <typename T, size_t NodesPerSlab = 4096>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = PoolAllocator<U, NodesPerSlab>;
+    };
+
+    static constexpr size_t CACHE_LINE = 64;
+
+    PoolAllocator() : pool_(std::make_shared<Pool>()) {}
+
+    // Rebinding to another node type starts a fresh pool: slots are sized for
+    // exactly one type, so pools are never shared across types.
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, NodesPerSlab>&) : PoolAllocator() {}
+
+    T* allocate(size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        }
+        return reinterpret_cast<T*>(pool_->allocate());
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) {
+            ::operator delete(p, std::align_val_t(alignof(T)));
+            return;
+        }
+        pool_->deallocate(reinterpret_cast<Slot*>(p));
+    }
+
+    // Frees all slabs without running destructors. Every pointer handed out
+    // by this pool is invalid afterwards.
+    void release() {
+        pool_->release();
+    }
+
+    // True while another allocator copy, such as the one held by a tree
+    // snapshot, still uses the pool. release() would free its nodes too.
+    bool shared() const {
+        return pool_.use_count() > 1;
+    }
+
+    size_t bytesReserved() const {
+        return pool_->slabs.size() * sizeof(Slot) * NodesPerSlab;
+    }
+
+    friend bool operator==(const PoolAllocator& lhs, const PoolAllocator& rhs) {
+        return lhs.pool_ == rhs.pool_;
+    }
+
+private:
+    template <typename, size_t> friend class PoolAllocator;
+
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Pool {
+        std::vector<Slot*> slabs;
+        Slot* free_list = nullptr;
+        Slot* bump = nullptr;
+        Slot* bump_end = nullptr;
+
+        ~Pool() {
+            release();
+        }
+
+        Slot* allocate() {
+            if (free_list != nullptr) {
+                Slot* slot = free_list;
+                free_list = slot->next;
+                return slot;
+            }
+            if (bump == bump_end) {
+                Slot* slab = static_cast<Slot*>(::operator new(
+                    sizeof(Slot) * NodesPerSlab, std::align_val_t(std::max(CACHE_LINE, alignof(Slot)))));
+                slabs.push_back(slab);
+                bump = slab;
+                bump_end = slab + NodesPerSlab;
+            }
+            return bump++;
+        }
+
+        void deallocate(Slot* slot) {
+            slot->next = free_list;
+            free_list = slot;
+        }
+
+        void release() {
+            for (Slot* slab : slabs) {
+                ::operator delete(slab, std::align_val_t(std::max(CACHE_LINE, alignof(Slot))));
+            }
+            slabs.clear();
+            free_list = nullptr;
+            bump = nullptr;
+            bump_end = nullptr;
+        }
+    };
+
+    std::shared_ptr<Pool> pool_;
+};
+
+// True when a tree may skip the per-node walk on teardown and hand every slab
+// back to the allocator in one call, provided no other tree shares the slabs.
+template <typename NodeAllocator, typename Node>
+concept BulkReleasable = std::is_trivially_destructible_v<Node> && requires(NodeAllocator& alloc) {
+    alloc.release();
+    { alloc.shared() } -> std::convertible_to<bool>;
+};
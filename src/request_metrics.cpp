@@ -0,0 +1,391 @@
+#include "request_metrics.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+
+namespace {
+    void appendNumber(std::string& out, double value) {
+        char buffer[32];
+        int length = std::snprintf(buffer, sizeof(buffer), "%.9g", value);
+        out.append(buffer, length);
+    }
+
+    void appendLabels(std::string& out, const std::string& operation, const std::string& treeType) {
+        out += "{operation=\"";
+        out += operation;
+        out += "\",tree_type=\"";
+        out += treeType;
+        out += '"';
+    }
+
+    void appendMicros(std::string& out, double nanos) {
+        char buffer[32];
+        int length = std::snprintf(buffer, sizeof(buffer), "%.3f", nanos / 1e3);
+        out.append(buffer, length);
+    }
+
+    void appendSummary(std::string& out, const LatencyHistogram::Summary& summary) {
+        const std::pair<const char*, double> fields[] = {
+            {"mean", summary.mean},
+            {"min", static_cast<double>(summary.min)},
+            {"p50", static_cast<double>(summary.p50)},
+            {"p90", static_cast<double>(summary.p90)},
+            {"p99", static_cast<double>(summary.p99)},
+            {"p99.9", static_cast<double>(summary.p999)},
+            {"max", static_cast<double>(summary.max)},
+        };
+        out += "{\"count\":";
+        out += std::to_string(summary.count);
+        for (const auto& [name, nanos] : fields) {
+            out += ",\"";
+            out += name;
+            out += "\":";
+            appendMicros(out, nanos);
+        }
+        out += '}';
+    }
+
+    void appendMillis(std::string& out, std::chrono::nanoseconds elapsed) {
+        char buffer[32];
+        int length = std::snprintf(buffer, sizeof(buffer), "%.3f ms", elapsed.count() / 1e6);
+        out.append(buffer, length);
+    }
+
+    constexpr const char* PHASE_NAMES[REQUEST_PHASES] = {"parse", "tree", "serialize"};
+}
+
+void LatencyHistogram::record(uint64_t nanos) {
+    counts_[bucketIndex(nanos)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t min = min_.load(std::memory_order_relaxed);
+    while (nanos < min && !min_.compare_exchange_weak(min, nanos, std::memory_order_relaxed)) {
+    }
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (nanos > max && !max_.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {
+    }
+}
+
+// Below 2^(SUB_BUCKET_BITS + 1) every nanosecond has its own bucket. Above,
+// the bit width of the value picks a run of 2^SUB_BUCKET_BITS buckets and
+// the bits after the leading one pick the bucket within it.
+size_t LatencyHistogram::bucketIndex(uint64_t nanos) {
+    nanos = std::min(nanos, (uint64_t(1) << MAX_BITS) - 1);
+    if (nanos < (uint64_t(1) << (SUB_BUCKET_BITS + 1))) {
+        return nanos;
+    }
+    unsigned shift = std::bit_width(nanos) - SUB_BUCKET_BITS - 1;
+    return (size_t(shift + 1) << SUB_BUCKET_BITS) + (nanos >> shift) - (size_t(1) << SUB_BUCKET_BITS);
+}
+
+uint64_t LatencyHistogram::bucketLowest(size_t index) {
+    size_t run = index >> SUB_BUCKET_BITS;
+    if (run <= 1) {
+        return index;
+    }
+    uint64_t subBucket = index & ((size_t(1) << SUB_BUCKET_BITS) - 1);
+    return (subBucket + (uint64_t(1) << SUB_BUCKET_BITS)) << (run - 1);
+}
+
+uint64_t LatencyHistogram::bucketHighest(size_t index) {
+    return bucketLowest(index + 1) - 1;
+}
+
+// Like the Prometheus series, the count is the sum of the buckets as read,
+// so the quantiles stay consistent with it while requests keep arriving.
+LatencyHistogram::Summary LatencyHistogram::summarize() const {
+    std::vector<uint64_t> counts(BUCKETS);
+    Summary summary;
+    double nanos = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        counts[i] = counts_[i].load(std::memory_order_relaxed);
+        summary.count += counts[i];
+        nanos += counts[i] * ((bucketLowest(i) + bucketHighest(i)) / 2.0);
+    }
+    if (summary.count == 0) {
+        return summary;
+    }
+    summary.min = min_.load(std::memory_order_relaxed);
+    summary.max = max_.load(std::memory_order_relaxed);
+    summary.mean = nanos / summary.count;
+
+    const std::pair<double, uint64_t*> quantiles[] = {
+        {0.5, &summary.p50}, {0.9, &summary.p90}, {0.99, &summary.p99}, {0.999, &summary.p999},
+    };
+    size_t next = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS && next < std::size(quantiles); i++) {
+        seen += counts[i];
+        while (next < std::size(quantiles)
+               && seen >= std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(quantiles[next].first * summary.count)))) {
+            *quantiles[next].second = std::min(bucketHighest(i), std::max(summary.max, bucketLowest(i)));
+            next++;
+        }
+    }
+    return summary;
+}
+
+void RequestMetrics::Route::record(size_t treeType, std::chrono::nanoseconds elapsed,
+                                   const std::array<std::chrono::nanoseconds, REQUEST_PHASES>* phases, bool failed) {
+    Series& series = series_[treeType];
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    size_t bucket = std::lower_bound(BUCKETS.begin(), BUCKETS.end(), seconds) - BUCKETS.begin();
+    series.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    series.nanos.fetch_add(elapsed.count(), std::memory_order_relaxed);
+    if (failed) {
+        series.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Two first requests may both allocate; the one that loses the exchange
+    // frees its histograms and records into the winner's.
+    Latency* latency = series.latency.load(std::memory_order_acquire);
+    if (latency == nullptr) {
+        auto created = std::make_unique<Latency>();
+        if (series.latency.compare_exchange_strong(latency, created.get(), std::memory_order_acq_rel)) {
+            latency = created.release();
+        }
+    }
+    latency->total.record(elapsed.count());
+    if (phases != nullptr) {
+        for (size_t phase = 0; phase < REQUEST_PHASES; phase++) {
+            latency->phases[phase].record((*phases)[phase].count());
+        }
+    }
+}
+
+RequestMetrics::RequestMetrics(std::vector<std::string> treeTypes, std::chrono::nanoseconds slowRequest)
+    : treeTypes_(std::move(treeTypes)), slowRequest_(slowRequest) {}
+
+RequestMetrics::Route& RequestMetrics::route(const std::string& operation) {
+    Route& route = routes_.emplace_back();
+    route.operation_ = operation;
+    route.series_ = std::make_unique<Route::Series[]>(treeTypes_.size() + 1);
+    return route;
+}
+
+size_t RequestMetrics::treeTypeIndex(const std::string& type) const {
+    return std::find(treeTypes_.begin(), treeTypes_.end(), type) - treeTypes_.begin();
+}
+
+const std::string& RequestMetrics::treeTypeName(size_t treeType) const {
+    static const std::string none = "none";
+    return treeType < treeTypes_.size() ? treeTypes_[treeType] : none;
+}
+
+// A series is read bucket by bucket while requests keep landing in it, so
+// the count is taken as the sum of the buckets read; that keeps it equal to
+// the +Inf bucket, as Prometheus expects.
+void RequestMetrics::render(std::string& out) const {
+    out += "# HELP balancedtrees_requests_total Requests handled.\n";
+    out += "# TYPE balancedtrees_requests_total counter\n";
+    std::string errors;
+    errors += "# HELP balancedtrees_request_errors_total Requests answered with a 4xx or 5xx status.\n";
+    errors += "# TYPE balancedtrees_request_errors_total counter\n";
+    std::string histograms;
+    histograms += "# HELP balancedtrees_request_duration_seconds Time spent in the request handler.\n";
+    histograms += "# TYPE balancedtrees_request_duration_seconds histogram\n";
+
+    for (const Route& route : routes_) {
+        for (size_t type = 0; type <= treeTypes_.size(); type++) {
+            const Route::Series& series = route.series_[type];
+            const std::string& treeType = treeTypeName(type);
+
+            std::array<uint64_t, BUCKETS.size() + 1> counts;
+            uint64_t total = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                counts[i] = series.buckets[i].load(std::memory_order_relaxed);
+                total += counts[i];
+            }
+            if (total == 0) {
+                continue;
+            }
+
+            out += "balancedtrees_requests_total";
+            appendLabels(out, route.operation_, treeType);
+            out += "} ";
+            out += std::to_string(total);
+            out += '\n';
+
+            errors += "balancedtrees_request_errors_total";
+            appendLabels(errors, route.operation_, treeType);
+            errors += "} ";
+            errors += std::to_string(series.errors.load(std::memory_order_relaxed));
+            errors += '\n';
+
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                cumulative += counts[i];
+                histograms += "balancedtrees_request_duration_seconds_bucket";
+                appendLabels(histograms, route.operation_, treeType);
+                histograms += ",le=\"";
+                if (i < BUCKETS.size()) {
+                    appendNumber(histograms, BUCKETS[i]);
+                } else {
+                    histograms += "+Inf";
+                }
+                histograms += "\"} ";
+                histograms += std::to_string(cumulative);
+                histograms += '\n';
+            }
+            histograms += "balancedtrees_request_duration_seconds_sum";
+            appendLabels(histograms, route.operation_, treeType);
+            histograms += "} ";
+            appendNumber(histograms, series.nanos.load(std::memory_order_relaxed) / 1e9);
+            histograms += '\n';
+            histograms += "balancedtrees_request_duration_seconds_count";
+            appendLabels(histograms, route.operation_, treeType);
+            histograms += "} ";
+            histograms += std::to_string(total);
+            histograms += '\n';
+        }
+    }
+    out += errors;
+    out += histograms;
+}
+
+void RequestMetrics::renderLatency(std::string& out) const {
+    out += "{\"unit\":\"us\",\"routes\":[";
+    bool first = true;
+    for (const Route& route : routes_) {
+        for (size_t type = 0; type <= treeTypes_.size(); type++) {
+            const Route::Latency* latency = route.series_[type].latency.load(std::memory_order_acquire);
+            if (latency == nullptr) {
+                continue;
+            }
+            LatencyHistogram::Summary total = latency->total.summarize();
+            if (total.count == 0) {
+                continue;
+            }
+
+            out += first ? "{" : ",{";
+            first = false;
+            out += "\"operation\":\"";
+            out += route.operation_;
+            out += "\",\"treeType\":\"";
+            out += treeTypeName(type);
+            out += "\",\"total\":";
+            appendSummary(out, total);
+            out += ",\"phases\":{";
+            bool firstPhase = true;
+            for (size_t phase = 0; phase < REQUEST_PHASES; phase++) {
+                LatencyHistogram::Summary summary = latency->phases[phase].summarize();
+                if (summary.count == 0) {
+                    continue;
+                }
+                out += firstPhase ? "\"" : ",\"";
+                firstPhase = false;
+                out += PHASE_NAMES[phase];
+                out += "\":";
+                appendSummary(out, summary);
+            }
+            out += "}}";
+        }
+    }
+    out += "]}";
+}
+
+thread_local RequestTiming* RequestTiming::current_ = nullptr;
+
+RequestTiming::RequestTiming(RequestMetrics& metrics, RequestMetrics::Route& route, size_t treeType,
+                             std::string_view method, std::string_view path)
+    : metrics_(metrics), route_(route), treeType_(treeType), method_(method), path_(path),
+      start_(Clock::now()), phaseStart_(start_) {
+    current_ = this;
+}
+
+RequestTiming::RequestTiming(const RequestTiming& request, std::string target)
+    : metrics_(request.metrics_), route_(request.route_), treeType_(request.treeType_),
+      ownedTarget_(std::move(target)), start_(request.start_), phaseStart_(request.phaseStart_),
+      phase_(request.phase_), phases_(request.phases_), marked_(request.marked_) {
+    method_ = std::string_view(ownedTarget_).substr(0, request.method_.size());
+    path_ = std::string_view(ownedTarget_).substr(request.method_.size());
+}
+
+// A handler that throws never reaches finish(); the server answers it with
+// a 500.
+RequestTiming::~RequestTiming() {
+    if (current_ == this) {
+        current_ = nullptr;
+    }
+    if (pending_) {
+        if (status_ == 0) {
+            status_ = 500;
+        }
+        record();
+    }
+}
+
+void RequestTiming::mark(RequestPhase phase) {
+    if (RequestTiming* timing = current_) {
+        timing->switchTo(phase, Clock::now());
+        timing->marked_ = true;
+    }
+}
+
+std::shared_ptr<RequestTiming> RequestTiming::detach() {
+    RequestTiming* request = current_;
+    if (request == nullptr) {
+        return nullptr;
+    }
+    std::shared_ptr<RequestTiming> detached(new RequestTiming(*request, std::string(request->method_) + std::string(request->path_)));
+    request->detached_ = detached;
+    request->pending_ = false;
+    current_ = detached.get();
+    return detached;
+}
+
+// httplib leaves the status at -1 for handlers that do not set one and
+// answers 200.
+void RequestTiming::finish(int status) {
+    current_ = nullptr;
+    if (status < 0) {
+        status = 200;
+    }
+    if (std::shared_ptr<RequestTiming> detached = detached_.lock()) {
+        detached->status_ = status;
+    } else if (pending_) {
+        status_ = status;
+        pending_ = false;
+        record();
+    }
+}
+
+void RequestTiming::switchTo(RequestPhase phase, Clock::time_point now) {
+    phases_[static_cast<size_t>(phase_)] += now - phaseStart_;
+    phase_ = phase;
+    phaseStart_ = now;
+}
+
+void RequestTiming::record() {
+    Clock::time_point now = Clock::now();
+    switchTo(phase_, now);
+    std::chrono::nanoseconds total = now - start_;
+    route_.record(treeType_, total, marked_ ? &phases_ : nullptr, status_ >= 400 || aborted_);
+
+    if (metrics_.slowRequest().count() == 0 || total < metrics_.slowRequest()) {
+        return;
+    }
+    std::string line = "Slow request: ";
+    line += method_;
+    line += ' ';
+    line += path_;
+    line += " (" + route_.operation() + ", " + metrics_.treeTypeName(treeType_) + ") status ";
+    line += std::to_string(status_);
+    if (aborted_) {
+        line += " aborted";
+    }
+    line += " in ";
+    appendMillis(line, total);
+    if (marked_) {
+        for (size_t phase = 0; phase < REQUEST_PHASES; phase++) {
+            line += phase == 0 ? ": " : ", ";
+            line += PHASE_NAMES[phase];
+            line += ' ';
+            appendMillis(line, phases_[phase]);
+        }
+    }
+    line += '\n';
+    // One write, so lines from concurrent requests do not interleave.
+    std::cerr << line << std::flush;
+}
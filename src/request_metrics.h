@@ -0,0 +1,203 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The parts of a request timed separately: reading the request, the tree
+// operation, and writing the response (for a streamed response, until the
+// last chunk has been handed to the connection).
+enum class RequestPhase {
+    PARSE,
+    TREE,
+    SERIALIZE,
+};
+
+constexpr size_t REQUEST_PHASES = 3;
+
+// A log-linear histogram of durations in nanoseconds, as in HdrHistogram:
+// every power of two is split into 2^SUB_BUCKET_BITS equal buckets, so a
+// value is known to within 1/32 of itself from 32ns up to 2^40ns (18
+// minutes; longer ones are counted there). Recording is one relaxed
+// increment plus a compare for the extremes, and the range and resolution
+// need no tuning per route.
+class LatencyHistogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 5;
+    static constexpr unsigned MAX_BITS = 40;
+    static constexpr size_t BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    void record(uint64_t nanos);
+
+    struct Summary {
+        uint64_t count = 0;
+        uint64_t min = 0;
+        uint64_t max = 0;
+        // From the bucket midpoints, so within the same 1/32.
+        double mean = 0;
+        // Each is the upper bound of the bucket holding that quantile, or
+        // max if that is lower.
+        uint64_t p50 = 0;
+        uint64_t p90 = 0;
+        uint64_t p99 = 0;
+        uint64_t p999 = 0;
+    };
+
+    Summary summarize() const;
+
+    static size_t bucketIndex(uint64_t nanos);
+    static uint64_t bucketLowest(size_t index);
+    static uint64_t bucketHighest(size_t index);
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts_{};
+    std::atomic<uint64_t> min_{UINT64_MAX};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Request counters and latency histograms for the HTTP routes, labelled by
+// operation and by the type of the tree a request addressed, rendered in the
+// Prometheus text exposition format. The series of a route are allocated
+// when it is registered, so recording a request is a few relaxed atomic
+// increments with no lock. Each series also keeps a LatencyHistogram of the
+// whole request and of each phase for GET /debug/latency; those are
+// allocated by the first request that needs them.
+class RequestMetrics {
+public:
+    // Upper bounds of the latency buckets in seconds; +Inf is implied.
+    static constexpr std::array<double, 14> BUCKETS = {
+        0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001,
+        0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 1.0
+    };
+
+    class Route {
+    public:
+        // treeType is an index from treeTypeIndex(), or noTree(). phases is
+        // null when the handler did not mark its phases.
+        void record(size_t treeType, std::chrono::nanoseconds elapsed,
+                    const std::array<std::chrono::nanoseconds, REQUEST_PHASES>* phases, bool failed);
+
+        const std::string& operation() const {
+            return operation_;
+        }
+
+    private:
+        friend class RequestMetrics;
+
+        struct Latency {
+            LatencyHistogram total;
+            std::array<LatencyHistogram, REQUEST_PHASES> phases;
+        };
+
+        struct Series {
+            std::array<std::atomic<uint64_t>, BUCKETS.size() + 1> buckets{};
+            std::atomic<uint64_t> errors{0};
+            std::atomic<uint64_t> nanos{0};
+            std::atomic<Latency*> latency{nullptr};
+
+            ~Series() {
+                delete latency.load(std::memory_order_relaxed);
+            }
+        };
+
+        std::string operation_;
+        std::unique_ptr<Series[]> series_;
+    };
+
+    // Requests that take at least slowRequest are logged to stderr with
+    // their phases; zero logs none.
+    explicit RequestMetrics(std::vector<std::string> treeTypes, std::chrono::nanoseconds slowRequest = {});
+
+    // Registers a route before the server starts. The reference stays valid
+    // for the lifetime of the metrics.
+    Route& route(const std::string& operation);
+
+    size_t treeTypeIndex(const std::string& type) const;
+
+    size_t noTree() const {
+        return treeTypes_.size();
+    }
+
+    const std::string& treeTypeName(size_t treeType) const;
+
+    std::chrono::nanoseconds slowRequest() const {
+        return slowRequest_;
+    }
+
+    // Appends every series that has seen a request.
+    void render(std::string& out) const;
+
+    // Appends a JSON document with the latency percentiles, in microseconds,
+    // of every series that has seen a request.
+    void renderLatency(std::string& out) const;
+
+private:
+    std::vector<std::string> treeTypes_;
+    std::chrono::nanoseconds slowRequest_;
+    std::deque<Route> routes_;
+};
+
+// Times the phases of one request. The server keeps one on the stack around
+// each handler; while it lives it is the current timing of its thread, and
+// the handler calls mark() where the tree operation and the response begin.
+// Whatever precedes the first mark is parsing. A request whose handler never
+// marks is recorded as a total only.
+class RequestTiming {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // method and path must outlive the timing unless it is detached.
+    RequestTiming(RequestMetrics& metrics, RequestMetrics::Route& route, size_t treeType,
+                  std::string_view method, std::string_view path);
+    ~RequestTiming();
+
+    RequestTiming(const RequestTiming&) = delete;
+    RequestTiming& operator=(const RequestTiming&) = delete;
+
+    // Ends the current phase of this thread's request and starts phase.
+    static void mark(RequestPhase phase);
+
+    // For a response written after the handler returns: moves this thread's
+    // request into the returned timing, which records it when destroyed
+    // instead of when the handler returns. Null outside a request.
+    static std::shared_ptr<RequestTiming> detach();
+
+    // Called by the server once the handler has returned.
+    void finish(int status);
+
+    // The response could not be written in full.
+    void abort() {
+        aborted_ = true;
+    }
+
+private:
+    static thread_local RequestTiming* current_;
+
+    RequestMetrics& metrics_;
+    RequestMetrics::Route& route_;
+    size_t treeType_;
+    std::string_view method_;
+    std::string_view path_;
+    std::string ownedTarget_;
+    Clock::time_point start_;
+    Clock::time_point phaseStart_;
+    RequestPhase phase_ = RequestPhase::PARSE;
+    std::array<std::chrono::nanoseconds, REQUEST_PHASES> phases_{};
+    int status_ = 0;
+    bool marked_ = false;
+    bool aborted_ = false;
+    bool pending_ = true;
+    std::weak_ptr<RequestTiming> detached_;
+
+    // The detached copy of request; it owns the method and path.
+    RequestTiming(const RequestTiming& request, std::string target);
+
+    void switchTo(RequestPhase phase, Clock::time_point now);
+    void record();
+};
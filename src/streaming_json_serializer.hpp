@@ -0,0 +1,229 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "tree_visitor.h"
+#include "trees/order_statistics.hpp"
+
+// Writes the same document as JsonSerializer, byte for byte, without building
+// a DOM. Nodes are emitted in preorder and a node's right child index is
+// derived from the left subtree size, so the traversal only keeps a stack of
+// pending right children (O(depth)) plus a fixed-size output buffer that is
+// handed to the writer whenever it fills up.
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class StreamingJsonSerializer : public TreeVisitor<T, Allocator, Instrumentation> {
+public:
+    // Receives consecutive chunks of the document. Returning false aborts the
+    // traversal, e.g. when the client has gone away.
+    using Writer = std::function<bool(const char* data, size_t size)>;
+
+    explicit StreamingJsonSerializer(Writer writer, size_t buffer_size = 64 * 1024)
+        : writer_(std::move(writer)), buffer_size_(buffer_size) {
+        buffer_.reserve(buffer_size_);
+    }
+
+    void visit(const AVLTree<T, Allocator, Instrumentation>& tree) override {
+        writeTree("avl_tree", tree.getRoot(), [this](auto* node) {
+            append("\"balance\":");
+            appendInteger(static_cast<int>(node->balance));
+            append(",");
+        });
+    }
+
+    void visit(const RedBlackTree<T, Allocator, Instrumentation>& tree) override {
+        writeTree("red_black_tree", tree.getRoot(), [this](auto* node) {
+            append(node->color == RedBlackTree<T, Allocator, Instrumentation>::RED ? "\"color\":\"red\"," : "\"color\":\"black\",");
+        });
+    }
+
+    void visit(const ParentFreeRedBlackTree<T, Allocator, Instrumentation>& tree) override {
+        writeTree("parent_free_red_black_tree", tree.getRoot(), [this](auto* node) {
+            append(node->color == ParentFreeRedBlackTree<T, Allocator, Instrumentation>::RED ? "\"color\":\"red\"," : "\"color\":\"black\",");
+        });
+    }
+
+    void visit(const SplayTree<T, Allocator, Instrumentation>& tree) override {
+        writeTree("splay_tree", tree.getRoot(), [](auto*) {});
+    }
+
+    void visit(const TopDownSplayTree<T, Allocator, Instrumentation>& tree) override {
+        writeTree("top_down_splay_tree", tree.getRoot(), [](auto*) {});
+    }
+
+    void visit(const ScapegoatTree<T, Allocator, Instrumentation>& tree) override {
+        writeTree("scapegoat", tree.getRoot(), [](auto*) {});
+    }
+
+    void visit(const BBAlphaTree<T, Allocator, Instrumentation>& tree) override {
+        writeTree("bb_alpha", tree.getRoot(), [](auto*) {});
+    }
+
+    // Children ids come from the node counts of the earlier siblings'
+    // subtrees. B-trees are shallow, so counting them again at every level
+    // stays within a few passes over the nodes.
+    void visit(const BTree<T, Allocator, Instrumentation>& tree) override {
+        using NodeType = typename BTree<T, Allocator, Instrumentation>::Node;
+        append("{\"nodes\":[");
+
+        std::vector<std::pair<const NodeType*, size_t>> pending;
+        if (tree.getRoot() != nullptr) {
+            pending.emplace_back(tree.getRoot(), 0);
+        }
+
+        bool first = true;
+        std::vector<std::pair<const NodeType*, size_t>> children;
+        while (!pending.empty() && ok_) {
+            auto [node, id] = pending.back();
+            pending.pop_back();
+
+            append(first ? "{\"children\":[" : ",{\"children\":[");
+            first = false;
+
+            children.clear();
+            if (!node->leaf) {
+                size_t child_id = id + 1;
+                for (uint32_t i = 0; i <= node->count; i++) {
+                    if (i > 0) {
+                        append(",");
+                    }
+                    appendInteger(child_id);
+                    children.emplace_back(node->children[i], child_id);
+                    child_id += countNodes<NodeType>(node->children[i]);
+                }
+            }
+
+            append("],\"keys\":[");
+            for (uint32_t i = 0; i < node->count; i++) {
+                if (i > 0) {
+                    append(",");
+                }
+                appendKey(node->keys[i]);
+            }
+            append("]}");
+
+            pending.insert(pending.end(), children.rbegin(), children.rend());
+        }
+
+        append("],\"type\":\"btree\"}");
+        flush();
+    }
+
+    // False if the writer asked to stop before the document was complete.
+    bool completed() const {
+        return ok_;
+    }
+
+private:
+    Writer writer_;
+    size_t buffer_size_;
+    std::string buffer_;
+    bool ok_ = true;
+
+    template <typename NodeType, typename WriteFields>
+    void writeTree(const char* type, NodeType* root, WriteFields writeFields) {
+        append("{\"nodes\":[");
+
+        std::vector<std::pair<NodeType*, size_t>> pending;
+        if (root != nullptr) {
+            pending.emplace_back(root, 0);
+        }
+
+        bool first = true;
+        while (!pending.empty() && ok_) {
+            auto [node, id] = pending.back();
+            pending.pop_back();
+
+            size_t left_id = id + 1;
+            size_t right_id = id + 1 + subtreeSize(node->left);
+
+            append(first ? "{" : ",{");
+            first = false;
+
+            writeFields(node);
+            append("\"key\":");
+            appendKey(node->key);
+            append(",\"left\":");
+            appendId<NodeType>(node->left, left_id);
+            append(",\"right\":");
+            appendId<NodeType>(node->right, right_id);
+            append("}");
+
+            if (node->right != nullptr) {
+                pending.emplace_back(node->right, right_id);
+            }
+            if (node->left != nullptr) {
+                pending.emplace_back(node->left, left_id);
+            }
+        }
+
+        append("],\"type\":\"");
+        append(type);
+        append("\"}");
+        flush();
+    }
+
+    template <typename NodeType>
+    static size_t countNodes(const NodeType* node) {
+        size_t count = 1;
+        if (!node->leaf) {
+            for (uint32_t i = 0; i <= node->count; i++) {
+                count += countNodes<NodeType>(node->children[i]);
+            }
+        }
+        return count;
+    }
+
+    template <typename NodeType>
+    void appendId(NodeType* child, size_t id) {
+        if (child == nullptr) {
+            append("-1");
+        } else {
+            appendInteger(id);
+        }
+    }
+
+    void appendKey(const T& key) {
+        if constexpr (std::is_integral_v<T> && !std::is_same_v<T, bool>) {
+            appendInteger(key);
+        } else {
+            append(nlohmann::json(key).dump());
+        }
+    }
+
+    template <typename Integer>
+    void appendInteger(Integer value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer_.append(digits, result.ptr);
+        flushIfFull();
+    }
+
+    void append(const std::string& text) {
+        buffer_ += text;
+        flushIfFull();
+    }
+
+    void append(const char* text) {
+        buffer_ += text;
+        flushIfFull();
+    }
+
+    void flushIfFull() {
+        if (buffer_.size() >= buffer_size_) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (ok_ && !buffer_.empty()) {
+            ok_ = writer_(buffer_.data(), buffer_.size());
+        }
+        buffer_.clear();
+    }
+};
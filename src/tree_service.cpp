@@ -1,61 +1,507 @@
 #include "tree_service.h"
 #include "tree_visitor.h"
+#include "request_metrics.h"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <filesystem>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
-std::unique_ptr<TreeWrapper> TreeFactory::createTree(const std::string& treeType) {
-    if (treeType == "avl") {
-        return std::make_unique<ConcreteTreeWrapper<AVLTree<int>>>("avl");
-    } else if (treeType == "splay") {
-        return std::make_unique<ConcreteTreeWrapper<SplayTree<int>>>("splay");
-    } else if (treeType == "red_black") {
-        return std::make_unique<ConcreteTreeWrapper<RedBlackTree<int>>>("red_black");
-    } else if (treeType == "scapegoat") {
-        return std::make_unique<ConcreteTreeWrapper<ScapegoatTree<int>>>("scapegoat");
-    } else if (treeType == "bb_alpha") {
-        return std::make_unique<ConcreteTreeWrapper<BBAlphaTree<int>>>("bb_alpha");
+namespace {
+    constexpr size_t DEFAULT_RANGE_LIMIT = 100;
+    constexpr size_t MAX_RANGE_LIMIT = 10000;
+
+    // Binary batch entries are one op byte followed by a little-endian int32.
+    constexpr size_t BINARY_ENTRY_SIZE = 5;
+
+    BatchOp parseBatchOp(const std::string& name) {
+        if (name == "insert") {
+            return BatchOp::INSERT;
+        } else if (name == "remove") {
+            return BatchOp::REMOVE;
+        } else if (name == "search") {
+            return BatchOp::SEARCH;
+        }
+        throw std::invalid_argument("Unsupported batch op: " + name);
+    }
+
+    // Keys in request bodies, checked like those parsed from text.
+    template <typename Key>
+    Key jsonKey(const json& value) {
+        return requireValidKey(value.get<Key>());
+    }
+
+    template <typename Key>
+    std::vector<Key> jsonKeys(const json& values) {
+        std::vector<Key> keys = values.get<std::vector<Key>>();
+        for (const Key& key : keys) {
+            requireValidKey(key);
+        }
+        return keys;
+    }
+
+    template <typename Key>
+    std::vector<BatchEntry<Key>> parseJsonBatch(const std::string& body) {
+        auto reqJson = json::parse(body);
+        if (!reqJson.contains("ops") || !reqJson["ops"].is_array()) {
+            throw std::invalid_argument("Ops array is required");
+        }
+
+        std::vector<BatchEntry<Key>> entries;
+        entries.reserve(reqJson["ops"].size());
+        for (const auto& op : reqJson["ops"]) {
+            entries.push_back({parseBatchOp(op.at("op")), jsonKey<Key>(op.at("value"))});
+        }
+        return entries;
+    }
+
+    FrozenLayout parseFrozenLayout(const std::string& name) {
+        if (name == "eytzinger") {
+            return FrozenLayout::EYTZINGER;
+        } else if (name == "veb") {
+            return FrozenLayout::VEB;
+        }
+        throw std::invalid_argument("Unsupported layout: " + name);
+    }
+
+    std::vector<BatchEntry<int>> parseBinaryBatch(const std::string& body) {
+        if (body.size() % BINARY_ENTRY_SIZE != 0) {
+            throw std::invalid_argument("Binary batch length must be a multiple of 5 bytes");
+        }
+
+        std::vector<BatchEntry<int>> entries;
+        entries.reserve(body.size() / BINARY_ENTRY_SIZE);
+        for (size_t offset = 0; offset < body.size(); offset += BINARY_ENTRY_SIZE) {
+            auto byte = [&](size_t i) { return static_cast<uint32_t>(static_cast<uint8_t>(body[offset + i])); };
+
+            uint8_t op = byte(0);
+            if (op > static_cast<uint8_t>(BatchOp::SEARCH)) {
+                throw std::invalid_argument("Unsupported batch op code: " + std::to_string(op));
+            }
+            uint32_t value = byte(1) | (byte(2) << 8) | (byte(3) << 16) | (byte(4) << 24);
+            entries.push_back({static_cast<BatchOp>(op), static_cast<int32_t>(value)});
+        }
+        return entries;
     }
+
+    // Range bounds, cursors and /keys paths come as text. Numbers must use
+    // up the whole string.
+    template <typename Key>
+    Key parseKey(const std::string& text) {
+        if constexpr (std::is_same_v<Key, StringKey>) {
+            return StringKey(text);
+        } else {
+            Key key{};
+            auto result = std::from_chars(text.data(), text.data() + text.size(), key);
+            if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+                throw std::invalid_argument("Invalid key: " + text);
+            }
+            return requireValidKey(key);
+        }
+    }
+
+    // The inverse of parseKey. Doubles are written in the shortest form that
+    // reads back as the same value, so a cursor resumes exactly.
+    template <typename Key>
+    std::string formatKey(const Key& key) {
+        if constexpr (std::is_same_v<Key, StringKey>) {
+            return key.str();
+        } else {
+            char digits[32];
+            auto result = std::to_chars(digits, digits + sizeof(digits), key);
+            return std::string(digits, result.ptr);
+        }
+    }
+
+    template <typename Stored, typename Allocator>
+    std::unique_ptr<TreeWrapper> createTreeWithAllocator(const std::string& treeType, const SplayPolicy& splayPolicy) {
+        if (treeType == "avl") {
+            return std::make_unique<ConcreteTreeWrapper<AVLTree<Stored, Allocator, ServerInstrumentation>>>("avl");
+        } else if (treeType == "splay") {
+            return std::make_unique<ConcreteTreeWrapper<SplayTree<Stored, Allocator, ServerInstrumentation>>>("splay", splayPolicy);
+        } else if (treeType == "top_down_splay") {
+            return std::make_unique<ConcreteTreeWrapper<TopDownSplayTree<Stored, Allocator, ServerInstrumentation>>>("top_down_splay");
+        } else if (treeType == "red_black") {
+            return std::make_unique<ConcreteTreeWrapper<RedBlackTree<Stored, Allocator, ServerInstrumentation>>>("red_black");
+        } else if (treeType == "parent_free_red_black") {
+            return std::make_unique<ConcreteTreeWrapper<ParentFreeRedBlackTree<Stored, Allocator, ServerInstrumentation>>>("parent_free_red_black");
+        } else if (treeType == "scapegoat") {
+            return std::make_unique<ConcreteTreeWrapper<ScapegoatTree<Stored, Allocator, ServerInstrumentation>>>("scapegoat");
+        } else if (treeType == "bb_alpha") {
+            return std::make_unique<ConcreteTreeWrapper<BBAlphaTree<Stored, Allocator, ServerInstrumentation>>>("bb_alpha");
+        } else if (treeType == "btree") {
+            return std::make_unique<ConcreteTreeWrapper<BTree<Stored, Allocator, ServerInstrumentation>>>("btree");
+        }
     
-    throw std::invalid_argument("Unsupported tree type: " + treeType);
+        throw std::invalid_argument("Unsupported tree type: " + treeType);
+    }
+
+    // Compact storage links nodes through 32-bit indices into one arena per
+    // node type, roughly halving the memory of a binary tree over int keys.
+    template <typename Stored>
+    std::unique_ptr<TreeWrapper> createTreeWithStorage(const std::string& treeType, const std::string& storage,
+                                                       const SplayPolicy& splayPolicy) {
+        if (storage == "pointer") {
+            return createTreeWithAllocator<Stored, std::allocator<Stored>>(treeType, splayPolicy);
+        } else if (storage == "compact") {
+            return createTreeWithAllocator<Stored, CompactAllocator<Stored>>(treeType, splayPolicy);
+        }
+
+        throw std::invalid_argument("Unsupported storage: " + storage);
+    }
+
+    // A tree with values stores map entries, so a lookup finds the key and
+    // its value in the same node.
+    template <typename Key>
+    std::unique_ptr<TreeWrapper> createTreeWithKeys(const std::string& treeType, const std::string& storage, bool values,
+                                                    const SplayPolicy& splayPolicy) {
+        if (values) {
+            return createTreeWithStorage<MapEntry<Key, std::string>>(treeType, storage, splayPolicy);
+        }
+        return createTreeWithStorage<Key>(treeType, storage, splayPolicy);
+    }
+}
+
+KeyType parseKeyType(const std::string& name) {
+    if (name == "int") {
+        return KeyType::INT;
+    } else if (name == "int64") {
+        return KeyType::INT64;
+    } else if (name == "double") {
+        return KeyType::DOUBLE;
+    } else if (name == "string") {
+        return KeyType::STRING;
+    }
+    throw std::invalid_argument("Unsupported key type: " + name);
+}
+
+std::string keyTypeName(KeyType keyType) {
+    switch (keyType) {
+        case KeyType::INT64:
+            return "int64";
+        case KeyType::DOUBLE:
+            return "double";
+        case KeyType::STRING:
+            return "string";
+        case KeyType::INT:
+        default:
+            return "int";
+    }
+}
+
+SplayPolicy parseSplayPolicy(const std::string& spec) {
+    SplayPolicy policy;
+    size_t colon = spec.find(':');
+    std::string mode = spec.substr(0, colon);
+    std::string argument = colon == std::string::npos ? "" : spec.substr(colon + 1);
+    bool needsArgument = mode == "probabilistic" || mode == "depth" || mode == "periodic";
+    if (needsArgument == argument.empty()) {
+        throw std::invalid_argument("Unsupported splay policy: " + spec);
+    }
+
+    if (mode == "full") {
+        policy.mode = SplayPolicy::Mode::FULL;
+    } else if (mode == "semi") {
+        policy.mode = SplayPolicy::Mode::SEMI;
+    } else if (mode == "probabilistic") {
+        policy.mode = SplayPolicy::Mode::PROBABILISTIC;
+        policy.probability = std::stod(argument);
+        if (!(policy.probability > 0.0 && policy.probability <= 1.0)) {
+            throw std::invalid_argument("Splay probability must be in (0, 1]: " + argument);
+        }
+    } else if (mode == "depth") {
+        policy.mode = SplayPolicy::Mode::DEPTH;
+        policy.depth = std::stoul(argument);
+    } else if (mode == "periodic") {
+        policy.mode = SplayPolicy::Mode::PERIODIC;
+        policy.period = std::stoull(argument);
+        if (policy.period == 0) {
+            throw std::invalid_argument("Splay period must be positive");
+        }
+    } else {
+        throw std::invalid_argument("Unsupported splay policy: " + spec);
+    }
+    return policy;
+}
+
+// Probabilities are written in the shortest form that reads back exactly,
+// so a policy survives the log and snapshots unchanged.
+std::string splayPolicyName(const SplayPolicy& policy) {
+    switch (policy.mode) {
+        case SplayPolicy::Mode::SEMI:
+            return "semi";
+        case SplayPolicy::Mode::PROBABILISTIC:
+            return "probabilistic:" + formatKey(policy.probability);
+        case SplayPolicy::Mode::DEPTH:
+            return "depth:" + std::to_string(policy.depth);
+        case SplayPolicy::Mode::PERIODIC:
+            return "periodic:" + std::to_string(policy.period);
+        case SplayPolicy::Mode::FULL:
+        default:
+            return "full";
+    }
+}
+
+std::unique_ptr<TreeWrapper> TreeFactory::createTree(const std::string& treeType, const std::string& storage, const std::string& keyType,
+                                                     bool values, const std::string& splayPolicy) {
+    SplayPolicy policy;
+    if (!splayPolicy.empty()) {
+        if (treeType != "splay") {
+            throw std::invalid_argument("Splay policies only apply to splay trees");
+        }
+        policy = parseSplayPolicy(splayPolicy);
+    }
+
+    switch (parseKeyType(keyType)) {
+        case KeyType::INT64:
+            return createTreeWithKeys<int64_t>(treeType, storage, values, policy);
+        case KeyType::DOUBLE:
+            return createTreeWithKeys<double>(treeType, storage, values, policy);
+        case KeyType::STRING:
+            return createTreeWithKeys<StringKey>(treeType, storage, values, policy);
+        case KeyType::INT:
+        default:
+            return createTreeWithKeys<int>(treeType, storage, values, policy);
+    }
+}
+
+std::vector<std::string> TreeFactory::treeTypes() {
+    return {"avl", "splay", "top_down_splay", "red_black", "parent_free_red_black", "scapegoat", "bb_alpha", "btree"};
 }
 
 std::string TreeManager::generateId() {
     return std::to_string(++current_id);
 }
 
-std::string TreeManager::createTree(const std::string& treeType) {
-    std::string id = generateId();
-    trees_[id] = TreeFactory::createTree(treeType);
+TreeManager::~TreeManager() {
+    {
+        std::lock_guard lock(stopMutex_);
+        stopping_ = true;
+    }
+    stopCv_.notify_all();
+    if (snapshotter_.joinable()) {
+        snapshotter_.join();
+    }
+    // The trees point at the log, which is declared after them.
+    trees_.clear();
+}
+
+// Registry changes are logged under the registry lock so that a tree's
+// CREATE precedes its writes and its DROP follows the ones made before it.
+std::string TreeManager::createTree(const std::string& treeType, const std::string& storage, const std::string& keyType,
+                                    bool values, const std::string& splayPolicy) {
+    std::shared_ptr<TreeWrapper> tree = TreeFactory::createTree(treeType, storage, keyType, values, splayPolicy);
+    
+    std::string id;
+    uint64_t lsn = 0;
+    {
+        std::unique_lock lock(mutex_);
+        id = generateId();
+        if (log_) {
+            lsn = log_->appendCreate(current_id, tree->getType(), tree->getStorage(), keyTypeName(tree->keyType()), tree->hasValues(),
+                                     tree->splayPolicy());
+            tree->attachLog(log_.get(), current_id, lsn);
+        }
+        trees_[id] = std::move(tree);
+    }
+    if (log_) {
+        log_->commit(lsn);
+    }
     return id;
 }
 
-TreeWrapper* TreeManager::getTree(const std::string& id) {
+std::shared_ptr<TreeWrapper> TreeManager::getTree(const std::string& id) {
+    std::shared_lock lock(mutex_);
     auto it = trees_.find(id);
     if (it == trees_.end()) {
         return nullptr;
     }
-    return it->second.get();
+    return it->second;
 }
 
 bool TreeManager::removeTree(const std::string& id) {
-    return trees_.erase(id) > 0;
+    std::shared_ptr<TreeWrapper> removed;
+    uint64_t lsn = 0;
+    {
+        std::unique_lock lock(mutex_);
+        auto it = trees_.find(id);
+        if (it == trees_.end()) {
+            return false;
+        }
+        if (log_) {
+            lsn = log_->append(WalOp::DROP, std::stoull(id), 0, 0, {});
+        }
+        removed = std::move(it->second);
+        trees_.erase(it);
+    }
+    if (log_) {
+        log_->commit(lsn);
+    }
+    // The tree itself is destroyed here, outside the registry lock, unless a
+    // handler still holds it.
+    return true;
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<TreeWrapper>>> TreeManager::allTrees() {
+    std::shared_lock lock(mutex_);
+    return {trees_.begin(), trees_.end()};
 }
 
 json TreeManager::listTrees() {
     json result = json::array();
+    std::shared_lock lock(mutex_);
     for (const auto& [id, tree] : trees_) {
         result.push_back({
             {"id", id},
-            {"type", tree->getType()}
+            {"type", tree->getType()},
+            {"storage", tree->getStorage()},
+            {"keyType", keyTypeName(tree->keyType())},
+            {"values", tree->hasValues()},
+            {"splayPolicy", tree->splayPolicy().empty() ? json(nullptr) : json(tree->splayPolicy())},
+            {"frozen", tree->isFrozen()}
         });
     }
     return result;
 }
 
-void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
+void TreeManager::enableDurability(const DurabilityOptions& options) {
+    durability_ = options;
+    std::filesystem::create_directories(options.dataDir);
+
+    std::unique_lock lock(mutex_);
+    uint64_t snapshotLsn = 0;
+    uint64_t lastId = 0;
+    std::unordered_map<std::string, uint64_t> checkpointed;
+    SnapshotWriter::load(options.dataDir, snapshotLsn, lastId, [&](TreeCheckpoint&& saved) {
+        std::shared_ptr<TreeWrapper> tree = TreeFactory::createTree(saved.type, saved.storage, saved.keyType, saved.values,
+                                                                    saved.splayPolicy);
+        tree->restore(saved);
+        std::string id = std::to_string(saved.id);
+        checkpointed[id] = saved.lsn;
+        trees_[id] = std::move(tree);
+    });
+    current_id = std::max<size_t>(current_id, lastId);
+
+    uint64_t lastLsn = WriteAheadLog::replay(options.dataDir, snapshotLsn, [&](const WalRecord& record) {
+        replay(record, checkpointed);
+    });
+    for (const auto& [id, lsn] : checkpointed) {
+        lastLsn = std::max(lastLsn, lsn);
+    }
+
+    log_ = std::make_unique<WriteAheadLog>(options, lastLsn + 1);
+    for (const auto& [id, tree] : trees_) {
+        tree->attachLog(log_.get(), std::stoull(id), lastLsn);
+    }
+
+    if (options.snapshotInterval.count() > 0) {
+        snapshotter_ = std::thread([this] {
+            std::unique_lock stopLock(stopMutex_);
+            while (!stopCv_.wait_for(stopLock, durability_.snapshotInterval, [this] { return stopping_; })) {
+                stopLock.unlock();
+                try {
+                    snapshot();
+                } catch (const std::exception& e) {
+                    std::cerr << "Snapshot failed: " << e.what() << std::endl;
+                }
+                stopLock.lock();
+            }
+        });
+    }
+}
+
+// Records a tree's snapshot already includes are skipped. A write that threw
+// when it was made throws again here and is skipped the same way.
+void TreeManager::replay(const WalRecord& record, const std::unordered_map<std::string, uint64_t>& checkpointed) {
+    std::string id = std::to_string(record.tree);
+    auto saved = checkpointed.find(id);
+    if (saved != checkpointed.end() && record.lsn <= saved->second) {
+        return;
+    }
+    current_id = std::max<size_t>(current_id, record.tree);
+
+    if (record.op == WalOp::CREATE) {
+        trees_[id] = TreeFactory::createTree(record.type, record.storage, record.keyType, record.values,
+                                             record.splayPolicy);
+        return;
+    }
+    if (record.op == WalOp::DROP) {
+        trees_.erase(id);
+        return;
+    }
+
+    auto it = trees_.find(id);
+    if (it == trees_.end()) {
+        return;
+    }
+    try {
+        it->second->replay(record);
+    } catch (const std::exception&) {
+    }
+}
+
+// Everything up to the rotation is covered by the snapshot. Writes made
+// while the trees are being copied land in the new segment; each tree
+// records the last one it includes so replay skips exactly those.
+void TreeManager::snapshot() {
+    if (!log_) {
+        throw std::logic_error("Durability is not enabled");
+    }
+    std::lock_guard guard(snapshotMutex_);
+    uint64_t lsn = log_->rotate();
+
+    std::vector<std::pair<std::string, std::shared_ptr<TreeWrapper>>> trees;
+    size_t lastId;
+    {
+        std::shared_lock lock(mutex_);
+        trees.assign(trees_.begin(), trees_.end());
+        lastId = current_id;
+    }
+
+    SnapshotWriter writer(durability_.dataDir, lsn, lastId);
+    for (const auto& [id, tree] : trees) {
+        TreeCheckpoint saved;
+        saved.id = std::stoull(id);
+        saved.type = tree->getType();
+        saved.storage = tree->getStorage();
+        saved.splayPolicy = tree->splayPolicy();
+        tree->checkpoint(saved);
+        writer.add(saved);
+    }
+    writer.commit();
+    WriteAheadLog::removeSegmentsUpTo(durability_.dataDir, lsn);
+}
+
+void setupTreeServer(httplib::Server& server, TreeManager& treeManager, const ServerOptions& options) {
     server.set_mount_point("/", "./static");
+
+    // Counts and times every request of a route under operation and the type
+    // of the tree named in the path, if any. The tree is looked up before
+    // the handler runs so a DELETE is still filed under its type. Handlers
+    // mark where their tree operation and their response begin.
+    auto metrics = std::make_shared<RequestMetrics>(TreeFactory::treeTypes(), options.slowRequest);
+    auto measured = [&treeManager, metrics](const std::string& operation, httplib::Server::Handler handler) {
+        RequestMetrics::Route& route = metrics->route(operation);
+        return [&treeManager, metrics, &route, handler = std::move(handler)](const httplib::Request& req, httplib::Response& res) {
+            size_t treeType = metrics->noTree();
+            if (req.matches.size() > 1) {
+                if (std::shared_ptr<TreeWrapper> tree = treeManager.getTree(req.matches[1])) {
+                    treeType = metrics->treeTypeIndex(tree->getType());
+                }
+            }
+            RequestTiming timing(*metrics, route, treeType, req.method, req.path);
+            handler(req, res);
+            timing.finish(res.status);
+        };
+    };
     
-    server.Post("/trees", [&](const httplib::Request& req, httplib::Response& res) {
+    server.Post("/trees", measured("create", [&](const httplib::Request& req, httplib::Response& res) {
         try {
             auto reqJson = json::parse(req.body);
             
@@ -66,19 +512,32 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
             }
             
             std::string treeType = reqJson["type"];
-            std::string treeId = treeManager.createTree(treeType);
+            std::string storage = reqJson.value("storage", "pointer");
+            std::string keyType = reqJson.value("keyType", "int");
+            bool values = reqJson.value("values", false);
+            std::string splayPolicy = reqJson.value("splayPolicy", "");
+            RequestTiming::mark(RequestPhase::TREE);
+            std::string treeId = treeManager.createTree(treeType, storage, keyType, values, splayPolicy);
+            RequestTiming::mark(RequestPhase::SERIALIZE);
             
-            res.set_content(json{{"id", treeId}, {"type", treeType}}.dump(), "application/json");
+            res.set_content(json{
+                {"id", treeId},
+                {"type", treeType},
+                {"storage", storage},
+                {"keyType", keyType},
+                {"values", values},
+                {"splayPolicy", splayPolicy.empty() ? json(nullptr) : json(splayPolicy)}
+            }.dump(), "application/json");
         }
         catch (const std::exception& e) {
             res.status = 400;
             res.set_content(json{{"error", e.what()}}.dump(), "application/json");
         }
-    });
+    }));
     
-    server.Get(R"(/trees/([^/]+))", [&](const httplib::Request& req, httplib::Response& res) {
+    server.Get(R"(/trees/([^/]+))", measured("get", [&](const httplib::Request& req, httplib::Response& res) {
         std::string id = req.matches[1];
-        TreeWrapper* tree = treeManager.getTree(id);
+        std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
         
         if (!tree) {
             res.status = 404;
@@ -86,14 +545,27 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
             return;
         }
         
-        json treeJson = tree->getJson();
-        res.set_content(treeJson.dump(), "application/json");
-    });
+        // The document is written after the handler returns, so the request
+        // is recorded once the provider is done with it.
+        RequestTiming::mark(RequestPhase::SERIALIZE);
+        std::shared_ptr<RequestTiming> timing = RequestTiming::detach();
+        res.set_chunked_content_provider("application/json", [tree, timing](size_t, httplib::DataSink& sink) {
+            bool completed = tree->writeJson([&sink](const char* data, size_t size) {
+                return sink.write(data, size);
+            });
+            if (completed) {
+                sink.done();
+            } else if (timing) {
+                timing->abort();
+            }
+            return completed;
+        });
+    }));
     
-    server.Post(R"(/trees/([^/]+)/insert)", [&](const httplib::Request& req, httplib::Response& res) {
+    server.Post(R"(/trees/([^/]+)/insert)", measured("insert", [&](const httplib::Request& req, httplib::Response& res) {
         try {
             std::string id = req.matches[1];
-            TreeWrapper* tree = treeManager.getTree(id);
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
             
             if (!tree) {
                 res.status = 404;
@@ -109,8 +581,12 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
                 return;
             }
             
-            int value = reqJson["value"];
-            tree->insert(value);
+            withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key value = jsonKey<Key>(reqJson["value"]);
+                RequestTiming::mark(RequestPhase::TREE);
+                keyed.insert(value);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+            });
             
             res.set_content(json{{"success", true}}.dump(), "application/json");
         }
@@ -118,12 +594,12 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
             res.status = 400;
             res.set_content(json{{"error", e.what()}}.dump(), "application/json");
         }
-    });
+    }));
     
-    server.Post(R"(/trees/([^/]+)/remove)", [&](const httplib::Request& req, httplib::Response& res) {
+    server.Post(R"(/trees/([^/]+)/remove)", measured("remove", [&](const httplib::Request& req, httplib::Response& res) {
         try {
             std::string id = req.matches[1];
-            TreeWrapper* tree = treeManager.getTree(id);
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
             
             if (!tree) {
                 res.status = 404;
@@ -139,8 +615,12 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
                 return;
             }
             
-            int value = reqJson["value"];
-            tree->remove(value);
+            withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key value = jsonKey<Key>(reqJson["value"]);
+                RequestTiming::mark(RequestPhase::TREE);
+                keyed.remove(value);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+            });
             
             res.set_content(json{{"success", true}}.dump(), "application/json");
         }
@@ -148,12 +628,12 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
             res.status = 400;
             res.set_content(json{{"error", e.what()}}.dump(), "application/json");
         }
-    });
+    }));
 
-    server.Post(R"(/trees/([^/]+)/search)", [&](const httplib::Request& req, httplib::Response& res) {
+    server.Post(R"(/trees/([^/]+)/search)", measured("search", [&](const httplib::Request& req, httplib::Response& res) {
         try {
             std::string id = req.matches[1];
-            TreeWrapper* tree = treeManager.getTree(id);
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
             
             if (!tree) {
                 res.status = 404;
@@ -169,10 +649,15 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
                 return;
             }
             
-            int value = reqJson["value"];
-            bool found = tree->search(value);
+            bool found = withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key value = jsonKey<Key>(reqJson["value"]);
+                RequestTiming::mark(RequestPhase::TREE);
+                bool found = keyed.search(value);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                return found;
+            });
             
-            bool treeModified = (tree->getType() == "splay");
+            bool treeModified = tree->readsModifyTree() && !tree->isFrozen();
             
             res.set_content(json{
                 {"found", found},
@@ -183,22 +668,537 @@ void setupTreeServer(httplib::Server& server, TreeManager& treeManager) {
             res.status = 400;
             res.set_content(json{{"error", e.what()}}.dump(), "application/json");
         }
-    });
+    }));
     
-    server.Get("/trees", [&](const httplib::Request& req, httplib::Response& res) {
+    // Adds {"values": [...]} as if each were inserted: AVL, scapegoat and
+    // both red-black trees keep every copy of a repeated key, the other
+    // trees and trees with values keep each key once.
+    server.Post(R"(/trees/([^/]+)/bulk)", measured("bulk", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            auto reqJson = json::parse(req.body);
+            
+            if (!reqJson.contains("values") || !reqJson["values"].is_array()) {
+                res.status = 400;
+                res.set_content(json{{"error", "Values array is required"}}.dump(), "application/json");
+                return;
+            }
+            
+            withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                std::vector<Key> values = jsonKeys<Key>(reqJson["values"]);
+                RequestTiming::mark(RequestPhase::TREE);
+                keyed.bulkLoad(values);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+            });
+            
+            res.set_content(json{{"success", true}}.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+    
+    server.Post(R"(/trees/([^/]+)/rank)", measured("rank", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            auto reqJson = json::parse(req.body);
+            
+            if (!reqJson.contains("value")) {
+                res.status = 400;
+                res.set_content(json{{"error", "Value is required"}}.dump(), "application/json");
+                return;
+            }
+            
+            size_t rank = withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key value = jsonKey<Key>(reqJson["value"]);
+                RequestTiming::mark(RequestPhase::TREE);
+                size_t rank = keyed.rank(value);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                return rank;
+            });
+            
+            bool treeModified = tree->readsModifyTree();
+            
+            res.set_content(json{
+                {"rank", rank},
+                {"treeModified", treeModified}
+            }.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+
+    server.Post(R"(/trees/([^/]+)/select)", measured("select", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            auto reqJson = json::parse(req.body);
+            
+            if (!reqJson.contains("k")) {
+                res.status = 400;
+                res.set_content(json{{"error", "k is required"}}.dump(), "application/json");
+                return;
+            }
+            
+            size_t k = reqJson["k"];
+            json value = withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                RequestTiming::mark(RequestPhase::TREE);
+                Key value = keyed.select(k);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                return json(value);
+            });
+            
+            bool treeModified = tree->readsModifyTree();
+            
+            res.set_content(json{
+                {"value", value},
+                {"treeModified", treeModified}
+            }.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+
+    server.Post(R"(/trees/([^/]+)/count)", measured("count", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            auto reqJson = json::parse(req.body);
+            
+            if (!reqJson.contains("from") || !reqJson.contains("to")) {
+                res.status = 400;
+                res.set_content(json{{"error", "Range bounds from and to are required"}}.dump(), "application/json");
+                return;
+            }
+            
+            size_t count = withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key from = jsonKey<Key>(reqJson["from"]);
+                Key to = jsonKey<Key>(reqJson["to"]);
+                RequestTiming::mark(RequestPhase::TREE);
+                size_t count = keyed.countRange(from, to);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                return count;
+            });
+            
+            bool treeModified = tree->readsModifyTree();
+            
+            res.set_content(json{
+                {"count", count},
+                {"treeModified", treeModified}
+            }.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+    
+    server.Get(R"(/trees/([^/]+)/range)", measured("range", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            size_t limit = DEFAULT_RANGE_LIMIT;
+            if (req.has_param("limit")) {
+                limit = std::clamp<size_t>(std::stoul(req.get_param_value("limit")), 1, MAX_RANGE_LIMIT);
+            }
+            
+            withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                std::optional<Key> from;
+                std::optional<Key> to;
+                bool exclusive = false;
+                
+                // The cursor is the last key of the previous page, so the next
+                // page resumes strictly after it.
+                if (req.has_param("cursor")) {
+                    from = parseKey<Key>(req.get_param_value("cursor"));
+                    exclusive = true;
+                } else if (req.has_param("from")) {
+                    from = parseKey<Key>(req.get_param_value("from"));
+                }
+                if (req.has_param("to")) {
+                    to = parseKey<Key>(req.get_param_value("to"));
+                }
+                
+                RequestTiming::mark(RequestPhase::TREE);
+                std::vector<Key> keys = keyed.scan(from, exclusive, to, limit + 1);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                
+                json cursor = nullptr;
+                if (keys.size() > limit) {
+                    keys.pop_back();
+                    cursor = formatKey(keys.back());
+                }
+                
+                bool treeModified = keyed.readsModifyTree();
+                
+                res.set_content(json{
+                    {"keys", keys},
+                    {"cursor", cursor},
+                    {"treeModified", treeModified}
+                }.dump(), "application/json");
+            });
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+    
+    // Point access to trees created with "values": true. The key is the
+    // rest of the path, read like a range bound, and the value is any JSON
+    // document. Values are stored as the JSON text and sent back as they
+    // were stored, without parsing them again.
+    server.Put(R"(/trees/([^/]+)/keys/(.+))", measured("put", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            if (req.body.empty()) {
+                res.status = 400;
+                res.set_content(json{{"error", "Value is required"}}.dump(), "application/json");
+                return;
+            }
+            
+            std::string value = json::parse(req.body).dump();
+            bool inserted = false;
+            
+            withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key key = parseKey<Key>(req.matches[2]);
+                RequestTiming::mark(RequestPhase::TREE);
+                inserted = keyed.putValue(key, value);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+            });
+            
+            res.set_content(json{{"inserted", inserted}}.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+    
+    server.Get(R"(/trees/([^/]+)/keys/(.+))", measured("get_value", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key key = parseKey<Key>(req.matches[2]);
+                RequestTiming::mark(RequestPhase::TREE);
+                std::optional<std::string> value = keyed.getValue(key);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                
+                if (!value) {
+                    res.status = 404;
+                    res.set_content(json{{"error", "Key not found"}}.dump(), "application/json");
+                    return;
+                }
+                
+                // A key inserted through /insert or a set operation has no value.
+                std::string body = "{\"key\":" + json(key).dump() + ",\"value\":";
+                body += value->empty() ? "null" : *value;
+                body += "}";
+                res.set_content(body, "application/json");
+            });
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+    
+    server.Delete(R"(/trees/([^/]+)/keys/(.+))", measured("erase", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            bool removed = false;
+            
+            withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                Key key = parseKey<Key>(req.matches[2]);
+                RequestTiming::mark(RequestPhase::TREE);
+                removed = keyed.erase(key);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+            });
+            
+            res.set_content(json{{"removed", removed}}.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+    
+    // Accepts {"ops": [{"op": "insert", "value": 1}, ...]} or, with
+    // Content-Type application/octet-stream, packed binary entries. Binary
+    // requests get one result byte per op back; JSON requests get a results array.
+    server.Post(R"(/trees/([^/]+)/batch)", measured("batch", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            bool binary = req.get_header_value("Content-Type").rfind("application/octet-stream", 0) == 0;
+            std::vector<uint8_t> results = withKeys(*tree, [&]<typename Key>(KeyedTreeWrapper<Key>& keyed) {
+                std::vector<BatchEntry<Key>> entries;
+                if (!binary) {
+                    entries = parseJsonBatch<Key>(req.body);
+                } else if constexpr (std::is_same_v<Key, int>) {
+                    entries = parseBinaryBatch(req.body);
+                } else {
+                    throw std::invalid_argument("Binary batches need a tree with int keys");
+                }
+                RequestTiming::mark(RequestPhase::TREE);
+                std::vector<uint8_t> results = keyed.applyBatch(entries);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                return results;
+            });
+            
+            if (binary) {
+                res.set_content(reinterpret_cast<const char*>(results.data()), results.size(), "application/octet-stream");
+                return;
+            }
+            
+            json resultsJson = json::array();
+            for (uint8_t result : results) {
+                resultsJson.push_back(result != 0);
+            }
+            
+            res.set_content(json{
+                {"results", resultsJson},
+                {"treeModified", tree->readsModifyTree()}
+            }.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+    
+    const std::pair<const char*, SetOperation> setOperations[] = {
+        {"union", SetOperation::UNION},
+        {"intersection", SetOperation::INTERSECTION},
+        {"difference", SetOperation::DIFFERENCE},
+    };
+    for (const auto& [name, op] : setOperations) {
+        server.Post(R"(/trees/([^/]+)/)" + std::string(name), measured(name, [&, op](const httplib::Request& req, httplib::Response& res) {
+            try {
+                std::string id = req.matches[1];
+                auto reqJson = json::parse(req.body);
+
+                if (!reqJson.contains("other")) {
+                    res.status = 400;
+                    res.set_content(json{{"error", "Other tree id is required"}}.dump(), "application/json");
+                    return;
+                }
+
+                std::string otherId = reqJson["other"];
+                std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+                std::shared_ptr<TreeWrapper> other = treeManager.getTree(otherId);
+
+                if (!tree || !other) {
+                    res.status = 404;
+                    res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                    return;
+                }
+
+                RequestTiming::mark(RequestPhase::TREE);
+                tree->combine(op, *other);
+                RequestTiming::mark(RequestPhase::SERIALIZE);
+                res.set_content(json{{"success", true}}.dump(), "application/json");
+            }
+            catch (const std::exception& e) {
+                res.status = 400;
+                res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+            }
+        }));
+    }
+
+    // Body is optional: {"layout": "eytzinger"} (the default) or {"layout": "veb"}.
+    server.Post(R"(/trees/([^/]+)/freeze)", measured("freeze", [&](const httplib::Request& req, httplib::Response& res) {
+        try {
+            std::string id = req.matches[1];
+            std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+            
+            if (!tree) {
+                res.status = 404;
+                res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+                return;
+            }
+            
+            std::string layout = "eytzinger";
+            if (!req.body.empty()) {
+                auto reqJson = json::parse(req.body);
+                if (reqJson.contains("layout")) {
+                    layout = reqJson["layout"];
+                }
+            }
+            RequestTiming::mark(RequestPhase::TREE);
+            tree->freeze(parseFrozenLayout(layout));
+            RequestTiming::mark(RequestPhase::SERIALIZE);
+            
+            res.set_content(json{{"frozen", true}, {"layout", layout}}.dump(), "application/json");
+        }
+        catch (const std::exception& e) {
+            res.status = 400;
+            res.set_content(json{{"error", e.what()}}.dump(), "application/json");
+        }
+    }));
+
+    server.Post(R"(/trees/([^/]+)/thaw)", measured("thaw", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string id = req.matches[1];
+        std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+        
+        if (!tree) {
+            res.status = 404;
+            res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+            return;
+        }
+        
+        RequestTiming::mark(RequestPhase::TREE);
+        tree->thaw();
+        RequestTiming::mark(RequestPhase::SERIALIZE);
+        res.set_content(json{{"frozen", false}}.dump(), "application/json");
+    }));
+    
+    server.Get("/trees", measured("list", [&](const httplib::Request& req, httplib::Response& res) {
+        RequestTiming::mark(RequestPhase::TREE);
         json treesList = treeManager.listTrees();
+        RequestTiming::mark(RequestPhase::SERIALIZE);
         res.set_content(treesList.dump(), "application/json");
-    });
+    }));
     
-    server.Delete(R"(/trees/([^/]+))", [&](const httplib::Request& req, httplib::Response& res) {
+    server.Delete(R"(/trees/([^/]+))", measured("delete", [&](const httplib::Request& req, httplib::Response& res) {
         std::string id = req.matches[1];
         
-        if (treeManager.removeTree(id)) {
+        RequestTiming::mark(RequestPhase::TREE);
+        bool removed = treeManager.removeTree(id);
+        RequestTiming::mark(RequestPhase::SERIALIZE);
+        if (removed) {
             res.set_content(json{{"success", true}}.dump(), "application/json");
         } else {
             res.status = 404;
             res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
         }
+    }));
+
+    server.Get(R"(/trees/([^/]+)/stats)", measured("stats", [&](const httplib::Request& req, httplib::Response& res) {
+        std::string id = req.matches[1];
+        std::shared_ptr<TreeWrapper> tree = treeManager.getTree(id);
+
+        if (!tree) {
+            res.status = 404;
+            res.set_content(json{{"error", "Tree not found"}}.dump(), "application/json");
+            return;
+        }
+
+        RequestTiming::mark(RequestPhase::TREE);
+        json stats = tree->getStats();
+        RequestTiming::mark(RequestPhase::SERIALIZE);
+        res.set_content(stats.dump(), "application/json");
+    }));
+
+    // Prometheus text format. Tree gauges are summed per tree type.
+    server.Get("/metrics", [&treeManager, metrics](const httplib::Request&, httplib::Response& res) {
+        std::vector<std::string> types = TreeFactory::treeTypes();
+        std::vector<size_t> trees(types.size()), keys(types.size()), bytes(types.size());
+        for (const auto& [id, tree] : treeManager.allTrees()) {
+            size_t type = metrics->treeTypeIndex(tree->getType());
+            if (type < types.size()) {
+                trees[type]++;
+                keys[type] += tree->size();
+                bytes[type] += tree->bytesAllocated();
+            }
+        }
+
+        std::string out;
+        const std::tuple<const char*, const char*, const std::vector<size_t>&> gauges[] = {
+            {"balancedtrees_trees", "Trees in the registry.", trees},
+            {"balancedtrees_tree_keys", "Keys held by the trees.", keys},
+            {"balancedtrees_tree_bytes_allocated", "Node memory held by the trees.", bytes},
+        };
+        for (const auto& [name, help, values] : gauges) {
+            out += std::string("# HELP ") + name + " " + help + "\n";
+            out += std::string("# TYPE ") + name + " gauge\n";
+            for (size_t type = 0; type < types.size(); type++) {
+                out += std::string(name) + "{tree_type=\"" + types[type] + "\"} " + std::to_string(values[type]) + "\n";
+            }
+        }
+        metrics->render(out);
+        res.set_content(out, "text/plain; version=0.0.4");
+    });
+
+    // Latency percentiles of every route and tree type, whole requests and
+    // each phase.
+    server.Get("/debug/latency", [metrics](const httplib::Request&, httplib::Response& res) {
+        std::string out;
+        metrics->renderLatency(out);
+        res.set_content(out, "application/json");
     });
 
     std::cout << "Serving static files from: " << std::filesystem::absolute("./static").string() << std::endl;
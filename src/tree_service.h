@@ -1,83 +1,1011 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 #include <random>
 #include <httplib.h>
 #include <nlohmann/json.hpp>
 
 #include "trees/avl_tree.hpp"
+#include "trees/b_tree.hpp"
 #include "trees/bb_alpha_tree.hpp"
+#include "trees/frozen_tree.hpp"
+#include "trees/parent_free_red_black_tree.hpp"
 #include "trees/red_black_tree.hpp"
 #include "trees/scapegoat_tree.hpp"
 #include "trees/splay_tree.hpp"
+#include "trees/string_key.hpp"
+#include "trees/top_down_splay_tree.hpp"
+#include "trees/tree_map.hpp"
 
 #include "tree_visitor.h"
 #include "json_serializer.hpp"
+#include "persistence.h"
+#include "streaming_json_serializer.hpp"
 
 using json = nlohmann::json;
 
+// Trees served over HTTP count comparisons, rotations, splay steps and
+// rebuilds only when the server is built with -DTREE_INSTRUMENTATION; the
+// counters then show up in GET /trees/{id}/stats.
+#ifdef TREE_INSTRUMENTATION
+using ServerInstrumentation = CountingInstrumentation;
+#else
+using ServerInstrumentation = NoInstrumentation;
+#endif
+
+// String keys travel as plain JSON strings.
+inline void to_json(json& out, const StringKey& key) {
+    out = key.str();
+}
+
+inline void from_json(const json& in, StringKey& key) {
+    key = StringKey(in.get<std::string>());
+}
+
+// Tree documents show the keys of a map tree, not its values.
+template <typename K, typename V>
+void to_json(json& out, const MapEntry<K, V>& entry) {
+    out = entry.key;
+}
+
+// The key types a tree can be created with, named "int" (the default),
+// "int64", "double" and "string" over HTTP. Every tree type is compiled once
+// per key type; see withKeys().
+enum class KeyType : uint8_t {
+    INT,
+    INT64,
+    DOUBLE,
+    STRING
+};
+
+KeyType parseKeyType(const std::string& name);
+std::string keyTypeName(KeyType keyType);
+
+// Splay trees take a policy over HTTP as "full" (the default), "semi",
+// "probabilistic:<p>", "depth:<nodes>" or "periodic:<k>"; see SplayPolicy.
+SplayPolicy parseSplayPolicy(const std::string& spec);
+std::string splayPolicyName(const SplayPolicy& policy);
+
+template <typename Key>
+constexpr KeyType keyTypeOf() {
+    if constexpr (std::is_same_v<Key, int>) {
+        return KeyType::INT;
+    } else if constexpr (std::is_same_v<Key, int64_t>) {
+        return KeyType::INT64;
+    } else if constexpr (std::is_same_v<Key, double>) {
+        return KeyType::DOUBLE;
+    } else {
+        static_assert(std::is_same_v<Key, StringKey>, "Unsupported key type");
+        return KeyType::STRING;
+    }
+}
+
+// NaN compares false against everything and would break the strict order
+// every tree relies on, so double keys must be finite.
+template <typename Key>
+const Key& requireValidKey(const Key& key) {
+    if constexpr (std::is_floating_point_v<Key>) {
+        if (!std::isfinite(key)) {
+            throw std::invalid_argument("Key must be a finite number");
+        }
+    }
+    return key;
+}
+
+enum class BatchOp : uint8_t {
+    INSERT = 0,
+    REMOVE = 1,
+    SEARCH = 2
+};
+
+template <typename Key>
+struct BatchEntry {
+    BatchOp op;
+    Key value;
+};
+
+// The operations that do not depend on the key type. Those that take or
+// return keys are on KeyedTreeWrapper.
 class TreeWrapper {
 public:
     virtual ~TreeWrapper() = default;
-    virtual void insert(int value) = 0;
-    virtual void remove(int value) = 0;
-    virtual bool search(int value) = 0;
+    virtual KeyType keyType() const = 0;
+    // True for trees created with values, which map every key to a value.
+    virtual bool hasValues() const = 0;
+    // Replaces the keys with their union, intersection or difference with
+    // other's keys, leaving other unchanged. Trees of the same type and
+    // storage are locked together and combined node by node; otherwise
+    // other's keys are copied out first. Both trees need the same key type.
+    virtual void combine(SetOperation op, TreeWrapper& other) = 0;
+    // Snapshots the keys into an immutable array that answers searches until
+    // thaw(). Other reads still use the tree; writes fail while frozen.
+    virtual void freeze(FrozenLayout layout) = 0;
+    virtual void thaw() = 0;
+    virtual bool isFrozen() const = 0;
     virtual json getJson() = 0;
+    // Streams the same document as getJson through writer in chunks, holding
+    // only O(depth) state. Returns false if the writer aborted.
+    virtual bool writeJson(const StreamingJsonSerializer<int>::Writer& writer) = 0;
     virtual std::string getType() const = 0;
+    // "compact" when nodes link through 32-bit indices, "pointer" otherwise.
+    virtual std::string getStorage() const = 0;
+    // True when reads restructure the tree (splay), so they need exclusive access.
+    virtual bool readsModifyTree() const = 0;
+    // The splay policy in the form parseSplayPolicy reads, or empty for
+    // trees without one.
+    virtual std::string splayPolicy() const = 0;
+    virtual size_t size() = 0;
+    virtual size_t bytesAllocated() = 0;
+    // Shape and usage figures that are kept up to date as the tree changes,
+    // so collecting them costs O(log n) at most and never walks the tree.
+    virtual json getStats() = 0;
+    // Fills in the keys, and the values of a tree with values, encoded, and
+    // the last logged write they include.
+    virtual void checkpoint(TreeCheckpoint& saved) = 0;
+    // Bulk loads the keys and values of a checkpoint.
+    virtual void restore(const TreeCheckpoint& saved) = 0;
+    // Applies a logged write. Throws if the write threw when it was made.
+    virtual void replay(const WalRecord& record) = 0;
+
+    // From now on every write is appended to log as tree id before it is
+    // applied. lsn is the last logged write the tree already reflects. Call
+    // before the tree is shared with other threads.
+    void attachLog(WriteAheadLog* log, uint64_t id, uint64_t lsn) {
+        log_ = log;
+        logId_ = id;
+        lastLsn_ = lsn;
+    }
+
+protected:
+    WriteAheadLog* log_ = nullptr;
+    uint64_t logId_ = 0;
+    // Guarded by the tree's lock.
+    uint64_t lastLsn_ = 0;
+};
+
+template <typename Key>
+class KeyedTreeWrapper : public TreeWrapper {
+public:
+    using key_type = Key;
+    using TreeWrapper::combine;
+
+    virtual void insert(const Key& value) = 0;
+    virtual void remove(const Key& value) = 0;
+    virtual bool search(const Key& value) = 0;
+    // One result byte per value, 1 if found. The lookups are interleaved
+    // under a single lock acquisition.
+    virtual std::vector<uint8_t> searchBatch(const std::vector<Key>& values) = 0;
+    virtual void bulkLoad(const std::vector<Key>& values) = 0;
+    virtual size_t rank(const Key& value) = 0;
+    virtual Key select(size_t k) = 0;
+    virtual size_t countRange(const Key& lo, const Key& hi) = 0;
+    // Returns up to limit keys in ascending order, starting at from (or just
+    // after it when exclusive) and stopping after to. Missing bounds are open.
+    virtual std::vector<Key> scan(std::optional<Key> from, bool exclusive, std::optional<Key> to, size_t limit) = 0;
+    // Applies the entries in order under a single lock acquisition. The result
+    // for a search is whether the key was found; inserts and removes report 1.
+    virtual std::vector<uint8_t> applyBatch(const std::vector<BatchEntry<Key>>& entries) = 0;
+    // combine() with other's keys given in ascending order; used to replay
+    // the write-ahead log.
+    virtual void combine(SetOperation op, const std::vector<Key>& keys) = 0;
+    // Removes value and returns whether it was there.
+    virtual bool erase(const Key& value) = 0;
+
+    // The values of a tree with values are JSON documents kept as their
+    // text. A key added by anything but putValue has no value, which reads
+    // as an empty string; set operations only ever add such keys. Both
+    // throw std::invalid_argument on a tree without values.
+    // The value of key, or nullopt if key is missing.
+    virtual std::optional<std::string> getValue(const Key& key) = 0;
+    // Sets the value of key, adding key if it is missing. Returns true if
+    // key was added.
+    virtual bool putValue(const Key& key, const std::string& value) = 0;
+
+    KeyType keyType() const override {
+        return keyTypeOf<Key>();
+    }
+
+    void replay(const WalRecord& record) override {
+        switch (record.op) {
+            case WalOp::INSERT:
+                insert(decodeKeys<Key>(record.keys, 1).at(0));
+                break;
+            case WalOp::REMOVE:
+                remove(decodeKeys<Key>(record.keys, 1).at(0));
+                break;
+            case WalOp::BULK:
+                bulkLoad(decodeKeys<Key>(record.keys, record.keyCount));
+                break;
+            case WalOp::BATCH: {
+                std::span<const uint8_t> in = record.keys;
+                std::vector<BatchEntry<Key>> entries;
+                for (uint32_t i = 0; i + 1 < record.keyCount; i += 2) {
+                    auto op = static_cast<BatchOp>(takeKey<int32_t>(in));
+                    entries.push_back({op, takeKey<Key>(in)});
+                }
+                applyBatch(entries);
+                break;
+            }
+            case WalOp::COMBINE:
+                combine(static_cast<SetOperation>(record.arg), decodeKeys<Key>(record.keys, record.keyCount));
+                break;
+            case WalOp::PUT: {
+                std::span<const uint8_t> in = record.keys;
+                Key key = takeKey<Key>(in);
+                putValue(key, takeKey<std::string>(in));
+                break;
+            }
+            default:
+                break;
+        }
+    }
+};
+
+// Calls f with tree as the KeyedTreeWrapper of its key type. f is generic
+// and compiled once per key type, so handlers convert request values
+// straight to the tree's keys.
+template <typename F>
+decltype(auto) withKeys(TreeWrapper& tree, F&& f) {
+    switch (tree.keyType()) {
+        case KeyType::INT64:
+            return f(static_cast<KeyedTreeWrapper<int64_t>&>(tree));
+        case KeyType::DOUBLE:
+            return f(static_cast<KeyedTreeWrapper<double>&>(tree));
+        case KeyType::STRING:
+            return f(static_cast<KeyedTreeWrapper<StringKey>&>(tree));
+        case KeyType::INT:
+        default:
+            return f(static_cast<KeyedTreeWrapper<int>&>(tree));
+    }
+}
+
+// What a tree stores: keys, or for a tree with values, map entries that
+// carry a key.
+template <typename Stored>
+struct StoredKey {
+    using type = Stored;
+    static constexpr bool HAS_VALUES = false;
+
+    static const Stored& of(const Stored& stored) {
+        return stored;
+    }
+};
+
+template <typename K, typename V>
+struct StoredKey<MapEntry<K, V>> {
+    using type = K;
+    static constexpr bool HAS_VALUES = true;
+
+    static const K& of(const MapEntry<K, V>& entry) {
+        return entry.key;
+    }
 };
 
+// Every method takes the tree's lock. Writes are exclusive; reads share the
+// lock unless the tree restructures itself on reads. Trees that can take an
+// O(1) snapshot are serialized and scanned from one, so those long reads
+// hold the lock only while the snapshot is taken and never block writers.
+// With a log attached, a write is journaled and applied under the lock and
+// waits for the log to commit it after the lock is released, so writers to
+// the same tree share an fsync instead of queueing behind each other's.
+//
+// A tree with values stores MapEntry<Key, std::string> and is searched with
+// entries that carry only a key, which the keys convert to implicitly.
 template <typename TreeType>
-class ConcreteTreeWrapper : public TreeWrapper {
+class ConcreteTreeWrapper : public KeyedTreeWrapper<typename StoredKey<typename TreeType::value_type>::type> {
 private:
+    using Stored = typename TreeType::value_type;
+    using Key = typename StoredKey<Stored>::type;
+    using WriteLock = std::unique_lock<std::shared_mutex>;
+    using SharedLock = std::shared_lock<std::shared_mutex>;
+    using ReadLock = std::conditional_t<TreeType::READS_MODIFY_TREE, WriteLock, SharedLock>;
+    using Allocator = typename TreeType::allocator_type;
+    using Instrumentation = typename TreeType::instrumentation_type;
+
+    static constexpr bool HAS_VALUES = StoredKey<Stored>::HAS_VALUES;
+    static constexpr bool HAS_SNAPSHOTS = requires(const TreeType& tree) { tree.snapshot(); };
+    // Trees whose shape gives away their height in O(log n).
+    static constexpr bool HAS_HEIGHT = requires(const TreeType& tree) { tree.height(); };
+    static constexpr bool HAS_SPLAY_POLICY = requires(const TreeType& tree) { tree.policy(); };
+
+    // One search in this many walks its path a second time to measure the
+    // depth, which keeps the cost to about one percent of search time.
+    static constexpr uint64_t DEPTH_SAMPLE_INTERVAL = 64;
+
     TreeType tree_;
     std::string type_;
+    std::optional<FrozenTree<Stored>> frozen_;
+    mutable std::shared_mutex mutex_;
+
+    // Searches run concurrently under the shared lock, so these are atomic.
+    std::atomic<uint64_t> searches_{0};
+    std::atomic<uint64_t> depthSamples_{0};
+    std::atomic<uint64_t> depthTotal_{0};
+    std::atomic<uint64_t> maxDepth_{0};
+    // Guarded by the lock.
+    size_t seenRebuilds_ = 0;
+    std::optional<std::chrono::system_clock::time_point> lastRebuild_;
     
 public:
-    ConcreteTreeWrapper(const std::string& type) : type_(type) {}
+    // Further arguments go to the tree, such as a splay policy.
+    template <typename... Args>
+    explicit ConcreteTreeWrapper(const std::string& type, Args&&... args) : tree_(std::forward<Args>(args)...), type_(type) {}
     
-    void insert(int value) override {
-        tree_.insert(value);
+    void insert(const Key& value) override {
+        uint64_t lsn;
+        {
+            WriteLock lock(mutex_);
+            requireThawed();
+            lsn = journal(WalOp::INSERT, 0, std::span(&value, 1));
+            insertLocked(value);
+            noteRebuilds();
+        }
+        commit(lsn);
     }
     
-    void remove(int value) override {
-        tree_.remove(value);
+    void remove(const Key& value) override {
+        uint64_t lsn;
+        {
+            WriteLock lock(mutex_);
+            requireThawed();
+            lsn = journal(WalOp::REMOVE, 0, std::span(&value, 1));
+            tree_.remove(value);
+            noteRebuilds();
+        }
+        commit(lsn);
+    }
+
+    // A frozen splay tree is not restructured by searches, so they can
+    // share the lock like every other tree. So can the hits a splay policy
+    // leaves in place; the others are searched again under the write lock.
+    bool search(const Key& value) override {
+        if constexpr (HAS_SPLAY_POLICY) {
+            {
+                SharedLock lock(mutex_);
+                if (frozen_) {
+                    return frozen_->search(value);
+                }
+                if (!tree_.policy().splaysEveryHit()) {
+                    sampleDepth(&value, 1);
+                    if (std::optional<bool> found = tree_.searchShared(value)) {
+                        return *found;
+                    }
+                }
+            }
+            WriteLock lock(mutex_);
+            if (frozen_) {
+                return frozen_->search(value);
+            }
+            if (tree_.policy().splaysEveryHit()) {
+                return searchLocked(value);
+            }
+            return tree_.searchAndSplay(value);
+        } else if constexpr (TreeType::READS_MODIFY_TREE) {
+            SharedLock lock(mutex_);
+            if (frozen_) {
+                return frozen_->search(value);
+            }
+        }
+        ReadLock lock(mutex_);
+        return searchLocked(value);
+    }
+
+    std::vector<uint8_t> searchBatch(const std::vector<Key>& values) override {
+        std::vector<uint8_t> results(values.size());
+        if constexpr (TreeType::READS_MODIFY_TREE) {
+            SharedLock lock(mutex_);
+            if (frozen_) {
+                searchBatchLocked(values.data(), values.size(), results.data());
+                return results;
+            }
+        }
+        ReadLock lock(mutex_);
+        searchBatchLocked(values.data(), values.size(), results.data());
+        return results;
+    }
+
+    // Like inserting each value; see BinarySearchTree::bulkLoad. A tree with
+    // values only takes keys it does not have yet, once each, as
+    // insertLocked does.
+    void bulkLoad(const std::vector<Key>& values) override {
+        uint64_t lsn;
+        {
+            WriteLock lock(mutex_);
+            requireThawed();
+            lsn = journal(WalOp::BULK, 0, values);
+            if constexpr (HAS_VALUES) {
+                std::vector<Key> added(values);
+                std::sort(added.begin(), added.end());
+                added.erase(std::unique(added.begin(), added.end()), added.end());
+                std::erase_if(added, [&](const Key& key) { return tree_.find(key) != nullptr; });
+                tree_.bulkLoad(added.begin(), added.end());
+            } else {
+                tree_.bulkLoad(values.begin(), values.end());
+            }
+            noteRebuilds();
+        }
+        commit(lsn);
+    }
+
+    size_t rank(const Key& value) override {
+        ReadLock lock(mutex_);
+        return tree_.rank(value);
     }
 
-    bool search(int value) override {
-        return tree_.search(value);
+    Key select(size_t k) override {
+        ReadLock lock(mutex_);
+        return StoredKey<Stored>::of(tree_.select(k));
+    }
+
+    size_t countRange(const Key& lo, const Key& hi) override {
+        ReadLock lock(mutex_);
+        return tree_.countRange(lo, hi);
+    }
+
+    std::vector<Key> scan(std::optional<Key> from, bool exclusive, std::optional<Key> to, size_t limit) override {
+        if constexpr (HAS_SNAPSHOTS) {
+            TreeType snapshot = takeSnapshot();
+            return scanTree(snapshot, from, exclusive, to, limit);
+        } else {
+            ReadLock lock(mutex_);
+            return scanTree(tree_, from, exclusive, to, limit);
+        }
+    }
+    
+    std::vector<uint8_t> applyBatch(const std::vector<BatchEntry<Key>>& entries) override {
+        bool writes = std::any_of(entries.begin(), entries.end(), [](const BatchEntry<Key>& entry) {
+            return entry.op != BatchOp::SEARCH;
+        });
+
+        if (!writes) {
+            SharedLock lock(mutex_);
+            if (frozen_ || !TreeType::READS_MODIFY_TREE) {
+                return applyBatchLocked(entries);
+            }
+        }
+        uint64_t lsn = 0;
+        std::vector<uint8_t> results;
+        {
+            WriteLock lock(mutex_);
+            if (writes) {
+                requireThawed();
+                lsn = journalBatch(entries);
+            }
+            results = applyBatchLocked(entries);
+            noteRebuilds();
+        }
+        commit(lsn);
+        return results;
+    }
+
+    // The log gets other's keys rather than its id, so replay does not
+    // depend on what later happened to other.
+    void combine(SetOperation op, TreeWrapper& other) override {
+        if (other.keyType() != this->keyType()) {
+            throw std::invalid_argument("Trees with different key types cannot be combined");
+        }
+        // Set operations on a tree with values only ever bring in keys, so
+        // it takes them from the other tree the same way whatever its type.
+        auto* same = HAS_VALUES ? nullptr : dynamic_cast<ConcreteTreeWrapper*>(&other);
+        if (same == nullptr) {
+            auto& keyed = static_cast<KeyedTreeWrapper<Key>&>(other);
+            combine(op, keyed.scan(std::nullopt, false, std::nullopt, SIZE_MAX));
+            return;
+        }
+
+        uint64_t lsn = 0;
+        {
+            WriteLock lock(mutex_, std::defer_lock);
+            if (same == this) {
+                lock.lock();
+                requireThawed();
+                if (this->log_ != nullptr) {
+                    lsn = journal(WalOp::COMBINE, static_cast<uint8_t>(op), allKeys(tree_));
+                }
+                tree_.combine(op, tree_);
+                noteRebuilds();
+            } else {
+                // std::lock backs off instead of deadlocking when two requests
+                // combine the same pair of trees in opposite directions.
+                SharedLock otherLock(same->mutex_, std::defer_lock);
+                std::lock(lock, otherLock);
+                requireThawed();
+                if (this->log_ != nullptr) {
+                    lsn = journal(WalOp::COMBINE, static_cast<uint8_t>(op), allKeys(same->tree_));
+                }
+                tree_.combine(op, same->tree_);
+                noteRebuilds();
+            }
+        }
+        commit(lsn);
+    }
+
+    void combine(SetOperation op, const std::vector<Key>& keys) override {
+        uint64_t lsn;
+        {
+            WriteLock lock(mutex_);
+            requireThawed();
+            lsn = journal(WalOp::COMBINE, static_cast<uint8_t>(op), keys);
+            if constexpr (HAS_VALUES) {
+                tree_.combineSorted(op, std::vector<Stored>(keys.begin(), keys.end()));
+            } else {
+                tree_.combineSorted(op, keys);
+            }
+            noteRebuilds();
+        }
+        commit(lsn);
+    }
+
+    void freeze(FrozenLayout layout) override {
+        WriteLock lock(mutex_);
+        frozen_ = tree_.freeze(layout);
+    }
+
+    void thaw() override {
+        WriteLock lock(mutex_);
+        frozen_.reset();
+    }
+
+    bool isFrozen() const override {
+        SharedLock lock(mutex_);
+        return frozen_.has_value();
     }
     
     json getJson() override {
-        JsonSerializer<int> serializer;
-        tree_.accept(serializer);
+        JsonSerializer<Stored, Allocator, Instrumentation> serializer;
+        if constexpr (HAS_SNAPSHOTS) {
+            takeSnapshot().accept(serializer);
+        } else {
+            SharedLock lock(mutex_);
+            tree_.accept(serializer);
+        }
         return serializer.getJson();
     }
+
+    // The snapshot keeps a slow client from holding up writers while the
+    // document is streamed out.
+    bool writeJson(const StreamingJsonSerializer<int>::Writer& writer) override {
+        StreamingJsonSerializer<Stored, Allocator, Instrumentation> serializer(writer);
+        if constexpr (HAS_SNAPSHOTS) {
+            takeSnapshot().accept(serializer);
+        } else {
+            SharedLock lock(mutex_);
+            tree_.accept(serializer);
+        }
+        return serializer.completed();
+    }
     
     std::string getType() const override {
         return type_;
     }
+
+    std::string getStorage() const override {
+        return std::is_same_v<Allocator, CompactAllocator<Stored>> ? "compact" : "pointer";
+    }
+
+    bool hasValues() const override {
+        return HAS_VALUES;
+    }
+
+    bool readsModifyTree() const override {
+        return TreeType::READS_MODIFY_TREE;
+    }
+
+    std::string splayPolicy() const override {
+        if constexpr (HAS_SPLAY_POLICY) {
+            return splayPolicyName(tree_.policy());
+        } else {
+            return "";
+        }
+    }
+
+    size_t size() override {
+        SharedLock lock(mutex_);
+        return tree_.size();
+    }
+
+    size_t bytesAllocated() override {
+        SharedLock lock(mutex_);
+        return tree_.bytesAllocated();
+    }
+
+    // height is null for trees that would have to walk every node for it.
+    // lastRebuild is in milliseconds since the Unix epoch. instrumentation
+    // is only present in servers built with TREE_INSTRUMENTATION.
+    json getStats() override {
+        SharedLock lock(mutex_);
+        size_t bytes = tree_.bytesAllocated();
+        uint64_t samples = depthSamples_.load(std::memory_order_relaxed);
+        json stats = {
+            {"type", type_},
+            {"storage", getStorage()},
+            {"keyType", keyTypeName(this->keyType())},
+            {"values", HAS_VALUES},
+            {"splayPolicy", nullptr},
+            {"frozen", frozen_.has_value()},
+            {"keys", tree_.size()},
+            {"nodes", bytes / sizeof(typename TreeType::Node)},
+            {"height", nullptr},
+            {"bytesAllocated", bytes},
+            {"searches", searches_.load(std::memory_order_relaxed)},
+            {"searchDepth", {
+                {"samples", samples},
+                {"average", samples == 0 ? 0.0 : static_cast<double>(depthTotal_.load(std::memory_order_relaxed)) / samples},
+                {"max", maxDepth_.load(std::memory_order_relaxed)}
+            }},
+            {"rebuilds", tree_.rebuilds()},
+            {"lastRebuild", nullptr}
+        };
+        if constexpr (HAS_HEIGHT) {
+            stats["height"] = tree_.height();
+        }
+        if constexpr (HAS_SPLAY_POLICY) {
+            stats["splayPolicy"] = splayPolicyName(tree_.policy());
+        }
+        if (lastRebuild_) {
+            stats["lastRebuild"] = std::chrono::duration_cast<std::chrono::milliseconds>(lastRebuild_->time_since_epoch()).count();
+        }
+        if constexpr (Instrumentation::ENABLED) {
+            InstrumentationCounters counters = tree_.instrumentation().counters();
+            stats["instrumentation"] = {
+                {"comparisons", counters.comparisons},
+                {"rotations", counters.rotations},
+                {"splaySteps", counters.splaySteps},
+                {"rebuilds", counters.rebuilds},
+                {"rebuiltNodes", counters.rebuiltNodes},
+                {"largestRebuild", counters.largestRebuild}
+            };
+        }
+        return stats;
+    }
+
+    bool erase(const Key& value) override {
+        requireValidKey(value);
+        uint64_t lsn;
+        bool erased;
+        {
+            WriteLock lock(mutex_);
+            requireThawed();
+            lsn = journal(WalOp::REMOVE, 0, std::span(&value, 1));
+            size_t before = tree_.size();
+            tree_.remove(value);
+            erased = tree_.size() != before;
+            noteRebuilds();
+        }
+        commit(lsn);
+        return erased;
+    }
+
+    // One traversal answers both whether key is there and its value.
+    std::optional<std::string> getValue(const Key& key) override {
+        if constexpr (HAS_VALUES) {
+            requireValidKey(key);
+            ReadLock lock(mutex_);
+            const Stored* entry = tree_.find(key);
+            if (entry == nullptr) {
+                return std::nullopt;
+            }
+            return std::string(entry->value.get());
+        } else {
+            throw std::invalid_argument("Tree was created without values");
+        }
+    }
+
+    // The value replaces the old one in place when key is there, and only
+    // a new key goes on to insert. The key is checked before it is journaled:
+    // a bad key in the log would be applied again on every replay.
+    bool putValue(const Key& key, const std::string& value) override {
+        if constexpr (HAS_VALUES) {
+            requireValidKey(key);
+            uint64_t lsn = 0;
+            bool added = false;
+            {
+                WriteLock lock(mutex_);
+                requireThawed();
+                if (this->log_ != nullptr) {
+                    std::vector<uint8_t> encoded;
+                    putKey(encoded, key);
+                    putKey(encoded, value);
+                    lsn = journalEncoded(WalOp::PUT, 0, 1, encoded);
+                }
+                Stored entry(key, value);
+                if (!tree_.assign(entry)) {
+                    tree_.insert(entry);
+                    added = true;
+                }
+                noteRebuilds();
+            }
+            commit(lsn);
+            return added;
+        } else {
+            throw std::invalid_argument("Tree was created without values");
+        }
+    }
+
+    // A tree with values checkpoints each key followed by its value.
+    void checkpoint(TreeCheckpoint& saved) override {
+        std::vector<Stored> stored;
+        if constexpr (HAS_SNAPSHOTS) {
+            TreeType snapshot = [&] {
+                SharedLock lock(mutex_);
+                saved.lsn = this->lastLsn_;
+                return tree_.snapshot();
+            }();
+            stored.assign(snapshot.begin(), snapshot.end());
+        } else {
+            SharedLock lock(mutex_);
+            saved.lsn = this->lastLsn_;
+            stored.assign(tree_.begin(), tree_.end());
+        }
+
+        saved.keyType = keyTypeName(this->keyType());
+        saved.values = HAS_VALUES;
+        saved.keyCount = stored.size();
+        saved.keys.clear();
+        for (const Stored& entry : stored) {
+            putKey(saved.keys, StoredKey<Stored>::of(entry));
+            if constexpr (HAS_VALUES) {
+                putKey(saved.keys, std::string(entry.value.get()));
+            }
+        }
+    }
+
+    void restore(const TreeCheckpoint& saved) override {
+        std::span<const uint8_t> in = saved.keys;
+        std::vector<Stored> stored;
+        stored.reserve(std::min<uint64_t>(saved.keyCount, in.size()));
+        for (uint64_t i = 0; i < saved.keyCount; i++) {
+            Key key = takeKey<Key>(in);
+            if constexpr (HAS_VALUES) {
+                stored.emplace_back(key, takeKey<std::string>(in));
+            } else {
+                stored.push_back(std::move(key));
+            }
+        }
+        WriteLock lock(mutex_);
+        tree_.bulkLoad(stored.begin(), stored.end());
+        noteRebuilds();
+    }
+
+private:
+    // Appends a write to the log, if any, and returns its LSN for commit().
+    // Called under the write lock, just before the write is applied.
+    uint64_t journal(WalOp op, uint8_t arg, std::span<const Key> keys) {
+        if (this->log_ == nullptr) {
+            return 0;
+        }
+        return journalEncoded(op, arg, keys.size(), encodeKeys(keys));
+    }
+
+    // Only the inserts and removes, as (op, key) pairs with the op written
+    // as an int32 key.
+    uint64_t journalBatch(const std::vector<BatchEntry<Key>>& entries) {
+        if (this->log_ == nullptr) {
+            return 0;
+        }
+        std::vector<uint8_t> writes;
+        uint32_t count = 0;
+        for (const BatchEntry<Key>& entry : entries) {
+            if (entry.op != BatchOp::SEARCH) {
+                putKey<int32_t>(writes, static_cast<int32_t>(entry.op));
+                putKey(writes, entry.value);
+                count += 2;
+            }
+        }
+        return journalEncoded(WalOp::BATCH, 0, count, writes);
+    }
+
+    uint64_t journalEncoded(WalOp op, uint8_t arg, uint32_t count, const std::vector<uint8_t>& keys) {
+        this->lastLsn_ = this->log_->append(op, this->logId_, arg, count, keys);
+        return this->lastLsn_;
+    }
+
+    void commit(uint64_t lsn) {
+        if (this->log_ != nullptr) {
+            this->log_->commit(lsn);
+        }
+    }
+
+    TreeType takeSnapshot() const {
+        SharedLock lock(mutex_);
+        return tree_.snapshot();
+    }
+
+    static std::vector<Key> scanTree(TreeType& tree, std::optional<Key> from, bool exclusive, std::optional<Key> to, size_t limit) {
+        auto it = !from ? tree.begin() : exclusive ? tree.upper_bound(*from) : tree.lower_bound(*from);
+        auto end = tree.end();
+
+        std::vector<Key> keys;
+        for (; it != end && keys.size() < limit; ++it) {
+            const Key& key = StoredKey<Stored>::of(*it);
+            if (to && *to < key) {
+                break;
+            }
+            keys.push_back(key);
+        }
+        return keys;
+    }
+
+    // In-order iteration, so unlike scanTree it never splays.
+    static std::vector<Key> allKeys(const TreeType& tree) {
+        std::vector<Key> keys;
+        for (const Stored& stored : tree) {
+            keys.push_back(StoredKey<Stored>::of(stored));
+        }
+        return keys;
+    }
+
+    void requireThawed() const {
+        if (frozen_) {
+            throw std::logic_error("Tree is frozen, thaw it before writing");
+        }
+    }
+
+    // A tree with values keeps one entry per key, whatever the tree does
+    // with duplicates, and a key inserted again keeps its value.
+    void insertLocked(const Key& value) {
+        if constexpr (HAS_VALUES) {
+            if (tree_.find(value) == nullptr) {
+                tree_.insert(value);
+            }
+        } else {
+            tree_.insert(value);
+        }
+    }
+
+    bool searchLocked(const Key& value) {
+        sampleDepth(&value, 1);
+        return frozen_ ? frozen_->search(value) : tree_.search(value);
+    }
+
+    void searchBatchLocked(const Key* values, size_t count, uint8_t* results) {
+        sampleDepth(values, count);
+        std::unique_ptr<bool[]> found(new bool[count]);
+        std::vector<Stored> entries;
+        std::span<const Stored> keys;
+        if constexpr (HAS_VALUES) {
+            entries.assign(values, values + count);
+            keys = entries;
+        } else {
+            keys = std::span<const Stored>(values, count);
+        }
+        std::span<bool> out(found.get(), count);
+        if (frozen_) {
+            frozen_->searchBatch(keys, out);
+        } else {
+            tree_.searchBatch(keys, out);
+        }
+        std::copy(out.begin(), out.end(), results);
+    }
+
+    // Measures the first of count searches whenever they take the search
+    // count past a multiple of DEPTH_SAMPLE_INTERVAL. Runs before the search
+    // itself, so a splay tree is measured before it restructures.
+    void sampleDepth(const Key* values, size_t count) {
+        uint64_t before = searches_.fetch_add(count, std::memory_order_relaxed);
+        if (frozen_ || before / DEPTH_SAMPLE_INTERVAL == (before + count) / DEPTH_SAMPLE_INTERVAL) {
+            return;
+        }
+        uint64_t depth = tree_.searchDepth(values[0]);
+        depthSamples_.fetch_add(1, std::memory_order_relaxed);
+        depthTotal_.fetch_add(depth, std::memory_order_relaxed);
+        uint64_t max = maxDepth_.load(std::memory_order_relaxed);
+        while (depth > max && !maxDepth_.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {
+        }
+    }
+
+    // Called under the write lock after every write.
+    void noteRebuilds() {
+        if (tree_.rebuilds() != seenRebuilds_) {
+            seenRebuilds_ = tree_.rebuilds();
+            lastRebuild_ = std::chrono::system_clock::now();
+        }
+    }
+
+    // Runs of consecutive searches go through searchBatchLocked so their
+    // lookups overlap; writes in between keep their order.
+    std::vector<uint8_t> applyBatchLocked(const std::vector<BatchEntry<Key>>& entries) {
+        std::vector<uint8_t> results(entries.size());
+        std::vector<Key> values;
+        size_t i = 0;
+        while (i < entries.size()) {
+            switch (entries[i].op) {
+                case BatchOp::INSERT:
+                    insertLocked(entries[i].value);
+                    results[i++] = 1;
+                    break;
+                case BatchOp::REMOVE:
+                    tree_.remove(entries[i].value);
+                    results[i++] = 1;
+                    break;
+                case BatchOp::SEARCH: {
+                    size_t first = i;
+                    values.clear();
+                    for (; i < entries.size() && entries[i].op == BatchOp::SEARCH; i++) {
+                        values.push_back(entries[i].value);
+                    }
+                    searchBatchLocked(values.data(), values.size(), results.data() + first);
+                    break;
+                }
+            }
+        }
+        return results;
+    }
 };
 
 class TreeFactory {
 public:
-    static std::unique_ptr<TreeWrapper> createTree(const std::string& treeType);
+    // Trees with values map every key to a JSON value. A splay policy is
+    // only accepted for "splay" trees.
+    static std::unique_ptr<TreeWrapper> createTree(const std::string& treeType, const std::string& storage = "pointer",
+                                                   const std::string& keyType = "int", bool values = false,
+                                                   const std::string& splayPolicy = "");
+    // Every type createTree accepts.
+    static std::vector<std::string> treeTypes();
 };
 
+// The registry has its own lock, separate from the per-tree locks. Trees are
+// handed out as shared_ptr so a handler can keep using one after a
+// concurrent DELETE has dropped it from the registry.
 class TreeManager {
 private:
-    std::unordered_map<std::string, std::unique_ptr<TreeWrapper>> trees_;
+    std::unordered_map<std::string, std::shared_ptr<TreeWrapper>> trees_;
+    mutable std::shared_mutex mutex_;
     
     size_t current_id = 0;
     std::string generateId();
+
+    DurabilityOptions durability_;
+    std::unique_ptr<WriteAheadLog> log_;
+    // Serializes snapshots with each other.
+    std::mutex snapshotMutex_;
+    std::thread snapshotter_;
+    std::mutex stopMutex_;
+    std::condition_variable stopCv_;
+    bool stopping_ = false;
+
+    void replay(const WalRecord& record, const std::unordered_map<std::string, uint64_t>& checkpointed);
     
 public:
-    std::string createTree(const std::string& treeType);
-    TreeWrapper* getTree(const std::string& id);
+    ~TreeManager();
+
+    std::string createTree(const std::string& treeType, const std::string& storage = "pointer", const std::string& keyType = "int",
+                           bool values = false, const std::string& splayPolicy = "");
+    std::shared_ptr<TreeWrapper> getTree(const std::string& id);
     bool removeTree(const std::string& id);
     json listTrees();
+    // The registered trees at the time of the call, with their ids.
+    std::vector<std::pair<std::string, std::shared_ptr<TreeWrapper>>> allTrees();
+
+    // Restores the trees kept in options.dataDir and logs every change made
+    // from now on there. Call once, before serving requests. Frozen trees
+    // come back thawed.
+    void enableDurability(const DurabilityOptions& options);
+    // Writes every tree out as sorted keys and deletes the log they
+    // supersede. Runs every snapshotInterval once durability is enabled.
+    void snapshot();
+};
+
+struct ServerOptions {
+    // Requests that take at least this long are logged to stderr with the
+    // time spent in each phase. Zero turns the log off.
+    std::chrono::milliseconds slowRequest{0};
 };
 
-void setupTreeServer(httplib::Server& server, TreeManager& treeManager);
+void setupTreeServer(httplib::Server& server, TreeManager& treeManager, const ServerOptions& options = {});
@@ -1,19 +1,28 @@
 #pragma once
 
-template <typename T> class AVLTree;
-template<typename T> class RedBlackTree;
-template <typename T> class SplayTree;
-template <typename T> class ScapegoatTree;
-template <typename T> class BBAlphaTree;
+#include <memory>
+#include "trees/instrumentation.hpp"
 
-template <typename T>
+template <typename T, typename Allocator, typename Instrumentation> class AVLTree;
+template <typename T, typename Allocator, typename Instrumentation> class RedBlackTree;
+template <typename T, typename Allocator, typename Instrumentation> class ParentFreeRedBlackTree;
+template <typename T, typename Allocator, typename Instrumentation> class SplayTree;
+template <typename T, typename Allocator, typename Instrumentation> class TopDownSplayTree;
+template <typename T, typename Allocator, typename Instrumentation> class ScapegoatTree;
+template <typename T, typename Allocator, typename Instrumentation> class BBAlphaTree;
+template <typename T, typename Allocator, typename Instrumentation> class BTree;
+
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
 class TreeVisitor {
 public:
-    virtual void visit(const AVLTree<T>& tree) = 0;
-    virtual void visit(const BBAlphaTree<T>& tree) = 0;
-    virtual void visit(const RedBlackTree<T>& tree) = 0;
-    virtual void visit(const ScapegoatTree<T>& tree) = 0;
-    virtual void visit(const SplayTree<T>& tree) = 0;
+    virtual void visit(const AVLTree<T, Allocator, Instrumentation>& tree) = 0;
+    virtual void visit(const BBAlphaTree<T, Allocator, Instrumentation>& tree) = 0;
+    virtual void visit(const BTree<T, Allocator, Instrumentation>& tree) = 0;
+    virtual void visit(const RedBlackTree<T, Allocator, Instrumentation>& tree) = 0;
+    virtual void visit(const ParentFreeRedBlackTree<T, Allocator, Instrumentation>& tree) = 0;
+    virtual void visit(const ScapegoatTree<T, Allocator, Instrumentation>& tree) = 0;
+    virtual void visit(const SplayTree<T, Allocator, Instrumentation>& tree) = 0;
+    virtual void visit(const TopDownSplayTree<T, Allocator, Instrumentation>& tree) = 0;
 
     virtual ~TreeVisitor() = default;
 };
\ No newline at end of file
@@ -1,214 +1,606 @@
 #pragma once
 
 #include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "order_statistics.hpp"
+#include "tree_iterator.hpp"
+#include "batch_search.hpp"
+#include "join_operations.hpp"
+#include "shared_nodes.hpp"
 #include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <vector>
 
-template <typename T>
-class AVLTree final : public BinarySearchTree<T> {
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class AVLTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
 public:
+    // balance is height(left) - height(right) and is always -1, 0 or 1 between
+    // operations (briefly ±2 before a rotation), so it takes three bits of the
+    // size word instead of a full size_t height. size counts the nodes in the
+    // subtree. refs counts the links to the node from trees sharing it and
+    // fits in the padding after a small key.
     struct Node {
+        using Link = typename NodeStorage<Allocator>::template Link<Node>;
+        using Size = typename NodeStorage<Allocator>::Size;
+
         T key;
-        Node *left, *right;
-        size_t height;
+        RefCount refs;
+        Link left, right;
+        Size size : NodeStorage<Allocator>::SIZE_BITS - 3;
+        int balance : 3;
 
-        explicit Node(const T& key) : key(key), left(nullptr), right(nullptr), height(1) {}
+        explicit Node(const T& key) : key(key), refs(1), left(nullptr), right(nullptr), size(1), balance(0) {}
     };
 
     AVLTree() : root_(nullptr) {}
-    
+
+    // O(1): the copy shares every node with other, and whichever of the two
+    // is written afterwards copies the nodes it changes.
+    AVLTree(const AVLTree& other) : alloc_(other.alloc_), root_(other.root_) {
+        retain(getRoot());
+    }
+
+    AVLTree& operator=(const AVLTree&) = delete;
+
     ~AVLTree() {
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            if (!alloc_.shared()) {
+                alloc_.release();
+                return;
+            }
+        }
         destroyTree(root_);
     }
 
+    // An immutable view of the current keys in O(1). It can be read, and
+    // destroyed, on another thread while this tree keeps changing.
+    AVLTree snapshot() const {
+        return AVLTree(*this);
+    }
+
     bool search(const T& value) override {
+        return find(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
         Node* current = root_;
+        size_t visited = 0;
         while (current != nullptr) {
+            visited++;
             if (value == current->key) {
+                this->instrumentation_.compare(visited);
+                return &current->key;
+            }
+            current = value < current->key ? current->left : current->right;
+        }
+        this->instrumentation_.compare(visited);
+        return nullptr;
+    }
+
+    // Takes ownership of the path down to the key, since the key changes in
+    // place. When it is missing, the path is the one an insert takes next.
+    bool assign(const T& value) override {
+        Link* link = &root_;
+        while (*link != nullptr) {
+            this->instrumentation_.compare();
+            Node* node = own(*link);
+            if (value == node->key) {
+                node->key = value;
                 return true;
-            } else if (value < current->key) {
-                current = current->left;
-            } else {
-                current = current->right;
             }
+            link = value < node->key ? &node->left : &node->right;
         }
         return false;
     }
 
+    void searchBatch(std::span<const T> keys, std::span<bool> out) override {
+        interleavedSearch(static_cast<const Node*>(root_), keys, out, this->instrumentation_);
+    }
+
     void insert(const T &value) override {
-        if (root_ == nullptr) {
-            root_ = new Node(value);
-            return;
+        std::array<Link*, MAX_HEIGHT> path;
+        size_t depth = 0;
+
+        Link* link = &root_;
+        while (*link != nullptr) {
+            path[depth++] = link;
+            Node* node = own(*link);
+            node->size++;
+            this->instrumentation_.compare();
+            link = value < node->key ? &node->left : &node->right;
+        }
+        *link = createNode(value);
+
+        // Walk back up only while the subtree height keeps growing. A node that
+        // becomes perfectly balanced, or one that needs a rotation, absorbs the
+        // growth and nothing above it changes.
+        Node* child = *link;
+        while (depth > 0) {
+            Link* parent_link = path[--depth];
+            Node* parent = *parent_link;
+
+            parent->balance += (child == parent->left) ? 1 : -1;
+
+            if (parent->balance == 0) {
+                break;
+            }
+            if (parent->balance == 2 || parent->balance == -2) {
+                *parent_link = rebalance(parent);
+                break;
+            }
+            child = parent;
         }
-        root_ = insertUtility(root_, value);
     }
     
+    // The key is found before any node is taken over, so removing a missing
+    // key copies nothing that a snapshot shares. The path is then owned by
+    // following the recorded turns, without comparing keys again.
     void remove(const T &value) override {
-        root_ = removeUtility(root_, value);
+        std::array<Link*, MAX_HEIGHT> path;
+        std::array<bool, MAX_HEIGHT> went_left;
+        size_t depth = 0;
+
+        const Node* found = root_;
+        while (found != nullptr && !(value == found->key)) {
+            this->instrumentation_.compare();
+            went_left[depth] = value < found->key;
+            found = went_left[depth] ? found->left : found->right;
+            depth++;
+        }
+
+        if (found == nullptr) {
+            return;
+        }
+        this->instrumentation_.compare();
+
+        Link* link = &root_;
+        for (size_t i = 0; i < depth; i++) {
+            path[i] = link;
+            Node* node = own(*link);
+            link = went_left[i] ? &node->left : &node->right;
+        }
+
+        Node* target = own(*link);
+        if (target->left != nullptr && target->right != nullptr) {
+            path[depth] = link;
+            went_left[depth] = false;
+            depth++;
+            link = &target->right;
+
+            while (own(*link)->left != nullptr) {
+                path[depth] = link;
+                went_left[depth] = true;
+                depth++;
+                link = &(*link)->left;
+            }
+
+            target->key = (*link)->key;
+            target = *link;
+        }
+
+        *link = target->left != nullptr ? target->left : target->right;
+        destroyNode(target);
+
+        for (size_t i = 0; i < depth; i++) {
+            (*path[i])->size--;
+        }
+
+        // Walk back up while the subtree height keeps shrinking. A node that was
+        // perfectly balanced keeps its height, and so does a rotation whose
+        // sibling was perfectly balanced.
+        while (depth > 0) {
+            depth--;
+            Link* parent_link = path[depth];
+            Node* parent = *parent_link;
+
+            parent->balance += went_left[depth] ? -1 : 1;
+
+            if (parent->balance == 1 || parent->balance == -1) {
+                break;
+            }
+            if (parent->balance == 2 || parent->balance == -2) {
+                Node* new_root = rebalance(parent);
+                *parent_link = new_root;
+                if (new_root->balance != 0) {
+                    break;
+                }
+            }
+        }
     }
 
-    Node* getRoot() const {
-        return root_;
+    size_t rank(const T& value) override {
+        return countBelow(getRoot(), value, false);
     }
 
-    static std::string name() {
-        return "AVL Tree";
+    T select(size_t k) override {
+        return selectNode(getRoot(), k)->key;
     }
 
-    void accept(TreeVisitor<T>& visitor) const override {
-        visitor.visit(*this);
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelow(getRoot(), hi, true) - countBelow(getRoot(), lo, false);
     }
 
-private:
-    Node* root_ = nullptr;
+    size_t size() const override {
+        return subtreeSize(root_);
+    }
 
-    size_t getHeight(Node* node) const {
-        if (node == nullptr) {
-            return 0;
+    size_t bytesAllocated() const override {
+        return size() * sizeof(Node);
+    }
+
+    size_t searchDepth(const T& value) const override {
+        return searchPathLength(getRoot(), value);
+    }
+
+    bool keepsDuplicates() const override {
+        return true;
+    }
+
+    // Follows the taller child at every level, so this is O(log n).
+    size_t height() const {
+        size_t height = 0;
+        for (const Node* node = root_; node != nullptr; node = node->balance > 0 ? node->left : node->right) {
+            height++;
         }
-        return node->height;
+        return height;
     }
 
-    void updateHeight(Node* node) {
-        if (node == nullptr) {
-            return;
+    // Moves every key not less than key into right, replacing its contents,
+    // in O(log n). This tree keeps the smaller keys. Nodes move without
+    // copying unless the two trees' allocators differ.
+    void split(const T& key, AVLTree& right) {
+        right.destroyTree(right.root_);
+        right.root_ = nullptr;
+
+        Node* found = nullptr;
+        auto [less, greater] = Join::split(*this, ranked(), key, found);
+        if (found != nullptr) {
+            greater = join(Ranked{}, found, greater);
         }
-        node->height = std::max(getHeight(node->left), getHeight(node->right)) + 1;
+        root_ = less.root;
+        right.root_ = right.adopt(*this, greater.root);
     }
 
-    int getBalance(Node* node) const {
-        if (node == nullptr) {
-            return 0;
+    // Appends key and then every key of right, leaving right empty, in
+    // O(log n). Every key here must be less than key and every key of right
+    // greater than it.
+    void join(const T& key, AVLTree& right) {
+        if ((root_ != nullptr && !(maximum(root_)->key < key)) ||
+            (right.root_ != nullptr && !(key < minimum(right.root_)->key))) {
+            throw std::invalid_argument("join needs every key of this tree below key and every key of right above it");
         }
-        return getHeight(node->left) - getHeight(node->right);
+
+        Node* other = adopt(right, right.root_);
+        right.root_ = nullptr;
+        root_ = join(ranked(), createNode(key), Ranked{other, height(other)}).root;
     }
 
-    Node* rotateRight(Node* node) {
-        if (node == nullptr || node->left == nullptr) {
-            return node;
+    // Against another AVL tree this splits and joins a copy of its nodes,
+    // which touches O(m log(n/m + 1)) nodes plus the m copies and the nodes
+    // it drops.
+    void combine(SetOperation op, const BinarySearchTree<T, Allocator, Instrumentation>& other) override {
+        const AVLTree* same = dynamic_cast<const AVLTree*>(&other);
+        if (same == nullptr) {
+            BinarySearchTree<T, Allocator, Instrumentation>::combine(op, other);
+            return;
+        }
+
+        Node* copy = cloneTree(same->root_);
+        Ranked operand{copy, height(copy)};
+        switch (op) {
+            case SetOperation::UNION:
+                root_ = Join::unite(*this, ranked(), operand).root;
+                break;
+            case SetOperation::INTERSECTION:
+                root_ = Join::intersect(*this, ranked(), operand).root;
+                break;
+            case SetOperation::DIFFERENCE:
+                root_ = Join::subtract(*this, ranked(), operand).root;
+                break;
         }
+    }
+
+    using iterator = TreeIterator<Node>;
+    using const_iterator = TreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    const_iterator lower_bound(const T& value) const {
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) const {
+        return const_iterator::upperBound(root_, value);
+    }
 
-        Node* left_child = node->left;
-        Node* left_right_child = left_child->right;
+    Node* getRoot() const {
+        return root_;
+    }
+
+    static constexpr bool READS_MODIFY_TREE = false;
+
+    static std::string name() {
+        return "AVL Tree";
+    }
 
-        node->left = left_right_child;
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
+        visitor.visit(*this);
+    }
+
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        std::vector<Node*> stack;
+        Node* current = root_;
+        while (current != nullptr || !stack.empty()) {
+            while (current != nullptr) {
+                stack.push_back(current);
+                current = current->left;
+            }
+            current = stack.back();
+            stack.pop_back();
+            out.push_back(current->key);
+            current = current->right;
+        }
+    }
+
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+        int height = 0;
+        root_ = buildBalanced(values, 0, values.size(), height);
+    }
+
+private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+    using Link = typename Node::Link;
+    using Ranked = RankedTree<Node>;
+    using Join = JoinAlgorithms<AVLTree, Node>;
+    friend Join;
+
+    NodeAllocator alloc_;
+    Link root_ = nullptr;
+
+    // An AVL tree of height h holds at least F(h+2)-1 nodes, so 96 levels is
+    // more than any tree that fits in a 64-bit address space.
+    static constexpr size_t MAX_HEIGHT = 96;
+
+    // Each rotation and rebalance takes ownership of the children it
+    // changes; the node passed in must already be owned.
+    Node* rotateRight(Node* node) {
+        this->instrumentation_.rotate();
+        Node* left_child = own(node->left);
+
+        node->left = left_child->right;
         left_child->right = node;
 
-        updateHeight(node);
-        updateHeight(left_child);
+        left_child->size = node->size;
+        node->size = 1 + subtreeSize(node->left) + subtreeSize(node->right);
+
+        node->balance = node->balance - 1 - std::max<signed char>(left_child->balance, 0);
+        left_child->balance = left_child->balance - 1 + std::min<signed char>(node->balance, 0);
 
         return left_child;
     }
 
     Node* rotateLeft(Node* node) {
-        Node* right_child = node->right;
-        Node* right_left_child = right_child->left;
+        this->instrumentation_.rotate();
+        Node* right_child = own(node->right);
 
-        node->right = right_left_child;
+        node->right = right_child->left;
         right_child->left = node;
 
-        updateHeight(node);
-        updateHeight(right_child);
+        right_child->size = node->size;
+        node->size = 1 + subtreeSize(node->left) + subtreeSize(node->right);
+
+        node->balance = node->balance + 1 - std::min<signed char>(right_child->balance, 0);
+        right_child->balance = right_child->balance + 1 + std::max<signed char>(node->balance, 0);
 
         return right_child;
     }
 
-    Node* insertUtility(Node* current, const T& value) {
-        if (current == nullptr) {
-            return new Node(value);
+    Node* rebalance(Node* node) {
+        if (node->balance > 1) {
+            Node* left_child = own(node->left);
+            if (left_child->balance < 0) {
+                node->left = rotateLeft(left_child);
+            }
+            return rotateRight(node);
+        }
+        Node* right_child = own(node->right);
+        if (right_child->balance > 0) {
+            node->right = rotateRight(right_child);
         }
+        return rotateLeft(node);
+    }
 
-        if (value < current->key) {
-            current->left = insertUtility(current->left, value);
-        } else {
-            current->right = insertUtility(current->right, value);
+    // Follows the taller child down, so it costs O(log n).
+    static int height(Node* node) {
+        int height = 0;
+        for (; node != nullptr; node = node->balance < 0 ? node->right : node->left) {
+            height++;
         }
+        return height;
+    }
+
+    Ranked ranked() const {
+        return {root_, height(root_)};
+    }
 
-        updateHeight(current);
-        int balance = getBalance(current);
+    // Takes ownership of the root, since the join algorithms go on to relink it.
+    std::pair<Ranked, Ranked> expose(Ranked& tree) {
+        Node* node = tree.root = unshare(tree.root);
+        return {{node->left, tree.rank - 1 - (node->balance < 0)},
+                {node->right, tree.rank - 1 - (node->balance > 0)}};
+    }
 
-        if (balance > 1 && value < current->left->key) {
-            return rotateRight(current);
+    Ranked join(Ranked left, Node* mid, Ranked right) {
+        if (left.rank > right.rank + 1) {
+            return joinRight(left, mid, right);
         }
-        if (balance < -1 && value > current->right->key) {
-            return rotateLeft(current);
+        if (right.rank > left.rank + 1) {
+            return joinLeft(left, mid, right);
         }
-        if (balance > 1 && value > current->left->key) {
-            current->left = rotateLeft(current->left);
-            return rotateRight(current);
+        return link(left, mid, right);
+    }
+
+    // Makes mid the parent of two subtrees whose heights differ by at most one.
+    Ranked link(Ranked left, Node* mid, Ranked right) {
+        mid->left = left.root;
+        mid->right = right.root;
+        mid->size = 1 + subtreeSize(left.root) + subtreeSize(right.root);
+        mid->balance = left.rank - right.rank;
+        return {mid, std::max(left.rank, right.rank) + 1};
+    }
+
+    // Walks down the right spine of the taller left tree to the first subtree
+    // at most one level taller than right, links the two under mid there and
+    // rebalances on the way back up. The joined subtree grows by at most one
+    // level, so a rotation leaves the parent at the new subtree's height, or
+    // one more when the rotated root is left unbalanced.
+    Ranked joinRight(Ranked left, Node* mid, Ranked right) {
+        auto [inner, outer] = expose(left);
+        Ranked joined = outer.rank <= right.rank + 1 ? link(outer, mid, right) : joinRight(outer, mid, right);
+
+        Node* node = left.root;
+        node->right = joined.root;
+        node->size = 1 + subtreeSize(node->left) + joined.root->size;
+        node->balance = inner.rank - joined.rank;
+        if (node->balance >= -1) {
+            return {node, std::max(inner.rank, joined.rank) + 1};
         }
-        if (balance < -1 && value < current->right->key) {
-            current->right = rotateRight(current->right);
-            return rotateLeft(current);
+        Node* new_root = rebalance(node);
+        return {new_root, joined.rank + (new_root->balance != 0)};
+    }
+
+    Ranked joinLeft(Ranked left, Node* mid, Ranked right) {
+        auto [outer, inner] = expose(right);
+        Ranked joined = outer.rank <= left.rank + 1 ? link(left, mid, outer) : joinLeft(left, mid, outer);
+
+        Node* node = right.root;
+        node->left = joined.root;
+        node->size = 1 + joined.root->size + subtreeSize(node->right);
+        node->balance = joined.rank - inner.rank;
+        if (node->balance <= 1) {
+            return {node, std::max(joined.rank, inner.rank) + 1};
         }
-        
-        return current;
+        Node* new_root = rebalance(node);
+        return {new_root, joined.rank + (new_root->balance != 0)};
     }
 
-    Node* findMinValueNode(Node* node) const {
-        Node* current = node;
-        while (current->left != nullptr) {
-            current = current->left;
+    // Takes ownership of a subtree built by from. Nodes can only move between
+    // trees whose allocators can free each other's nodes; otherwise they are
+    // copied and from frees the originals.
+    Node* adopt(AVLTree& from, Node* node) {
+        if (alloc_ == from.alloc_) {
+            return node;
         }
-        return current;
+        Node* copy = cloneTree(node);
+        from.destroyTree(node);
+        return copy;
     }
 
-    Node* removeUtility(Node* current, const T& value) {
-        if (current == nullptr) {
+    Node* cloneTree(const Node* node) {
+        if (node == nullptr) {
             return nullptr;
         }
-        
-        if (value < current->key) {
-            current->left = removeUtility(current->left, value);
-        } else if (value > current->key) {
-            current->right = removeUtility(current->right, value);
-        } else {
-            if (current->right == nullptr || current->left == nullptr) {
-                Node* temp = current->left ? current->left : current->right;
-                
-                if (temp == nullptr) {
-                    temp = current;
-                    current = nullptr;
-                } else {
-                    *current = *temp;
-                }
-                delete temp;
-            } else {
-                Node* temp = findMinValueNode(current->right);
-                current->key = temp->key;
-                current->right = removeUtility(current->right, temp->key);
-            }
+        Node* copy = createNode(node->key);
+        copy->left = cloneTree(node->left);
+        copy->right = cloneTree(node->right);
+        copy->size = node->size;
+        copy->balance = node->balance;
+        return copy;
+    }
+
+    static Node* minimum(Node* node) {
+        while (node->left != nullptr) {
+            node = node->left;
+        }
+        return node;
+    }
+
+    static Node* maximum(Node* node) {
+        while (node->right != nullptr) {
+            node = node->right;
         }
-        
-        if (current == nullptr) {
+        return node;
+    }
+
+    Node* buildBalanced(const std::vector<T>& values, size_t begin, size_t end, int& height) {
+        if (begin == end) {
+            height = 0;
             return nullptr;
         }
 
-        updateHeight(current);
-        int balance = getBalance(current);
+        size_t mid = begin + (end - begin) / 2;
+        Node* node = createNode(values[mid]);
 
-        if (balance > 1 && getBalance(current->left) >= 0) {
-            return rotateRight(current);
-        }
-        if (balance < -1 && getBalance(current->right) <= 0) {
-            return rotateLeft(current);
-        }
-        if (balance > 1 && getBalance(current->left) < 0) {
-            current->left = rotateLeft(current->left);
-            return rotateRight(current);
+        int left_height = 0;
+        int right_height = 0;
+        node->left = buildBalanced(values, begin, mid, left_height);
+        node->right = buildBalanced(values, mid + 1, end, right_height);
+
+        node->balance = static_cast<signed char>(left_height - right_height);
+        node->size = end - begin;
+        height = std::max(left_height, right_height) + 1;
+        return node;
+    }
+
+    Node* createNode(const T& key) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, key);
+        return node;
+    }
+
+    void destroyNode(Node* node) {
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
+    // Returns node itself if this tree is its only owner, or else a private
+    // copy that shares the children, dropping this tree's reference to node.
+    // The caller relinks the copy in node's place.
+    Node* unshare(Node* node) {
+        if (node == nullptr || !isShared(node)) {
+            return node;
         }
-        if (balance < -1 && getBalance(current->right) > 0) {
-            current->right = rotateRight(current->right);
-            return rotateLeft(current);
+        Node* copy = createNode(node->key);
+        copy->left = node->left;
+        copy->right = node->right;
+        copy->size = node->size;
+        copy->balance = node->balance;
+        retain(static_cast<Node*>(copy->left));
+        retain(static_cast<Node*>(copy->right));
+        destroyTree(node);
+        return copy;
+    }
+
+    Node* own(Link& link) {
+        Node* node = link;
+        Node* owned = unshare(node);
+        if (owned != node) {
+            link = owned;
         }
-        
-        return current;
+        return owned;
     }
 
+    // Drops a reference to the subtree and frees whatever no other tree shares.
     void destroyTree(Node* node) {
-        if (node) {
+        if (node && dropRef(node)) {
             destroyTree(node->left);
             destroyTree(node->right);
-            delete node;
+            destroyNode(node);
         }
     }
 };
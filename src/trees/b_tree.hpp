@@ -0,0 +1,772 @@
+#pragma once
+
+#include "tree_visitor.h"
+#include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "batch_search.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Bytes of keys per B-tree node. The default of four cache lines holds 63 ints,
+// so a million keys fit in four levels instead of the ~20 a binary tree needs.
+// Override at build time with -DBTREE_NODE_BYTES=<bytes>.
+#ifndef BTREE_NODE_BYTES
+#define BTREE_NODE_BYTES 256
+#endif
+
+// In-order iterator over a B-tree. Each frame on the path holds a node and a
+// key index: for the top frame that is the current key, for the frames below
+// it the key that follows the child the path descended into.
+template <typename Node>
+class BTreeIterator {
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = typename std::remove_cv_t<decltype(Node::keys)>::value_type;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    BTreeIterator() = default;
+
+    // The past-the-end iterator.
+    explicit BTreeIterator(const Node* root) : root_(root) {}
+
+    static BTreeIterator first(const Node* root) {
+        BTreeIterator it(root);
+        if (root != nullptr && root->count > 0) {
+            it.descendLeft(root);
+        }
+        return it;
+    }
+
+    // First key not less than value.
+    template <typename T>
+    static BTreeIterator lowerBound(const Node* root, const T& value) {
+        BTreeIterator it(root);
+        const Node* node = root;
+        while (node != nullptr) {
+            uint32_t index = Node::lowerIndex(node, value);
+            it.path_.push_back({node, index});
+            if (node->leaf || (index < node->count && !(value < node->keys[index]))) {
+                break;
+            }
+            node = node->children[index];
+        }
+        it.skipExhausted();
+        return it;
+    }
+
+    // First key greater than value.
+    template <typename T>
+    static BTreeIterator upperBound(const Node* root, const T& value) {
+        BTreeIterator it(root);
+        const Node* node = root;
+        while (node != nullptr) {
+            uint32_t index = Node::upperIndex(node, value);
+            it.path_.push_back({node, index});
+            node = node->leaf ? nullptr : node->children[index];
+        }
+        it.skipExhausted();
+        return it;
+    }
+
+    reference operator*() const {
+        return path_.back().node->keys[path_.back().index];
+    }
+
+    pointer operator->() const {
+        return &**this;
+    }
+
+    BTreeIterator& operator++() {
+        Frame& top = path_.back();
+        if (!top.node->leaf) {
+            top.index++;
+            descendLeft(top.node->children[top.index]);
+            return *this;
+        }
+        top.index++;
+        skipExhausted();
+        return *this;
+    }
+
+    BTreeIterator operator++(int) {
+        BTreeIterator copy = *this;
+        ++*this;
+        return copy;
+    }
+
+    BTreeIterator& operator--() {
+        if (path_.empty()) {
+            if (root_ != nullptr && root_->count > 0) {
+                descendRight(root_);
+            }
+            return *this;
+        }
+
+        Frame& top = path_.back();
+        if (!top.node->leaf) {
+            descendRight(top.node->children[top.index]);
+            return *this;
+        }
+        if (top.index > 0) {
+            top.index--;
+            return *this;
+        }
+
+        do {
+            path_.pop_back();
+        } while (!path_.empty() && path_.back().index == 0);
+        if (!path_.empty()) {
+            path_.back().index--;
+        }
+        return *this;
+    }
+
+    BTreeIterator operator--(int) {
+        BTreeIterator copy = *this;
+        --*this;
+        return copy;
+    }
+
+    friend bool operator==(const BTreeIterator& lhs, const BTreeIterator& rhs) {
+        if (lhs.path_.empty() || rhs.path_.empty()) {
+            return lhs.path_.empty() == rhs.path_.empty();
+        }
+        return lhs.path_.back().node == rhs.path_.back().node && lhs.path_.back().index == rhs.path_.back().index;
+    }
+
+private:
+    struct Frame {
+        const Node* node;
+        uint32_t index;
+    };
+
+    const Node* root_ = nullptr;
+    std::vector<Frame> path_;
+
+    void descendLeft(const Node* node) {
+        while (true) {
+            path_.push_back({node, 0});
+            if (node->leaf) {
+                return;
+            }
+            node = node->children[0];
+        }
+    }
+
+    void descendRight(const Node* node) {
+        while (!node->leaf) {
+            path_.push_back({node, node->count});
+            node = node->children[node->count];
+        }
+        path_.push_back({node, node->count - 1});
+    }
+
+    // Pops frames that have run past their last key; the first one that has
+    // not becomes the current position.
+    void skipExhausted() {
+        while (!path_.empty() && path_.back().index == path_.back().node->count) {
+            path_.pop_back();
+        }
+    }
+};
+
+// B-tree with a node fanout sized to cache lines. A node keeps its keys in a
+// sorted array, so a search costs one or two cache misses per level and the
+// comparisons inside a node run over contiguous memory. Every node also
+// stores the number of keys in its subtree for rank and select.
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class BTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
+public:
+    // Every node but the root holds between MIN_DEGREE - 1 and MAX_KEYS keys.
+    static constexpr uint32_t MIN_DEGREE = std::max<uint32_t>(2, (BTREE_NODE_BYTES / sizeof(T) + 1) / 2);
+    static constexpr uint32_t MAX_KEYS = 2 * MIN_DEGREE - 1;
+
+    struct alignas(64) Node {
+        std::array<T, MAX_KEYS> keys;
+        uint32_t count;
+        bool leaf;
+        typename NodeStorage<Allocator>::Size size;
+        std::array<typename NodeStorage<Allocator>::template Link<Node>, MAX_KEYS + 1> children;
+
+        explicit Node(bool leaf) : count(0), leaf(leaf), size(0) {}
+
+        // Index of the first key not less than value. Arithmetic keys are
+        // counted with a branchless scan the compiler vectorizes, which beats
+        // a binary search at these array sizes.
+        static uint32_t lowerIndex(const Node* node, const T& value) {
+#ifdef __AVX2__
+            if constexpr (std::is_same_v<T, int32_t>) {
+                return countAvx2<false>(node, value);
+            }
+#endif
+            if constexpr (std::is_arithmetic_v<T>) {
+                uint32_t index = 0;
+                for (uint32_t i = 0; i < node->count; i++) {
+                    index += node->keys[i] < value;
+                }
+                return index;
+            } else {
+                return std::lower_bound(node->keys.begin(), node->keys.begin() + node->count, value) - node->keys.begin();
+            }
+        }
+
+        // Index of the first key greater than value.
+        static uint32_t upperIndex(const Node* node, const T& value) {
+#ifdef __AVX2__
+            if constexpr (std::is_same_v<T, int32_t>) {
+                return countAvx2<true>(node, value);
+            }
+#endif
+            if constexpr (std::is_arithmetic_v<T>) {
+                uint32_t index = 0;
+                for (uint32_t i = 0; i < node->count; i++) {
+                    index += !(value < node->keys[i]);
+                }
+                return index;
+            } else {
+                return std::upper_bound(node->keys.begin(), node->keys.begin() + node->count, value) - node->keys.begin();
+            }
+        }
+
+#ifdef __AVX2__
+        // Compares eight keys at a time and counts the mask bits: keys less
+        // than value, or not greater than it when inclusive.
+        template <bool Inclusive>
+        static uint32_t countAvx2(const Node* node, int32_t value) {
+            const int32_t* keys = node->keys.data();
+            __m256i needle = _mm256_set1_epi32(value);
+            uint32_t index = 0;
+            uint32_t i = 0;
+            for (; i + 8 <= node->count; i += 8) {
+                __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+                __m256i mask = Inclusive ? _mm256_cmpgt_epi32(block, needle) : _mm256_cmpgt_epi32(needle, block);
+                uint32_t bits = std::popcount(static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(mask))));
+                index += Inclusive ? 8 - bits : bits;
+            }
+            for (; i < node->count; i++) {
+                index += Inclusive ? !(value < keys[i]) : keys[i] < value;
+            }
+            return index;
+        }
+#endif
+    };
+
+    BTree() : root_(nullptr) {}
+
+    ~BTree() {
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            alloc_.release();
+        } else {
+            destroyTree(root_);
+        }
+    }
+
+    bool search(const T& value) override {
+        return findKey(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
+        return findKey(value);
+    }
+
+    bool assign(const T& value) override {
+        T* key = findKey(value);
+        if (key == nullptr) {
+            return false;
+        }
+        *key = value;
+        return true;
+    }
+
+    // Interleaves the lookups and prefetches the key lines of every lane's
+    // next node.
+    void searchBatch(std::span<const T> keys, std::span<bool> out) override {
+        interleavedSearch(static_cast<const Node*>(root_), keys, out,
+            [&instrumentation = this->instrumentation_](const Node* node, const T& key, bool& found) -> const Node* {
+                instrumentation.compare(node->count);
+                uint32_t index = Node::lowerIndex(node, key);
+                if (index < node->count && !(key < node->keys[index])) {
+                    found = true;
+                    return nullptr;
+                }
+                return node->leaf ? nullptr : node->children[index];
+            },
+            [](const Node* node) {
+                const char* bytes = reinterpret_cast<const char*>(node);
+                for (size_t line = 0; line < KEY_LINES; line++) {
+                    __builtin_prefetch(bytes + 64 * line);
+                }
+            });
+    }
+
+    // Splits full nodes on the way down, so the key always lands in a leaf
+    // with room and no second pass is needed.
+    void insert(const T& value) override {
+        if (root_ == nullptr) {
+            root_ = createNode(true);
+        }
+        if (root_->count == MAX_KEYS) {
+            Node* root = createNode(false);
+            root->children[0] = root_;
+            root->size = root_->size;
+            root_ = root;
+            splitChild(root, 0);
+        }
+
+        Node* path[MAX_HEIGHT];
+        size_t depth = 0;
+        Node* node = root_;
+        while (true) {
+            this->instrumentation_.compare(node->count);
+            uint32_t index = Node::lowerIndex(node, value);
+            if (index < node->count && !(value < node->keys[index])) {
+                return;
+            }
+            path[depth++] = node;
+            if (node->leaf) {
+                std::move_backward(node->keys.begin() + index, node->keys.begin() + node->count, node->keys.begin() + node->count + 1);
+                node->keys[index] = value;
+                node->count++;
+                break;
+            }
+
+            if (node->children[index]->count == MAX_KEYS) {
+                splitChild(node, index);
+                if (node->keys[index] < value) {
+                    index++;
+                } else if (!(value < node->keys[index])) {
+                    return;
+                }
+            }
+            node = node->children[index];
+        }
+
+        for (size_t i = 0; i < depth; i++) {
+            path[i]->size++;
+        }
+    }
+
+    void remove(const T& value) override {
+        if (root_ == nullptr) {
+            return;
+        }
+        removeFrom(root_, value);
+        if (root_->count == 0) {
+            Node* root = root_;
+            root_ = root->leaf ? nullptr : root->children[0];
+            destroyNode(root);
+        }
+    }
+
+    size_t rank(const T& value) override {
+        return countBelow(value, false);
+    }
+
+    T select(size_t k) override {
+        if (k >= (root_ == nullptr ? 0 : root_->size)) {
+            throw std::out_of_range("Rank " + std::to_string(k) + " is out of range");
+        }
+
+        const Node* node = root_;
+        while (!node->leaf) {
+            uint32_t index = 0;
+            while (k > node->children[index]->size) {
+                k -= node->children[index]->size + 1;
+                index++;
+            }
+            if (k == node->children[index]->size) {
+                return node->keys[index];
+            }
+            node = node->children[index];
+        }
+        return node->keys[k];
+    }
+
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelow(hi, true) - countBelow(lo, false);
+    }
+
+    size_t size() const override {
+        return root_ == nullptr ? 0 : root_->size;
+    }
+
+    size_t bytesAllocated() const override {
+        return nodes_ * sizeof(Node);
+    }
+
+    // Counts nodes, not key comparisons.
+    size_t searchDepth(const T& value) const override {
+        size_t depth = 0;
+        const Node* node = root_;
+        while (node != nullptr) {
+            depth++;
+            uint32_t index = Node::lowerIndex(node, value);
+            if (index < node->count && !(value < node->keys[index])) {
+                break;
+            }
+            node = node->leaf ? nullptr : node->children[index];
+        }
+        return depth;
+    }
+
+    bool keepsDuplicates() const override {
+        return false;
+    }
+
+    // Every leaf is at the same depth, so this is O(log n).
+    size_t height() const {
+        size_t height = 0;
+        for (const Node* node = root_; node != nullptr; node = node->leaf ? nullptr : node->children[0]) {
+            height++;
+        }
+        return height;
+    }
+
+    using iterator = BTreeIterator<Node>;
+    using const_iterator = BTreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    const_iterator lower_bound(const T& value) const {
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) const {
+        return const_iterator::upperBound(root_, value);
+    }
+
+    Node* getRoot() const {
+        return root_;
+    }
+
+    static constexpr bool READS_MODIFY_TREE = false;
+
+    static std::string name() {
+        return "B-Tree";
+    }
+
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
+        visitor.visit(*this);
+    }
+
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        out.insert(out.end(), begin(), end());
+    }
+
+    // Packs the keys bottom-up with every child of a node getting an equal
+    // share, which keeps all nodes at least half full.
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+        root_ = nullptr;
+        if (values.empty()) {
+            return;
+        }
+
+        size_t height = 1;
+        size_t capacity = MAX_KEYS;
+        while (capacity < values.size()) {
+            capacity = capacity * (MAX_KEYS + 1) + MAX_KEYS;
+            height++;
+        }
+        root_ = buildSubtree(values, 0, values.size(), height, 2);
+    }
+
+private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+    // Every level below the root at least doubles the key count.
+    static constexpr size_t MAX_HEIGHT = 64;
+    // Cache lines holding a node's keys and count.
+    static constexpr size_t KEY_LINES = (sizeof(std::array<T, MAX_KEYS>) + sizeof(uint32_t) + 63) / 64;
+
+    NodeAllocator alloc_;
+    Node* root_ = nullptr;
+    size_t nodes_ = 0;
+
+    T* findKey(const T& value) {
+        Node* node = root_;
+        while (node != nullptr) {
+            this->instrumentation_.compare(node->count);
+            uint32_t index = Node::lowerIndex(node, value);
+            if (index < node->count && !(value < node->keys[index])) {
+                return &node->keys[index];
+            }
+            node = node->leaf ? nullptr : node->children[index];
+        }
+        return nullptr;
+    }
+
+    // Number of keys less than value, or not greater than value when inclusive.
+    size_t countBelow(const T& value, bool inclusive) const {
+        size_t count = 0;
+        const Node* node = root_;
+        while (node != nullptr) {
+            uint32_t index = inclusive ? Node::upperIndex(node, value) : Node::lowerIndex(node, value);
+            count += index;
+            if (node->leaf) {
+                break;
+            }
+            for (uint32_t i = 0; i < index; i++) {
+                count += node->children[i]->size;
+            }
+            node = node->children[index];
+        }
+        return count;
+    }
+
+    // Moves the upper half of the full child at index into a new sibling and
+    // lifts its median into parent, which must not be full.
+    void splitChild(Node* parent, uint32_t index) {
+        Node* child = parent->children[index];
+        Node* sibling = createNode(child->leaf);
+
+        std::move(child->keys.begin() + MIN_DEGREE, child->keys.begin() + MAX_KEYS, sibling->keys.begin());
+        if (!child->leaf) {
+            std::copy(child->children.begin() + MIN_DEGREE, child->children.begin() + MAX_KEYS + 1, sibling->children.begin());
+        }
+        sibling->count = MIN_DEGREE - 1;
+        child->count = MIN_DEGREE - 1;
+
+        std::move_backward(parent->keys.begin() + index, parent->keys.begin() + parent->count, parent->keys.begin() + parent->count + 1);
+        std::copy_backward(parent->children.begin() + index + 1, parent->children.begin() + parent->count + 1, parent->children.begin() + parent->count + 2);
+        parent->keys[index] = std::move(child->keys[MIN_DEGREE - 1]);
+        parent->children[index + 1] = sibling;
+        parent->count++;
+
+        updateSize(sibling);
+        child->size -= sibling->size + 1;
+    }
+
+    // Removes value from the subtree of node. Every node the descent enters
+    // is first topped up to MIN_DEGREE keys, so a key can always be taken out
+    // of a leaf without underflowing it. The root may end up with no keys;
+    // remove() collapses it.
+    bool removeFrom(Node* node, const T& value) {
+        this->instrumentation_.compare(node->count);
+        uint32_t index = Node::lowerIndex(node, value);
+        bool found = index < node->count && !(value < node->keys[index]);
+
+        if (node->leaf) {
+            if (!found) {
+                return false;
+            }
+            std::move(node->keys.begin() + index + 1, node->keys.begin() + node->count, node->keys.begin() + index);
+            node->count--;
+            node->size--;
+            return true;
+        }
+
+        bool removed;
+        if (found) {
+            Node* left = node->children[index];
+            Node* right = node->children[index + 1];
+            if (left->count >= MIN_DEGREE) {
+                T predecessor = maxKey(left);
+                node->keys[index] = predecessor;
+                removed = removeFrom(left, predecessor);
+            } else if (right->count >= MIN_DEGREE) {
+                T successor = minKey(right);
+                node->keys[index] = successor;
+                removed = removeFrom(right, successor);
+            } else {
+                mergeChildren(node, index);
+                removed = removeFrom(left, value);
+            }
+        } else {
+            if (node->children[index]->count < MIN_DEGREE) {
+                index = fillChild(node, index);
+            }
+            removed = removeFrom(node->children[index], value);
+        }
+
+        if (removed) {
+            node->size--;
+        }
+        return removed;
+    }
+
+    // Gives the child at index at least MIN_DEGREE keys by borrowing from a
+    // sibling or merging with one. Returns the index of the child that now
+    // covers the same key range.
+    uint32_t fillChild(Node* node, uint32_t index) {
+        if (index > 0 && node->children[index - 1]->count >= MIN_DEGREE) {
+            borrowFromLeft(node, index);
+        } else if (index < node->count && node->children[index + 1]->count >= MIN_DEGREE) {
+            borrowFromRight(node, index);
+        } else if (index < node->count) {
+            mergeChildren(node, index);
+        } else {
+            mergeChildren(node, index - 1);
+            return index - 1;
+        }
+        return index;
+    }
+
+    void borrowFromLeft(Node* node, uint32_t index) {
+        Node* child = node->children[index];
+        Node* sibling = node->children[index - 1];
+
+        std::move_backward(child->keys.begin(), child->keys.begin() + child->count, child->keys.begin() + child->count + 1);
+        child->keys[0] = std::move(node->keys[index - 1]);
+        node->keys[index - 1] = std::move(sibling->keys[sibling->count - 1]);
+
+        size_t moved = 1;
+        if (!child->leaf) {
+            std::copy_backward(child->children.begin(), child->children.begin() + child->count + 1, child->children.begin() + child->count + 2);
+            child->children[0] = sibling->children[sibling->count];
+            moved += child->children[0]->size;
+        }
+
+        child->count++;
+        sibling->count--;
+        child->size += moved;
+        sibling->size -= moved;
+    }
+
+    void borrowFromRight(Node* node, uint32_t index) {
+        Node* child = node->children[index];
+        Node* sibling = node->children[index + 1];
+
+        child->keys[child->count] = std::move(node->keys[index]);
+        node->keys[index] = std::move(sibling->keys[0]);
+        std::move(sibling->keys.begin() + 1, sibling->keys.begin() + sibling->count, sibling->keys.begin());
+
+        size_t moved = 1;
+        if (!child->leaf) {
+            child->children[child->count + 1] = sibling->children[0];
+            moved += sibling->children[0]->size;
+            std::copy(sibling->children.begin() + 1, sibling->children.begin() + sibling->count + 1, sibling->children.begin());
+        }
+
+        child->count++;
+        sibling->count--;
+        child->size += moved;
+        sibling->size -= moved;
+    }
+
+    // Folds the child at index + 1 and the key between them into the child
+    // at index. Both children hold MIN_DEGREE - 1 keys, so the result is full.
+    void mergeChildren(Node* node, uint32_t index) {
+        Node* child = node->children[index];
+        Node* sibling = node->children[index + 1];
+
+        child->keys[child->count] = std::move(node->keys[index]);
+        std::move(sibling->keys.begin(), sibling->keys.begin() + sibling->count, child->keys.begin() + child->count + 1);
+        if (!child->leaf) {
+            std::copy(sibling->children.begin(), sibling->children.begin() + sibling->count + 1, child->children.begin() + child->count + 1);
+        }
+        child->count += sibling->count + 1;
+        child->size += sibling->size + 1;
+
+        std::move(node->keys.begin() + index + 1, node->keys.begin() + node->count, node->keys.begin() + index);
+        std::copy(node->children.begin() + index + 2, node->children.begin() + node->count + 1, node->children.begin() + index + 1);
+        node->count--;
+
+        destroyNode(sibling);
+    }
+
+    const T& minKey(const Node* node) const {
+        while (!node->leaf) {
+            node = node->children[0];
+        }
+        return node->keys[0];
+    }
+
+    const T& maxKey(const Node* node) const {
+        while (!node->leaf) {
+            node = node->children[node->count];
+        }
+        return node->keys[node->count - 1];
+    }
+
+    void updateSize(Node* node) {
+        node->size = node->count;
+        if (!node->leaf) {
+            for (uint32_t i = 0; i <= node->count; i++) {
+                node->size += node->children[i]->size;
+            }
+        }
+    }
+
+    // Builds a subtree of the given height over count values starting at
+    // first, with at least minChildren children unless it is a leaf.
+    Node* buildSubtree(const std::vector<T>& values, size_t first, size_t count, size_t height, size_t minChildren) {
+        Node* node = createNode(height == 1);
+        node->size = count;
+
+        if (height == 1) {
+            std::copy(values.begin() + first, values.begin() + first + count, node->keys.begin());
+            node->count = static_cast<uint32_t>(count);
+            return node;
+        }
+
+        size_t childSpan = 1;
+        for (size_t i = 1; i < height; i++) {
+            childSpan *= MAX_KEYS + 1;
+        }
+        size_t children = std::max(minChildren, (count + childSpan) / childSpan);
+        size_t share = (count - (children - 1)) / children;
+        size_t extra = (count - (children - 1)) % children;
+
+        size_t next = first;
+        for (size_t i = 0; i < children; i++) {
+            size_t childCount = share + (i < extra ? 1 : 0);
+            node->children[i] = buildSubtree(values, next, childCount, height - 1, MIN_DEGREE);
+            next += childCount;
+            if (i + 1 < children) {
+                node->keys[i] = values[next++];
+            }
+        }
+        node->count = static_cast<uint32_t>(children - 1);
+        return node;
+    }
+
+    Node* createNode(bool leaf) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, leaf);
+        nodes_++;
+        return node;
+    }
+
+    void destroyNode(Node* node) {
+        nodes_--;
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
+    void destroyTree(Node* node) {
+        if (node) {
+            if (!node->leaf) {
+                for (uint32_t i = 0; i <= node->count; i++) {
+                    destroyTree(node->children[i]);
+                }
+            }
+            destroyNode(node);
+        }
+    }
+};
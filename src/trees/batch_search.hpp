@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <span>
+
+// Number of lookups a batched search keeps in flight. Each one is a chain of
+// dependent loads, but the chains are independent of each other, so with a
+// prefetch issued for every lane's next node the misses of up to this many
+// lookups overlap instead of being paid one after another.
+constexpr size_t SEARCH_BATCH_LANES = 16;
+
+// Advances up to SEARCH_BATCH_LANES lookups round-robin, one node each per
+// round, and refills a lane with the next key as soon as its lookup ends.
+// step(node, key, found) returns the node to visit next, or nullptr once the
+// lookup is resolved (setting found if the key was seen); prefetch(node) is
+// called on every node a lane is about to visit.
+template <typename Node, typename T, typename Step, typename Prefetch>
+void interleavedSearch(const Node* root, std::span<const T> keys, std::span<bool> out, Step step, Prefetch prefetch) {
+    if (root == nullptr) {
+        std::fill(out.begin(), out.begin() + keys.size(), false);
+        return;
+    }
+
+    const Node* nodes[SEARCH_BATCH_LANES];
+    size_t indices[SEARCH_BATCH_LANES];
+    size_t lanes = std::min(SEARCH_BATCH_LANES, keys.size());
+    for (size_t lane = 0; lane < lanes; lane++) {
+        nodes[lane] = root;
+        indices[lane] = lane;
+    }
+
+    size_t next = lanes;
+    size_t active = lanes;
+    while (active > 0) {
+        for (size_t lane = 0; lane < lanes; lane++) {
+            const Node* node = nodes[lane];
+            if (node == nullptr) {
+                continue;
+            }
+
+            bool found = false;
+            node = step(node, keys[indices[lane]], found);
+            if (node == nullptr) {
+                out[indices[lane]] = found;
+                if (next < keys.size()) {
+                    indices[lane] = next++;
+                    node = root;
+                } else {
+                    active--;
+                }
+            }
+            if (node != nullptr) {
+                prefetch(node);
+            }
+            nodes[lane] = node;
+        }
+    }
+}
+
+// Batched search over nodes with key, left and right. Reports one comparison
+// per node visited to instrumentation.
+template <typename Node, typename T, typename Instrumentation>
+void interleavedSearch(const Node* root, std::span<const T> keys, std::span<bool> out, Instrumentation& instrumentation) {
+    interleavedSearch(root, keys, out,
+        [&instrumentation](const Node* node, const T& key, bool& found) -> const Node* {
+            instrumentation.compare();
+            if (key == node->key) {
+                found = true;
+                return nullptr;
+            }
+            return key < node->key ? node->left : node->right;
+        },
+        [](const Node* node) {
+            __builtin_prefetch(node);
+        });
+}
@@ -2,16 +2,23 @@
 
 #include "tree_visitor.h"
 #include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "order_statistics.hpp"
+#include "tree_iterator.hpp"
+#include "batch_search.hpp"
 #include <algorithm>
 #include <vector>
 
-template <typename T>
-class BBAlphaTree final : public BinarySearchTree<T> {
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class BBAlphaTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
 public:
     struct Node {
+        using Link = typename NodeStorage<Allocator>::template Link<Node>;
+
         T key;
-        Node *left, *right;
-        size_t size;
+        Link left, right;
+        typename NodeStorage<Allocator>::Size size;
 
         explicit Node(const T& key) : key(key), left(nullptr), right(nullptr), size(1) {}
     };
@@ -19,26 +26,38 @@ public:
     BBAlphaTree(double alpha = 0.25) : root_(nullptr), alpha_(alpha) {}
     
     ~BBAlphaTree() {
-        destroyTree(root_);
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            alloc_.release();
+        } else {
+            destroyTree(root_);
+        }
     }
 
     bool search(const T& value) override {
-        Node* current = root_;
-        while (current != nullptr) {
-            if (value == current->key) {
-                return true;
-            } else if (value < current->key) {
-                current = current->left;
-            } else {
-                current = current->right;
-            }
+        return findNode(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
+        Node* node = findNode(value);
+        return node != nullptr ? &node->key : nullptr;
+    }
+
+    bool assign(const T& value) override {
+        Node* node = findNode(value);
+        if (node == nullptr) {
+            return false;
         }
-        return false;
+        node->key = value;
+        return true;
+    }
+
+    void searchBatch(std::span<const T> keys, std::span<bool> out) override {
+        interleavedSearch(static_cast<const Node*>(root_), keys, out, this->instrumentation_);
     }
 
     void insert(const T &value) override {
         if (root_ == nullptr) {
-            root_ = new Node(value);
+            root_ = createNode(value);
             return;
         }
         root_ = insertUtility(root_, value);
@@ -48,22 +67,119 @@ public:
         root_ = removeUtility(root_, value);
     }
 
+    size_t rank(const T& value) override {
+        return countBelow(root_, value, false);
+    }
+
+    T select(size_t k) override {
+        return selectNode(root_, k)->key;
+    }
+
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelow(root_, hi, true) - countBelow(root_, lo, false);
+    }
+
+    size_t size() const override {
+        return subtreeSize(root_);
+    }
+
+    size_t bytesAllocated() const override {
+        return size() * sizeof(Node);
+    }
+
+    size_t searchDepth(const T& value) const override {
+        return searchPathLength(static_cast<const Node*>(root_), value);
+    }
+
+    bool keepsDuplicates() const override {
+        return false;
+    }
+
+    using iterator = TreeIterator<Node>;
+    using const_iterator = TreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    const_iterator lower_bound(const T& value) const {
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) const {
+        return const_iterator::upperBound(root_, value);
+    }
+
     Node* getRoot() const {
         return root_;
     }
 
+    static constexpr bool READS_MODIFY_TREE = false;
+
     static std::string name() {
         return "BB-alpha Tree";
     }
 
-    void accept(TreeVisitor<T>& visitor) const override {
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
         visitor.visit(*this);
     }
 
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        std::vector<Node*> stack;
+        Node* current = root_;
+        while (current != nullptr || !stack.empty()) {
+            while (current != nullptr) {
+                stack.push_back(current);
+                current = current->left;
+            }
+            current = stack.back();
+            stack.pop_back();
+            out.push_back(current->key);
+            current = current->right;
+        }
+    }
+
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+
+        std::vector<Node*> nodes;
+        nodes.reserve(values.size());
+        for (const T& value : values) {
+            nodes.push_back(createNode(value));
+        }
+        root_ = buildBalancedTree(nodes, 0, static_cast<int>(nodes.size()) - 1);
+    }
+
 private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+    NodeAllocator alloc_;
     Node* root_ = nullptr;
     double alpha_;
 
+    Node* findNode(const T& value) {
+        Node* current = root_;
+        size_t visited = 0;
+        while (current != nullptr) {
+            visited++;
+            if (value == current->key) {
+                break;
+            }
+            current = value < current->key ? current->left : current->right;
+        }
+        this->instrumentation_.compare(visited);
+        return current;
+    }
+
     size_t getSize(Node* node) const {
         if (node == nullptr) {
             return 0;
@@ -99,8 +215,10 @@ private:
     }
 
     Node* rebuildSubtree(Node* root) {
+        this->rebuilds_++;
         std::vector<Node*> nodes;
         flattenTree(root, nodes);
+        this->instrumentation_.rebuild(nodes.size());
         return buildBalancedTree(nodes, 0, nodes.size() - 1);
     }
 
@@ -133,9 +251,10 @@ private:
 
     Node* insertUtility(Node* current, const T& value) {
         if (current == nullptr) {
-            return new Node(value);
+            return createNode(value);
         }
         
+        this->instrumentation_.compare();
         if (value < current->key) {
             current->left = insertUtility(current->left, value);
         } else if (value > current->key) {
@@ -166,6 +285,7 @@ private:
             return nullptr;
         }
         
+        this->instrumentation_.compare();
         if (value < current->key) {
             current->left = removeUtility(current->left, value);
         } else if (value > current->key) {
@@ -174,11 +294,11 @@ private:
             
             if (current->left == nullptr) {
                 Node* temp = current->right;
-                delete current;
+                destroyNode(current);
                 return temp;
             } else if (current->right == nullptr) {
                 Node* temp = current->left;
-                delete current;
+                destroyNode(current);
                 return temp;
             }
             
@@ -196,11 +316,22 @@ private:
         return current;
     }
 
+    Node* createNode(const T& key) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, key);
+        return node;
+    }
+
+    void destroyNode(Node* node) {
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
     void destroyTree(Node* node) {
         if (node) {
             destroyTree(node->left);
             destroyTree(node->right);
-            delete node;
+            destroyNode(node);
         }
     }
 };
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "batch_search.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <new>
+#include <span>
+#include <vector>
+
+enum class FrozenLayout {
+    // Breadth-first order: the children of position k sit at 2k and 2k + 1,
+    // so the four levels below a node share one cache line and can be
+    // prefetched together.
+    EYTZINGER,
+    // van Emde Boas order: the tree is split at half its height and the top
+    // and bottom subtrees are laid out recursively, which keeps every
+    // subtree that fits in a block contiguous at any block size.
+    VEB
+};
+
+// Cache-line aligned storage, so that the Eytzinger prefetch of the 16th
+// descendant of position k touches exactly one line.
+template <typename T>
+struct CacheLineAllocator {
+    using value_type = T;
+
+    static constexpr std::align_val_t ALIGNMENT{64};
+
+    CacheLineAllocator() = default;
+
+    template <typename U>
+    CacheLineAllocator(const CacheLineAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), ALIGNMENT));
+    }
+
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, ALIGNMENT);
+    }
+
+    friend bool operator==(const CacheLineAllocator&, const CacheLineAllocator&) {
+        return true;
+    }
+};
+
+// Immutable snapshot of a tree's keys in an implicit layout: there are no
+// child pointers, the position of a child follows from the position of its
+// parent. Searches descend a complete binary tree with a branchless loop,
+// so their cost depends only on the memory layout and not on the shape of
+// the tree the keys came from.
+template <typename T>
+class FrozenTree {
+public:
+    FrozenTree() : FrozenTree(std::vector<T>(), FrozenLayout::EYTZINGER) {}
+
+    // Takes the keys in strictly increasing order.
+    FrozenTree(const std::vector<T>& sorted, FrozenLayout layout) : layout_(layout), size_(sorted.size()) {
+        if (layout_ == FrozenLayout::EYTZINGER) {
+            buildEytzinger(sorted);
+        } else {
+            buildVeb(sorted);
+        }
+    }
+
+    bool search(const T& value) const {
+        return layout_ == FrozenLayout::EYTZINGER ? searchEytzinger(value) : searchVeb(value);
+    }
+
+    // The Eytzinger descent takes the same number of steps for every key, so
+    // a group of lookups runs in lockstep with no per-lane bookkeeping, each
+    // step prefetching ahead for all of them.
+    void searchBatch(std::span<const T> keys, std::span<bool> out) const {
+        if (layout_ != FrozenLayout::EYTZINGER) {
+            for (size_t i = 0; i < keys.size(); i++) {
+                out[i] = searchVeb(keys[i]);
+            }
+            return;
+        }
+
+        const T* data = keys_.data();
+        size_t n = keys_.size();
+        size_t positions[SEARCH_BATCH_LANES];
+        for (size_t base = 0; base < keys.size(); base += SEARCH_BATCH_LANES) {
+            size_t lanes = std::min(SEARCH_BATCH_LANES, keys.size() - base);
+            std::fill(positions, positions + lanes, 1);
+
+            for (size_t step = 1; step < n; step *= 2) {
+                for (size_t lane = 0; lane < lanes; lane++) {
+                    size_t k = positions[lane];
+                    if (k < n) {
+                        if constexpr (PREFETCH_STRIDE > 1) {
+                            __builtin_prefetch(data + k * PREFETCH_STRIDE);
+                        }
+                        positions[lane] = 2 * k + (data[k] < keys[base + lane]);
+                    }
+                }
+            }
+
+            for (size_t lane = 0; lane < lanes; lane++) {
+                size_t k = positions[lane] >> (std::countr_one(positions[lane]) + 1);
+                out[base + lane] = k != 0 && !(keys[base + lane] < data[k]);
+            }
+        }
+    }
+
+    FrozenLayout layout() const {
+        return layout_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t bytes() const {
+        return keys_.capacity() * sizeof(T);
+    }
+
+private:
+    // Descendants four levels down (for int keys) fill one cache line.
+    static constexpr size_t PREFETCH_STRIDE = std::bit_floor(std::max<size_t>(1, 64 / sizeof(T)));
+    static constexpr size_t MAX_HEIGHT = 64;
+
+    FrozenLayout layout_;
+    size_t size_;
+    std::vector<T, CacheLineAllocator<T>> keys_;
+
+    // vEB navigation tables, indexed by depth. A node at depth d is the root
+    // of a bottom subtree of the recursive split whose top subtree is rooted
+    // at depth veb_top_depth_[d] and holds veb_top_size_[d] keys; each bottom
+    // subtree holds veb_bottom_size_[d] keys.
+    size_t height_ = 0;
+    std::vector<size_t> veb_top_depth_;
+    std::vector<size_t> veb_top_size_;
+    std::vector<size_t> veb_bottom_size_;
+
+    // Position 0 is unused so that the children of k are 2k and 2k + 1.
+    void buildEytzinger(const std::vector<T>& sorted) {
+        keys_.resize(sorted.size() + 1);
+        size_t next = 0;
+        placeEytzinger(sorted, 1, next);
+    }
+
+    void placeEytzinger(const std::vector<T>& sorted, size_t k, size_t& next) {
+        if (k < keys_.size()) {
+            placeEytzinger(sorted, 2 * k, next);
+            keys_[k] = sorted[next++];
+            placeEytzinger(sorted, 2 * k + 1, next);
+        }
+    }
+
+    // Each step moves to the right child exactly when the key is smaller
+    // than value, so the path encodes the lower bound: after the loop the
+    // trailing ones of k are the final right turns, and stripping them and
+    // the left turn before them leaves the position of the first key not
+    // less than value.
+    bool searchEytzinger(const T& value) const {
+        const T* keys = keys_.data();
+        size_t n = keys_.size();
+        size_t k = 1;
+        while (k < n) {
+            if constexpr (PREFETCH_STRIDE > 1) {
+                __builtin_prefetch(keys + k * PREFETCH_STRIDE);
+            }
+            k = 2 * k + (keys[k] < value);
+        }
+        k >>= std::countr_one(k) + 1;
+        return k != 0 && !(value < keys[k]);
+    }
+
+    // The layout is defined over a complete tree, so the keys are padded to
+    // 2^height - 1 with copies of the largest one. Duplicates at the end do
+    // not change the result of a membership search.
+    void buildVeb(const std::vector<T>& sorted) {
+        while ((size_t(1) << height_) - 1 < sorted.size()) {
+            height_++;
+        }
+        veb_top_depth_.assign(std::max<size_t>(height_, 1), 0);
+        veb_top_size_.assign(std::max<size_t>(height_, 1), 0);
+        veb_bottom_size_.assign(std::max<size_t>(height_, 1), 0);
+        splitVeb(0, height_);
+
+        keys_.resize((size_t(1) << height_) - 1);
+        if (height_ > 0) {
+            size_t pos[MAX_HEIGHT];
+            size_t next = 0;
+            placeVeb(sorted, 1, 0, pos, next);
+        }
+    }
+
+    void splitVeb(size_t root_depth, size_t height) {
+        if (height <= 1) {
+            return;
+        }
+        size_t top = height / 2;
+        size_t bottom = height - top;
+        size_t depth = root_depth + top;
+        veb_top_depth_[depth] = root_depth;
+        veb_top_size_[depth] = (size_t(1) << top) - 1;
+        veb_bottom_size_[depth] = (size_t(1) << bottom) - 1;
+        splitVeb(root_depth, top);
+        splitVeb(depth, bottom);
+    }
+
+    // Position of the node with breadth-first index i at depth d, given the
+    // positions of its ancestors in pos. The low bits of i below the top
+    // subtree's root select which bottom subtree it roots.
+    size_t vebPosition(size_t i, size_t depth, const size_t* pos) const {
+        if (depth == 0) {
+            return 0;
+        }
+        size_t top_size = veb_top_size_[depth];
+        return pos[veb_top_depth_[depth]] + top_size + (i & top_size) * veb_bottom_size_[depth];
+    }
+
+    void placeVeb(const std::vector<T>& sorted, size_t i, size_t depth, size_t* pos, size_t& next) {
+        if (depth == height_) {
+            return;
+        }
+        pos[depth] = vebPosition(i, depth, pos);
+        placeVeb(sorted, 2 * i, depth + 1, pos, next);
+        keys_[pos[depth]] = sorted[std::min(next++, sorted.size() - 1)];
+        placeVeb(sorted, 2 * i + 1, depth + 1, pos, next);
+    }
+
+    // Same branchless descent as the Eytzinger search, with positions taken
+    // from the navigation tables. The next position depends on the key just
+    // read, so there is nothing useful to prefetch; the layout itself keeps
+    // consecutive levels close together.
+    bool searchVeb(const T& value) const {
+        size_t pos[MAX_HEIGHT];
+        size_t i = 1;
+        bool found = false;
+        for (size_t depth = 0; depth < height_; depth++) {
+            pos[depth] = vebPosition(i, depth, pos);
+            const T& key = keys_[pos[depth]];
+            found |= key == value;
+            i = 2 * i + (key < value);
+        }
+        return found;
+    }
+};
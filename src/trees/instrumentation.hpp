@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Instrumentation policies. Every tree takes one as its last template
+// parameter and reports these events to it:
+//   compare(n)   n key comparisons. A binary tree counts one per node on the
+//                path of a search, insert or remove; a B-tree node scan
+//                counts every key it looks at.
+//   rotate()     one single rotation, wherever it happens; a double
+//                rotation reports two.
+//   splayStep()  one zig, zig-zig or zig-zag step of a splay. A top-down
+//                splay reports one per node it links into the left or right
+//                tree, so its zig-zags count as two steps.
+//   rebuild(n)   a scapegoat or BB-alpha subtree of n nodes was rebuilt to
+//                restore balance. bulkLoad and combine rebuilds are not
+//                reported.
+// The comparisons of rank, select and range queries and of split, join and
+// the set operations are not counted.
+
+// The default. Its hooks are empty and it takes no space in the tree, so an
+// uninstrumented tree compiles to the same code as before.
+struct NoInstrumentation {
+    static constexpr bool ENABLED = false;
+
+    void compare(size_t = 1) {}
+    void rotate() {}
+    void splayStep() {}
+    void rebuild(size_t) {}
+};
+
+struct InstrumentationCounters {
+    uint64_t comparisons = 0;
+    uint64_t rotations = 0;
+    uint64_t splaySteps = 0;
+    uint64_t rebuilds = 0;
+    uint64_t rebuiltNodes = 0;
+    uint64_t largestRebuild = 0;
+};
+
+// Counts every event. Searches of the non-splaying trees run concurrently
+// under a shared lock in the server, so the counters are atomics, but they
+// are bumped with a relaxed load and store rather than a locked add: two
+// readers racing on a counter can lose an increment, and in exchange a
+// counted search costs about what an uncounted one does. Scalar searches
+// count the nodes they visit in a local and report once: a store per node
+// to a counter the compiler must keep in memory doubled the time of an AVL
+// search.
+class CountingInstrumentation {
+public:
+    static constexpr bool ENABLED = true;
+
+    CountingInstrumentation() = default;
+
+    // A copy, such as a tree snapshot, counts its own events from zero.
+    CountingInstrumentation(const CountingInstrumentation&) {}
+
+    void compare(size_t count = 1) {
+        add(comparisons_, count);
+    }
+
+    void rotate() {
+        add(rotations_, 1);
+    }
+
+    void splayStep() {
+        add(splaySteps_, 1);
+    }
+
+    void rebuild(size_t nodes) {
+        add(rebuilds_, 1);
+        add(rebuiltNodes_, nodes);
+        if (nodes > largestRebuild_.load(std::memory_order_relaxed)) {
+            largestRebuild_.store(nodes, std::memory_order_relaxed);
+        }
+    }
+
+    InstrumentationCounters counters() const {
+        InstrumentationCounters counters;
+        counters.comparisons = comparisons_.load(std::memory_order_relaxed);
+        counters.rotations = rotations_.load(std::memory_order_relaxed);
+        counters.splaySteps = splaySteps_.load(std::memory_order_relaxed);
+        counters.rebuilds = rebuilds_.load(std::memory_order_relaxed);
+        counters.rebuiltNodes = rebuiltNodes_.load(std::memory_order_relaxed);
+        counters.largestRebuild = largestRebuild_.load(std::memory_order_relaxed);
+        return counters;
+    }
+
+    void reset() {
+        for (std::atomic<uint64_t>* counter : {&comparisons_, &rotations_, &splaySteps_, &rebuilds_, &rebuiltNodes_, &largestRebuild_}) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    std::atomic<uint64_t> comparisons_{0};
+    std::atomic<uint64_t> rotations_{0};
+    std::atomic<uint64_t> splaySteps_{0};
+    std::atomic<uint64_t> rebuilds_{0};
+    std::atomic<uint64_t> rebuiltNodes_{0};
+    std::atomic<uint64_t> largestRebuild_{0};
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
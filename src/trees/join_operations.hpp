@@ -0,0 +1,136 @@
+#pragma once
+
+#include <utility>
+
+// Join-based ordered set algorithms, after Blelloch, Ferizovic and Sun, "Just
+// Join for Parallel Ordered Sets". A balancing scheme only has to say how to
+// join two trees around a middle node whose key lies between them; split and
+// the set operations are built once on top of that. Union, intersection and
+// difference of trees holding m <= n keys visit O(m log(n/m + 1)) nodes, so
+// merging a small tree into a large one is much cheaper than inserting its
+// keys one at a time.
+
+// A detached subtree together with the rank its tree joins by: the height
+// for AVL trees, the black height for red-black trees.
+template <typename Node>
+struct RankedTree {
+    Node* root = nullptr;
+    int rank = 0;
+};
+
+// Tree has to befriend this class and provide, for its own nodes:
+//   expose(t)        the ranked left and right subtrees of t's root
+//   join(l, mid, r)  a balanced tree of l, then mid, then r, in O(rank difference)
+//   destroyNode(node), destroyTree(node)
+// Every node handed to these functions ends up in the result or destroyed.
+// Parent links of the returned root are left for the caller to reset.
+template <typename Tree, typename Node>
+class JoinAlgorithms {
+public:
+    using Ranked = RankedTree<Node>;
+
+    // Splits t into the keys less than key and the keys greater than key.
+    // The node holding key, if any, is detached into found.
+    template <typename Key>
+    static std::pair<Ranked, Ranked> split(Tree& tree, Ranked t, const Key& key, Node*& found) {
+        if (t.root == nullptr) {
+            found = nullptr;
+            return {};
+        }
+
+        auto [left, right] = tree.expose(t);
+        if (key == t.root->key) {
+            found = t.root;
+            return {left, right};
+        }
+        if (key < t.root->key) {
+            auto [less, greater] = split(tree, left, key, found);
+            return {less, tree.join(greater, t.root, right)};
+        }
+        auto [less, greater] = split(tree, right, key, found);
+        return {tree.join(left, t.root, less), greater};
+    }
+
+    // Joins two trees with every key of l less than every key of r.
+    static Ranked join2(Tree& tree, Ranked l, Ranked r) {
+        if (l.root == nullptr) {
+            return r;
+        }
+        Node* last = nullptr;
+        Ranked rest = splitLast(tree, l, last);
+        return tree.join(rest, last, r);
+    }
+
+    static Ranked unite(Tree& tree, Ranked a, Ranked b) {
+        if (a.root == nullptr) {
+            return b;
+        }
+        if (b.root == nullptr) {
+            return a;
+        }
+
+        auto [a_left, a_right] = tree.expose(a);
+        Node* duplicate = nullptr;
+        auto [b_left, b_right] = split(tree, b, a.root->key, duplicate);
+        if (duplicate != nullptr) {
+            tree.destroyNode(duplicate);
+        }
+
+        Ranked left = unite(tree, a_left, b_left);
+        Ranked right = unite(tree, a_right, b_right);
+        return tree.join(left, a.root, right);
+    }
+
+    static Ranked intersect(Tree& tree, Ranked a, Ranked b) {
+        if (a.root == nullptr || b.root == nullptr) {
+            tree.destroyTree(a.root);
+            tree.destroyTree(b.root);
+            return {};
+        }
+
+        auto [a_left, a_right] = tree.expose(a);
+        Node* match = nullptr;
+        auto [b_left, b_right] = split(tree, b, a.root->key, match);
+
+        Ranked left = intersect(tree, a_left, b_left);
+        Ranked right = intersect(tree, a_right, b_right);
+        if (match != nullptr) {
+            tree.destroyNode(match);
+            return tree.join(left, a.root, right);
+        }
+        tree.destroyNode(a.root);
+        return join2(tree, left, right);
+    }
+
+    // The keys of a that are not in b.
+    static Ranked subtract(Tree& tree, Ranked a, Ranked b) {
+        if (a.root == nullptr || b.root == nullptr) {
+            tree.destroyTree(b.root);
+            return a;
+        }
+
+        auto [b_left, b_right] = tree.expose(b);
+        Node* match = nullptr;
+        auto [a_left, a_right] = split(tree, a, b.root->key, match);
+        if (match != nullptr) {
+            tree.destroyNode(match);
+        }
+        tree.destroyNode(b.root);
+
+        Ranked left = subtract(tree, a_left, b_left);
+        Ranked right = subtract(tree, a_right, b_right);
+        return join2(tree, left, right);
+    }
+
+private:
+    // Detaches the node with the largest key of a non-empty tree into last.
+    static Ranked splitLast(Tree& tree, Ranked t, Node*& last) {
+        auto [left, right] = tree.expose(t);
+        if (right.root == nullptr) {
+            last = t.root;
+            return left;
+        }
+        Ranked rest = splitLast(tree, right, last);
+        return tree.join(left, t.root, rest);
+    }
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+// Walks shared by every tree whose nodes carry a subtree `size` field. Each
+// one descends a single root-to-leaf path, so it costs O(height). The last
+// node visited is reported so self-adjusting trees can splay it.
+
+// Takes a node pointer or any link type that compares with nullptr.
+template <typename Link>
+size_t subtreeSize(const Link& node) {
+    return node == nullptr ? 0 : node->size;
+}
+
+// Nodes on the path a search for value walks, including the one holding it.
+template <typename Node, typename T>
+size_t searchPathLength(const Node* node, const T& value) {
+    size_t length = 0;
+    while (node != nullptr) {
+        length++;
+        if (value == node->key) {
+            break;
+        }
+        node = value < node->key ? node->left : node->right;
+    }
+    return length;
+}
+
+// Number of keys less than value, or not greater than value when inclusive.
+template <typename Node, typename T>
+size_t countBelow(Node* node, const T& value, bool inclusive, Node** last = nullptr) {
+    size_t count = 0;
+    while (node != nullptr) {
+        if (last != nullptr) {
+            *last = node;
+        }
+        if (node->key < value || (inclusive && !(value < node->key))) {
+            count += subtreeSize(node->left) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return count;
+}
+
+// The node holding the k-th smallest key, counting from zero.
+template <typename Node>
+Node* selectNode(Node* node, size_t k) {
+    if (k >= subtreeSize(node)) {
+        throw std::out_of_range("Rank " + std::to_string(k) + " is out of range");
+    }
+
+    while (true) {
+        size_t left_size = subtreeSize(node->left);
+        if (k < left_size) {
+            node = node->left;
+        } else if (k == left_size) {
+            return node;
+        } else {
+            k -= left_size + 1;
+            node = node->right;
+        }
+    }
+}
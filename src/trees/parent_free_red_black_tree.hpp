@@ -0,0 +1,439 @@
+#pragma once
+
+#include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "order_statistics.hpp"
+#include "tree_iterator.hpp"
+#include "batch_search.hpp"
+#include <array>
+#include <vector>
+
+// A red-black tree whose nodes hold only the key, two child links and the
+// size word with the colour in its top bit: 32 bytes for int keys against
+// RedBlackTree's 40, and 16 instead of 24 with compact storage. Inserts and
+// removes remember the path they walk down in a fixed array and fix the
+// colours up along it instead of following parent links. Without reference
+// counts it has no O(1) snapshots, and set operations go through the sorted
+// merge of the base class. Like RedBlackTree it keeps duplicate keys.
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class ParentFreeRedBlackTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
+public:
+    enum Color { RED, BLACK };
+
+    struct Node {
+        using Link = typename NodeStorage<Allocator>::template Link<Node>;
+        using Size = typename NodeStorage<Allocator>::Size;
+
+        T key;
+        Link left, right;
+        Size size : NodeStorage<Allocator>::SIZE_BITS - 1;
+        Color color : 1;
+
+        explicit Node(const T& key)
+            : key(key), left(nullptr), right(nullptr), size(1), color(RED) {}
+    };
+
+    ParentFreeRedBlackTree() : root_(nullptr) {}
+
+    ~ParentFreeRedBlackTree() {
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            alloc_.release();
+        } else {
+            destroyTree(root_);
+        }
+    }
+
+    bool search(const T& value) override {
+        return find(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
+        Node* current = root_;
+        size_t visited = 0;
+        while (current != nullptr) {
+            visited++;
+            if (value == current->key) {
+                this->instrumentation_.compare(visited);
+                return &current->key;
+            }
+            current = value < current->key ? current->left : current->right;
+        }
+        this->instrumentation_.compare(visited);
+        return nullptr;
+    }
+
+    bool assign(const T& value) override {
+        Node* node = root_;
+        while (node != nullptr) {
+            this->instrumentation_.compare();
+            if (value == node->key) {
+                node->key = value;
+                return true;
+            }
+            node = value < node->key ? node->left : node->right;
+        }
+        return false;
+    }
+
+    void searchBatch(std::span<const T> keys, std::span<bool> out) override {
+        interleavedSearch(static_cast<const Node*>(root_), keys, out, this->instrumentation_);
+    }
+
+    void insert(const T &value) override {
+        std::array<Node*, MAX_HEIGHT + 1> path;
+        size_t depth = 0;
+
+        Node* node = root_;
+        while (node != nullptr) {
+            this->instrumentation_.compare();
+            path[depth++] = node;
+            node->size++;
+            node = value < node->key ? node->left : node->right;
+        }
+
+        Node* z = createNode(value);
+        if (depth == 0) {
+            root_ = z;
+            z->color = BLACK;
+            return;
+        }
+        if (value < path[depth - 1]->key) {
+            path[depth - 1]->left = z;
+        } else {
+            path[depth - 1]->right = z;
+        }
+        insertFixup(z, path.data(), depth);
+    }
+
+    // A node with two children swaps its key with its successor's, so the
+    // node that leaves the tree always has at most one child.
+    void remove(const T &value) override {
+        std::array<Node*, MAX_HEIGHT + 1> path;
+        size_t depth = 0;
+
+        Node* z = root_;
+        while (z != nullptr && !(value == z->key)) {
+            this->instrumentation_.compare();
+            path[depth++] = z;
+            z = value < z->key ? z->left : z->right;
+        }
+
+        if (z == nullptr) return;
+        this->instrumentation_.compare();
+
+        if (z->left != nullptr && z->right != nullptr) {
+            path[depth++] = z;
+            Node* successor = z->right;
+            while (successor->left != nullptr) {
+                path[depth++] = successor;
+                successor = successor->left;
+            }
+            z->key = successor->key;
+            z = successor;
+        }
+        for (size_t i = 0; i < depth; i++) {
+            path[i]->size--;
+        }
+
+        Node* x = z->left != nullptr ? z->left : z->right;
+        replaceChild(path.data(), depth, z, x);
+        Color removed_color = z->color;
+        destroyNode(z);
+
+        if (removed_color == BLACK) {
+            deleteFixup(x, path.data(), depth);
+        }
+    }
+
+    size_t rank(const T& value) override {
+        return countBelow(root_, value, false);
+    }
+
+    T select(size_t k) override {
+        return selectNode(root_, k)->key;
+    }
+
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelow(root_, hi, true) - countBelow(root_, lo, false);
+    }
+
+    size_t size() const override {
+        return subtreeSize(root_);
+    }
+
+    size_t bytesAllocated() const override {
+        return size() * sizeof(Node);
+    }
+
+    size_t searchDepth(const T& value) const override {
+        return searchPathLength(static_cast<const Node*>(root_), value);
+    }
+
+    bool keepsDuplicates() const override {
+        return true;
+    }
+
+    using iterator = TreeIterator<Node>;
+    using const_iterator = TreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    const_iterator lower_bound(const T& value) const {
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) const {
+        return const_iterator::upperBound(root_, value);
+    }
+
+    Node* getRoot() const {
+        return root_;
+    }
+
+    static constexpr bool READS_MODIFY_TREE = false;
+
+    static std::string name() {
+        return "Parent-Free Red-Black Tree";
+    }
+
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
+        visitor.visit(*this);
+    }
+
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        std::vector<Node*> stack;
+        Node* current = root_;
+        while (current != nullptr || !stack.empty()) {
+            while (current != nullptr) {
+                stack.push_back(current);
+                current = current->left;
+            }
+            current = stack.back();
+            stack.pop_back();
+            out.push_back(current->key);
+            current = current->right;
+        }
+    }
+
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+
+        // Same colouring as RedBlackTree: only the last, possibly partial,
+        // level of the midpoint build is red.
+        size_t height = 0;
+        for (size_t n = values.size(); n > 0; n /= 2) {
+            height++;
+        }
+        root_ = buildBalanced(values, 0, values.size(), 0, height - 1);
+        if (root_ != nullptr) {
+            root_->color = BLACK;
+        }
+    }
+
+private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+    NodeAllocator alloc_;
+    Node* root_ = nullptr;
+
+    // A red-black tree of n nodes is at most 2 log2(n + 1) levels deep, and
+    // the size word bounds n. A delete fixup can push one extra node on the
+    // path, hence the + 1 on the arrays.
+    static constexpr size_t MAX_HEIGHT = 2 * NodeStorage<Allocator>::SIZE_BITS;
+
+    static bool isRed(const Node* node) {
+        return node != nullptr && node->color == RED;
+    }
+
+    // Points the link to old, a child of path[depth - 1] or the root when
+    // depth is 0, at replacement.
+    void replaceChild(Node** path, size_t depth, Node* old, Node* replacement) {
+        if (depth == 0) {
+            root_ = replacement;
+        } else if (path[depth - 1]->left == old) {
+            path[depth - 1]->left = replacement;
+        } else {
+            path[depth - 1]->right = replacement;
+        }
+    }
+
+    // Rotations return the new subtree root; the caller relinks it.
+    Node* rotateLeft(Node* node) {
+        this->instrumentation_.rotate();
+        Node* child = node->right;
+        node->right = child->left;
+        child->left = node;
+        child->size = node->size;
+        node->size = 1 + subtreeSize(node->left) + subtreeSize(node->right);
+        return child;
+    }
+
+    Node* rotateRight(Node* node) {
+        this->instrumentation_.rotate();
+        Node* child = node->left;
+        node->left = child->right;
+        child->right = node;
+        child->size = node->size;
+        node->size = 1 + subtreeSize(node->left) + subtreeSize(node->right);
+        return child;
+    }
+
+    // z is a red node whose parent is path[depth - 1]. Recolouring moves the
+    // violation two levels up the path; a rotation ends it.
+    void insertFixup(Node* z, Node** path, size_t depth) {
+        while (depth >= 2 && isRed(path[depth - 1])) {
+            Node* parent = path[depth - 1];
+            Node* grandparent = path[depth - 2];
+
+            if (parent == grandparent->left) {
+                Node* uncle = grandparent->right;
+                if (isRed(uncle)) {
+                    parent->color = BLACK;
+                    uncle->color = BLACK;
+                    grandparent->color = RED;
+                    z = grandparent;
+                    depth -= 2;
+                    continue;
+                }
+                if (z == parent->right) {
+                    parent = grandparent->left = rotateLeft(parent);
+                }
+                parent->color = BLACK;
+                grandparent->color = RED;
+                replaceChild(path, depth - 2, grandparent, rotateRight(grandparent));
+            } else {
+                Node* uncle = grandparent->left;
+                if (isRed(uncle)) {
+                    parent->color = BLACK;
+                    uncle->color = BLACK;
+                    grandparent->color = RED;
+                    z = grandparent;
+                    depth -= 2;
+                    continue;
+                }
+                if (z == parent->left) {
+                    parent = grandparent->right = rotateRight(parent);
+                }
+                parent->color = BLACK;
+                grandparent->color = RED;
+                replaceChild(path, depth - 2, grandparent, rotateLeft(grandparent));
+            }
+            break;
+        }
+
+        root_->color = BLACK;
+    }
+
+    // x, possibly null, is one black short and its parent is path[depth - 1].
+    // Its sibling is then never null. When the red-sibling rotation lowers
+    // the parent, the sibling is put on the path above it.
+    void deleteFixup(Node* x, Node** path, size_t depth) {
+        while (depth > 0 && !isRed(x)) {
+            Node* parent = path[depth - 1];
+
+            if (x == parent->left) {
+                Node* w = parent->right;
+                if (isRed(w)) {
+                    w->color = BLACK;
+                    parent->color = RED;
+                    replaceChild(path, depth - 1, parent, rotateLeft(parent));
+                    path[depth - 1] = w;
+                    path[depth++] = parent;
+                    w = parent->right;
+                }
+
+                if (!isRed(w->left) && !isRed(w->right)) {
+                    w->color = RED;
+                    x = parent;
+                    depth--;
+                    continue;
+                }
+                if (!isRed(w->right)) {
+                    w->left->color = BLACK;
+                    w->color = RED;
+                    w = parent->right = rotateRight(w);
+                }
+                w->color = parent->color;
+                parent->color = BLACK;
+                w->right->color = BLACK;
+                replaceChild(path, depth - 1, parent, rotateLeft(parent));
+            } else {
+                Node* w = parent->left;
+                if (isRed(w)) {
+                    w->color = BLACK;
+                    parent->color = RED;
+                    replaceChild(path, depth - 1, parent, rotateRight(parent));
+                    path[depth - 1] = w;
+                    path[depth++] = parent;
+                    w = parent->left;
+                }
+
+                if (!isRed(w->left) && !isRed(w->right)) {
+                    w->color = RED;
+                    x = parent;
+                    depth--;
+                    continue;
+                }
+                if (!isRed(w->left)) {
+                    w->right->color = BLACK;
+                    w->color = RED;
+                    w = parent->left = rotateLeft(w);
+                }
+                w->color = parent->color;
+                parent->color = BLACK;
+                w->left->color = BLACK;
+                replaceChild(path, depth - 1, parent, rotateRight(parent));
+            }
+            x = root_;
+            break;
+        }
+
+        if (x != nullptr) x->color = BLACK;
+    }
+
+    Node* buildBalanced(const std::vector<T>& values, size_t begin, size_t end, size_t depth, size_t red_depth) {
+        if (begin == end) {
+            return nullptr;
+        }
+
+        size_t mid = begin + (end - begin) / 2;
+        Node* node = createNode(values[mid]);
+        node->color = depth == red_depth ? RED : BLACK;
+        node->size = end - begin;
+
+        node->left = buildBalanced(values, begin, mid, depth + 1, red_depth);
+        node->right = buildBalanced(values, mid + 1, end, depth + 1, red_depth);
+        return node;
+    }
+
+    Node* createNode(const T& key) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, key);
+        return node;
+    }
+
+    void destroyNode(Node* node) {
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
+    void destroyTree(Node* node) {
+        if (node) {
+            destroyTree(node->left);
+            destroyTree(node->right);
+            destroyNode(node);
+        }
+    }
+};
@@ -1,54 +1,116 @@
 #pragma once
 
 #include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "order_statistics.hpp"
+#include "tree_iterator.hpp"
+#include "batch_search.hpp"
+#include "join_operations.hpp"
+#include "shared_nodes.hpp"
 #include <algorithm>
+#include <stdexcept>
+#include <vector>
 
-template <typename T>
-class RedBlackTree final : public BinarySearchTree<T> {
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class RedBlackTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
 public:
     enum Color { RED, BLACK };
     
+    // The colour takes the top bit of the size word. Nodes can be shared with
+    // snapshots (see shared_nodes.hpp), and then parent may point into either
+    // tree: it is only trusted on nodes a write has taken ownership of, which
+    // resets it, and readers never follow it.
     struct Node {
+        using Link = typename NodeStorage<Allocator>::template Link<Node>;
+        using Size = typename NodeStorage<Allocator>::Size;
+
         T key;
-        Node *left, *right, *parent;
-        Color color;
+        RefCount refs;
+        Link left, right, parent;
+        Size size : NodeStorage<Allocator>::SIZE_BITS - 1;
+        Color color : 1;
 
         explicit Node(const T& key) 
-            : key(key), left(nullptr), right(nullptr), parent(nullptr), color(RED) {}
+            : key(key), refs(1), left(nullptr), right(nullptr), parent(nullptr), size(1), color(RED) {}
     };
 
     RedBlackTree() : root_(nullptr) {}
-    
+
+    // O(1): the copy shares every node with other, and whichever of the two
+    // is written afterwards copies the nodes it changes. Writes also reset
+    // parent links of shared nodes, so the two must not be written at the
+    // same time.
+    RedBlackTree(const RedBlackTree& other) : alloc_(other.alloc_), root_(other.root_) {
+        retain(root_);
+    }
+
+    RedBlackTree& operator=(const RedBlackTree&) = delete;
+
     ~RedBlackTree() {
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            if (!alloc_.shared()) {
+                alloc_.release();
+                return;
+            }
+        }
         destroyTree(root_);
     }
 
+    // An immutable view of the current keys in O(1). It can be read, and
+    // destroyed, on another thread while this tree keeps changing.
+    RedBlackTree snapshot() const {
+        return RedBlackTree(*this);
+    }
+
     bool search(const T& value) override {
+        return find(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
         Node* current = root_;
+        size_t visited = 0;
         while (current != nullptr) {
+            visited++;
             if (value == current->key) {
+                this->instrumentation_.compare(visited);
+                return &current->key;
+            }
+            current = value < current->key ? current->left : current->right;
+        }
+        this->instrumentation_.compare(visited);
+        return nullptr;
+    }
+
+    // Takes ownership of the path down to the key, since the key changes in
+    // place. When it is missing, the path is the one an insert takes next.
+    bool assign(const T& value) override {
+        Node* node = own(root_, nullptr);
+        while (node != nullptr) {
+            this->instrumentation_.compare();
+            if (value == node->key) {
+                node->key = value;
                 return true;
-            } else if (value < current->key) {
-                current = current->left;
-            } else {
-                current = current->right;
             }
+            node = own(value < node->key ? node->left : node->right, node);
         }
         return false;
     }
 
+    void searchBatch(std::span<const T> keys, std::span<bool> out) override {
+        interleavedSearch(static_cast<const Node*>(root_), keys, out, this->instrumentation_);
+    }
+
     void insert(const T &value) override {
-        Node* z = new Node(value);
+        Node* z = createNode(value);
         Node* y = nullptr;
-        Node* x = root_;
+        Node* x = own(root_, nullptr);
 
         while (x != nullptr) {
+            this->instrumentation_.compare();
             y = x;
-            if (z->key < x->key) {
-                x = x->left;
-            } else {
-                x = x->right;
-            }
+            x->size++;
+            x = own(z->key < x->key ? x->left : x->right, x);
         }
 
         z->parent = y;
@@ -63,19 +125,36 @@ public:
         insertFixup(z);
     }
     
+    // The key is found before any node is taken over, so removing a missing
+    // key copies nothing that a snapshot shares. The second descent takes
+    // the path over and ends at the same node.
     void remove(const T &value) override {
-        Node* z = root_;
-        while (z != nullptr) {
-            if (value == z->key) {
-                break;
-            } else if (value < z->key) {
-                z = z->left;
-            } else {
-                z = z->right;
-            }
+        const Node* found = root_;
+        while (found != nullptr && !(value == found->key)) {
+            this->instrumentation_.compare();
+            found = value < found->key ? found->left : found->right;
+        }
+
+        if (found == nullptr) return;
+        this->instrumentation_.compare();
+
+        Node* z = own(root_, nullptr);
+        while (!(value == z->key)) {
+            z = own(value < z->key ? z->left : z->right, z);
         }
 
-        if (z == nullptr) return;
+        // The path down to the successor is taken over as well: its sizes
+        // change and the fixup walks back up it.
+        Node* unlinked = z;
+        if (z->left != nullptr && z->right != nullptr) {
+            unlinked = own(z->right, z);
+            while (unlinked->left != nullptr) {
+                unlinked = own(unlinked->left, unlinked);
+            }
+        }
+        for (Node* node = unlinked->parent; node != nullptr; node = node->parent) {
+            node->size--;
+        }
 
         Node* y = z;
         Node* x = nullptr;
@@ -83,17 +162,17 @@ public:
         Color y_original_color = y->color;
 
         if (z->left == nullptr) {
-            x = z->right;
+            x = own(z->right, z);
             x_parent = z->parent;
             transplant(z, z->right);
         } else if (z->right == nullptr) {
-            x = z->left;
+            x = own(z->left, z);
             x_parent = z->parent;
             transplant(z, z->left);
         } else {
-            y = minimum(z->right);
+            y = unlinked;
             y_original_color = y->color;
-            x = y->right;
+            x = own(y->right, y);
             
             if (y->parent == z) {
                 if (x != nullptr) {
@@ -113,34 +192,183 @@ public:
             y->left = z->left;
             y->left->parent = y;
             y->color = z->color;
+            y->size = z->size;
         }
 
-        delete z;
+        destroyNode(z);
         
         if (y_original_color == BLACK) {
             deleteFixup(x, x_parent);
         }
     }
 
+    size_t rank(const T& value) override {
+        return countBelow(root_, value, false);
+    }
+
+    T select(size_t k) override {
+        return selectNode(root_, k)->key;
+    }
+
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelow(root_, hi, true) - countBelow(root_, lo, false);
+    }
+
+    size_t size() const override {
+        return subtreeSize(root_);
+    }
+
+    size_t bytesAllocated() const override {
+        return size() * sizeof(Node);
+    }
+
+    size_t searchDepth(const T& value) const override {
+        return searchPathLength(static_cast<const Node*>(root_), value);
+    }
+
+    bool keepsDuplicates() const override {
+        return true;
+    }
+
+    // Moves every key not less than key into right, replacing its contents,
+    // in O(log n). This tree keeps the smaller keys. Nodes move without
+    // copying unless the two trees' allocators differ.
+    void split(const T& key, RedBlackTree& right) {
+        right.destroyTree(right.root_);
+        right.root_ = nullptr;
+
+        Node* found = nullptr;
+        auto [less, greater] = Join::split(*this, ranked(), key, found);
+        if (found != nullptr) {
+            greater = join(Ranked{}, found, greater);
+        }
+        setRoot(less.root);
+        right.setRoot(right.adopt(*this, greater.root));
+    }
+
+    // Appends key and then every key of right, leaving right empty, in
+    // O(log n). Every key here must be less than key and every key of right
+    // greater than it.
+    void join(const T& key, RedBlackTree& right) {
+        if ((root_ != nullptr && !(maximum(root_)->key < key)) ||
+            (right.root_ != nullptr && !(key < minimum(right.root_)->key))) {
+            throw std::invalid_argument("join needs every key of this tree below key and every key of right above it");
+        }
+
+        Node* other = adopt(right, right.root_);
+        right.root_ = nullptr;
+        setRoot(join(ranked(), createNode(key), Ranked{other, blackHeight(other)}).root);
+    }
+
+    // Against another red-black tree this splits and joins a copy of its
+    // nodes, which touches O(m log(n/m + 1)) nodes plus the m copies and
+    // the nodes it drops.
+    void combine(SetOperation op, const BinarySearchTree<T, Allocator, Instrumentation>& other) override {
+        const RedBlackTree* same = dynamic_cast<const RedBlackTree*>(&other);
+        if (same == nullptr) {
+            BinarySearchTree<T, Allocator, Instrumentation>::combine(op, other);
+            return;
+        }
+
+        Node* copy = cloneTree(same->root_);
+        Ranked operand{copy, blackHeight(copy)};
+        switch (op) {
+            case SetOperation::UNION:
+                setRoot(Join::unite(*this, ranked(), operand).root);
+                break;
+            case SetOperation::INTERSECTION:
+                setRoot(Join::intersect(*this, ranked(), operand).root);
+                break;
+            case SetOperation::DIFFERENCE:
+                setRoot(Join::subtract(*this, ranked(), operand).root);
+                break;
+        }
+    }
+
+    using iterator = TreeIterator<Node>;
+    using const_iterator = TreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    const_iterator lower_bound(const T& value) const {
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) const {
+        return const_iterator::upperBound(root_, value);
+    }
+
     Node* getRoot() const {
         return root_;
     }
 
+    static constexpr bool READS_MODIFY_TREE = false;
+
     static std::string name() {
         return "Red-Black Tree";
     }
 
-    void accept(TreeVisitor<T>& visitor) const override {
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
         visitor.visit(*this);
     }
 
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        std::vector<Node*> stack;
+        Node* current = root_;
+        while (current != nullptr || !stack.empty()) {
+            while (current != nullptr) {
+                stack.push_back(current);
+                current = current->left;
+            }
+            current = stack.back();
+            stack.pop_back();
+            out.push_back(current->key);
+            current = current->right;
+        }
+    }
+
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+
+        // A midpoint build has every level full except possibly the last, so
+        // colouring exactly that level red gives every path the same number
+        // of black nodes.
+        size_t height = 0;
+        for (size_t n = values.size(); n > 0; n /= 2) {
+            height++;
+        }
+        root_ = buildBalanced(values, 0, values.size(), 0, height - 1, nullptr);
+        if (root_ != nullptr) {
+            root_->color = BLACK;
+        }
+    }
+
 private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+    using Ranked = RankedTree<Node>;
+    using Join = JoinAlgorithms<RedBlackTree, Node>;
+    friend Join;
+
+    NodeAllocator alloc_;
     Node* root_ = nullptr;
     
     void leftRotate(Node* x) {
         if (x == nullptr || x->right == nullptr) return;
+        this->instrumentation_.rotate();
         
-        Node* y = x->right;
+        Node* y = own(x->right, x);
         x->right = y->left;
         
         if (y->left != nullptr) {
@@ -159,12 +387,16 @@ private:
         
         y->left = x;
         x->parent = y;
+
+        y->size = x->size;
+        x->size = 1 + subtreeSize(x->left) + subtreeSize(x->right);
     }
     
     void rightRotate(Node* y) {
         if (y == nullptr || y->left == nullptr) return;
+        this->instrumentation_.rotate();
         
-        Node* x = y->left;
+        Node* x = own(y->left, y);
         y->left = x->right;
         
         if (x->right != nullptr) {
@@ -183,6 +415,9 @@ private:
         
         x->right = y;
         y->parent = x;
+
+        x->size = y->size;
+        y->size = 1 + subtreeSize(y->left) + subtreeSize(y->right);
     }
     
     void insertFixup(Node* z) {
@@ -191,6 +426,7 @@ private:
                 Node* y = z->parent->parent->right;
                 
                 if (y != nullptr && y->color == RED) {
+                    y = own(z->parent->parent->right, z->parent->parent);
                     z->parent->color = BLACK;
                     y->color = BLACK;
                     z->parent->parent->color = RED;
@@ -209,6 +445,7 @@ private:
                 Node* y = z->parent->parent->left;
                 
                 if (y != nullptr && y->color == RED) {
+                    y = own(z->parent->parent->left, z->parent->parent);
                     z->parent->color = BLACK;
                     y->color = BLACK;
                     z->parent->parent->color = RED;
@@ -234,13 +471,13 @@ private:
             if (x_parent == nullptr) break;
             
             if (x == x_parent->left) {
-                Node* w = x_parent->right;
+                Node* w = own(x_parent->right, x_parent);
                 
                 if (w != nullptr && w->color == RED) {
                     w->color = BLACK;
                     x_parent->color = RED;
                     leftRotate(x_parent);
-                    w = x_parent->right;
+                    w = own(x_parent->right, x_parent);
                 }
                 
                 if (w == nullptr || 
@@ -251,28 +488,28 @@ private:
                     x_parent = x->parent;
                 } else {
                     if (w->right == nullptr || w->right->color == BLACK) {
-                        if (w->left != nullptr) w->left->color = BLACK;
+                        if (w->left != nullptr) own(w->left, w)->color = BLACK;
                         w->color = RED;
                         rightRotate(w);
-                        w = x_parent->right;
+                        w = own(x_parent->right, x_parent);
                     }
                     
                     if (w != nullptr) {
                         w->color = x_parent->color;
-                        if (w->right != nullptr) w->right->color = BLACK;
+                        if (w->right != nullptr) own(w->right, w)->color = BLACK;
                     }
                     x_parent->color = BLACK;
                     leftRotate(x_parent);
                     x = root_;
                 }
             } else {
-                Node* w = x_parent->left;
+                Node* w = own(x_parent->left, x_parent);
                 
                 if (w != nullptr && w->color == RED) {
                     w->color = BLACK;
                     x_parent->color = RED;
                     rightRotate(x_parent);
-                    w = x_parent->left;
+                    w = own(x_parent->left, x_parent);
                 }
                 
                 if (w == nullptr || 
@@ -283,15 +520,15 @@ private:
                     x_parent = x->parent;
                 } else {
                     if (w->left == nullptr || w->left->color == BLACK) {
-                        if (w->right != nullptr) w->right->color = BLACK;
+                        if (w->right != nullptr) own(w->right, w)->color = BLACK;
                         w->color = RED;
                         leftRotate(w);
-                        w = x_parent->left;
+                        w = own(x_parent->left, x_parent);
                     }
                     
                     if (w != nullptr) {
                         w->color = x_parent->color;
-                        if (w->left != nullptr) w->left->color = BLACK;
+                        if (w->left != nullptr) own(w->left, w)->color = BLACK;
                     }
                     x_parent->color = BLACK;
                     rightRotate(x_parent);
@@ -324,11 +561,251 @@ private:
         return node;
     }
     
+    static bool isRed(Node* node) {
+        return node != nullptr && node->color == RED;
+    }
+
+    // Black nodes on any path down from node, counting node itself.
+    static int blackHeight(Node* node) {
+        int height = 0;
+        for (; node != nullptr; node = node->left) {
+            height += node->color == BLACK;
+        }
+        return height;
+    }
+
+    Ranked ranked() const {
+        return {root_, blackHeight(root_)};
+    }
+
+    // Subtrees passed between the join helpers may have a red root and a
+    // stale parent link; the final root is fixed up here.
+    void setRoot(Node* node) {
+        root_ = unshare(node);
+        if (root_ != nullptr) {
+            root_->parent = nullptr;
+            root_->color = BLACK;
+        }
+    }
+
+    // Takes ownership of the root, since the join algorithms go on to relink it.
+    std::pair<Ranked, Ranked> expose(Ranked& tree) {
+        Node* node = tree.root = unshare(tree.root);
+        int child_rank = tree.rank - (node->color == BLACK);
+        return {{node->left, child_rank}, {node->right, child_rank}};
+    }
+
+    // Both inputs get a black root first, so the only red-red violation the
+    // descent can create is at mid and it is resolved on the way back up.
+    Ranked join(Ranked left, Node* mid, Ranked right) {
+        left = blacken(left);
+        right = blacken(right);
+
+        if (left.rank > right.rank) {
+            Node* node = joinRight(left, mid, right);
+            if (node->color == RED && isRed(node->right)) {
+                node->color = BLACK;
+                return {node, left.rank + 1};
+            }
+            return {node, left.rank};
+        }
+        if (right.rank > left.rank) {
+            Node* node = joinLeft(left, mid, right);
+            if (node->color == RED && isRed(node->left)) {
+                node->color = BLACK;
+                return {node, right.rank + 1};
+            }
+            return {node, right.rank};
+        }
+        return {link(left.root, mid, right.root, RED), left.rank};
+    }
+
+    Ranked blacken(Ranked tree) {
+        if (isRed(tree.root)) {
+            tree.root = unshare(tree.root);
+            tree.root->color = BLACK;
+            tree.rank++;
+        }
+        return tree;
+    }
+
+    Node* link(Node* left, Node* mid, Node* right, Color color) {
+        mid->color = color;
+        mid->left = nullptr;
+        mid->right = nullptr;
+        attachLeft(mid, left);
+        attachRight(mid, right);
+        return mid;
+    }
+
+    void attachLeft(Node* node, Node* child) {
+        node->left = child;
+        if (child != nullptr) {
+            child->parent = node;
+        }
+        node->size = 1 + subtreeSize(child) + subtreeSize(node->right);
+    }
+
+    void attachRight(Node* node, Node* child) {
+        node->right = child;
+        if (child != nullptr) {
+            child->parent = node;
+        }
+        node->size = 1 + subtreeSize(node->left) + subtreeSize(child);
+    }
+
+    // Walks down the right spine of the left tree to the first black node of
+    // the right tree's black height and hangs mid there as a red node. A red
+    // mid under a red parent is fixed by one rotation at the black node
+    // above them, which pushes the red node up a level.
+    Node* joinRight(Ranked left, Node* mid, Ranked right) {
+        if (!isRed(left.root) && left.rank == right.rank) {
+            return link(left.root, mid, right.root, RED);
+        }
+
+        Ranked outer = expose(left).second;
+        Node* node = left.root;
+        attachRight(node, joinRight(outer, mid, right));
+        if (node->color == BLACK && isRed(node->right) && isRed(node->right->right)) {
+            node->right->right->color = BLACK;
+            return detachedRotateLeft(node);
+        }
+        return node;
+    }
+
+    Node* joinLeft(Ranked left, Node* mid, Ranked right) {
+        if (!isRed(right.root) && right.rank == left.rank) {
+            return link(left.root, mid, right.root, RED);
+        }
+
+        Ranked outer = expose(right).first;
+        Node* node = right.root;
+        attachLeft(node, joinLeft(left, mid, outer));
+        if (node->color == BLACK && isRed(node->left) && isRed(node->left->left)) {
+            node->left->left->color = BLACK;
+            return detachedRotateRight(node);
+        }
+        return node;
+    }
+
+    // Rotations of a subtree outside the tree; the caller links the new
+    // subtree root to its parent.
+    Node* detachedRotateLeft(Node* node) {
+        this->instrumentation_.rotate();
+        Node* child = node->right;
+        attachRight(node, child->left);
+        attachLeft(child, node);
+        return child;
+    }
+
+    Node* detachedRotateRight(Node* node) {
+        this->instrumentation_.rotate();
+        Node* child = node->left;
+        attachLeft(node, child->right);
+        attachRight(child, node);
+        return child;
+    }
+
+    // Takes ownership of a subtree built by from. Nodes can only move between
+    // trees whose allocators can free each other's nodes; otherwise they are
+    // copied and from frees the originals.
+    Node* adopt(RedBlackTree& from, Node* node) {
+        if (alloc_ == from.alloc_) {
+            return node;
+        }
+        Node* copy = cloneTree(node);
+        from.destroyTree(node);
+        return copy;
+    }
+
+    Node* cloneTree(const Node* node, Node* parent = nullptr) {
+        if (node == nullptr) {
+            return nullptr;
+        }
+        Node* copy = createNode(node->key);
+        copy->parent = parent;
+        copy->color = node->color;
+        copy->size = node->size;
+        copy->left = cloneTree(node->left, copy);
+        copy->right = cloneTree(node->right, copy);
+        return copy;
+    }
+
+    Node* maximum(Node* node) const {
+        while (node->right != nullptr) {
+            node = node->right;
+        }
+        return node;
+    }
+
+    Node* buildBalanced(const std::vector<T>& values, size_t begin, size_t end, size_t depth, size_t red_depth, Node* parent) {
+        if (begin == end) {
+            return nullptr;
+        }
+
+        size_t mid = begin + (end - begin) / 2;
+        Node* node = createNode(values[mid]);
+        node->parent = parent;
+        node->color = depth == red_depth ? RED : BLACK;
+        node->size = end - begin;
+
+        node->left = buildBalanced(values, begin, mid, depth + 1, red_depth, node);
+        node->right = buildBalanced(values, mid + 1, end, depth + 1, red_depth, node);
+        return node;
+    }
+
+    Node* createNode(const T& key) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, key);
+        return node;
+    }
+
+    void destroyNode(Node* node) {
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
+    // Returns node itself if this tree is its only owner, or else a private
+    // copy that shares the children, dropping this tree's reference to node.
+    // The caller relinks the copy in node's place.
+    Node* unshare(Node* node) {
+        if (node == nullptr || !isShared(node)) {
+            return node;
+        }
+        Node* copy = createNode(node->key);
+        copy->color = node->color;
+        copy->size = node->size;
+        copy->left = nullptr;
+        copy->right = nullptr;
+        retain(static_cast<Node*>(node->left));
+        retain(static_cast<Node*>(node->right));
+        attachLeft(copy, node->left);
+        attachRight(copy, node->right);
+        destroyTree(node);
+        return copy;
+    }
+
+    // Takes ownership of the node behind link, a child link of parent or the
+    // root, and points its parent link back at parent.
+    template <typename NodeLink>
+    Node* own(NodeLink& link, Node* parent) {
+        Node* node = link;
+        Node* owned = unshare(node);
+        if (owned != node) {
+            link = owned;
+        }
+        if (owned != nullptr && owned->parent != parent) {
+            owned->parent = parent;
+        }
+        return owned;
+    }
+
+    // Drops a reference to the subtree and frees whatever no other tree shares.
     void destroyTree(Node* node) {
-        if (node) {
+        if (node && dropRef(node)) {
             destroyTree(node->left);
             destroyTree(node->right);
-            delete node;
+            destroyNode(node);
         }
     }
 };
@@ -1,42 +1,63 @@
 #pragma once
 
 #include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "order_statistics.hpp"
+#include "tree_iterator.hpp"
+#include "batch_search.hpp"
 #include <algorithm>
 #include <cmath>
+#include <vector>
 
-template <typename T>
-class ScapegoatTree final : public BinarySearchTree<T> {
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class ScapegoatTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
 public:
     struct Node {
+        using Link = typename NodeStorage<Allocator>::template Link<Node>;
+
         T key;
-        Node *left, *right;
+        Link left, right;
+        typename NodeStorage<Allocator>::Size size;
 
-        explicit Node(const T& key) : key(key), left(nullptr), right(nullptr) {}
+        explicit Node(const T& key) : key(key), left(nullptr), right(nullptr), size(1) {}
     };
 
     ScapegoatTree(double alpha = 0.6) : root_(nullptr), size_(0), max_size_(0), alpha_(alpha) {}
     
     ~ScapegoatTree() {
-        destroyTree(root_);
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            alloc_.release();
+        } else {
+            destroyTree(root_);
+        }
     }
 
     bool search(const T& value) override {
-        Node* current = root_;
-        while (current != nullptr) {
-            if (value == current->key) {
-                return true;
-            } else if (value < current->key) {
-                current = current->left;
-            } else {
-                current = current->right;
-            }
+        return findNode(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
+        Node* node = findNode(value);
+        return node != nullptr ? &node->key : nullptr;
+    }
+
+    bool assign(const T& value) override {
+        Node* node = findNode(value);
+        if (node == nullptr) {
+            return false;
         }
-        return false;
+        node->key = value;
+        return true;
+    }
+
+    void searchBatch(std::span<const T> keys, std::span<bool> out) override {
+        interleavedSearch(static_cast<const Node*>(root_), keys, out, this->instrumentation_);
     }
 
     void insert(const T &value) override {
         if (root_ == nullptr) {
-            root_ = new Node(value);
+            root_ = createNode(value);
             size_ = 1;
             max_size_ = 1;
             return;
@@ -47,7 +68,9 @@ public:
         std::vector<Node*> path;
         
         while (current != nullptr) {
+            this->instrumentation_.compare();
             path.push_back(current);
+            current->size++;
             parent = current;
             if (value < current->key) {
                 current = current->left;
@@ -56,7 +79,7 @@ public:
             }
         }
         
-        Node* new_node = new Node(value);
+        Node* new_node = createNode(value);
         if (value < parent->key) {
             parent->left = new_node;
         } else {
@@ -67,10 +90,9 @@ public:
         max_size_ = std::max(max_size_, size_);
         
         if (height(path.size()) > log_alpha(size_)) {
-            Node* scapegoat = findScapegoat(path);
-            if (scapegoat != nullptr) {
-                rebuildSubtree(scapegoat, path);
-            }
+            size_t scapegoat_size = 0;
+            size_t scapegoat_index = findScapegoat(path, scapegoat_size);
+            rebuildSubtree(path, scapegoat_index, scapegoat_size);
         }
     }
     
@@ -85,27 +107,124 @@ public:
         }
     }
 
+    size_t rank(const T& value) override {
+        return countBelow(root_, value, false);
+    }
+
+    T select(size_t k) override {
+        return selectNode(root_, k)->key;
+    }
+
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelow(root_, hi, true) - countBelow(root_, lo, false);
+    }
+
+    size_t size() const override {
+        return size_;
+    }
+
+    size_t bytesAllocated() const override {
+        return size_ * sizeof(Node);
+    }
+
+    size_t searchDepth(const T& value) const override {
+        return searchPathLength(static_cast<const Node*>(root_), value);
+    }
+
+    bool keepsDuplicates() const override {
+        return true;
+    }
+
+    using iterator = TreeIterator<Node>;
+    using const_iterator = TreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    const_iterator lower_bound(const T& value) const {
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) const {
+        return const_iterator::upperBound(root_, value);
+    }
+
     Node* getRoot() const {
         return root_;
     }
 
+    static constexpr bool READS_MODIFY_TREE = false;
+
     static std::string name() {
         return "Scapegoat Tree";
     }
 
-    void accept(TreeVisitor<T>& visitor) const override {
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
         visitor.visit(*this);
     }
 
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        std::vector<Node*> stack;
+        Node* current = root_;
+        while (current != nullptr || !stack.empty()) {
+            while (current != nullptr) {
+                stack.push_back(current);
+                current = current->left;
+            }
+            current = stack.back();
+            stack.pop_back();
+            out.push_back(current->key);
+            current = current->right;
+        }
+    }
+
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+
+        Node* list_head = nullptr;
+        for (size_t i = values.size(); i > 0; i--) {
+            Node* node = createNode(values[i - 1]);
+            node->right = list_head;
+            list_head = node;
+        }
+        root_ = buildBalancedFromLinkedList(list_head, values.size());
+
+        size_ = values.size();
+        max_size_ = size_;
+    }
+
 private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+    using Link = typename Node::Link;
+
+    NodeAllocator alloc_;
     Node* root_;
     size_t size_;
     size_t max_size_;
     double alpha_;
 
-    size_t subtreeSize(Node* node) const {
-        if (node == nullptr) return 0;
-        return 1 + subtreeSize(node->left) + subtreeSize(node->right);
+    Node* findNode(const T& value) {
+        Node* current = root_;
+        size_t visited = 0;
+        while (current != nullptr) {
+            visited++;
+            if (value == current->key) {
+                break;
+            }
+            current = value < current->key ? current->left : current->right;
+        }
+        this->instrumentation_.compare(visited);
+        return current;
     }
 
     double log_alpha(double n) const {
@@ -116,80 +235,118 @@ private:
         return path_length;
     }
 
-    Node* findScapegoat(const std::vector<Node*>& path) {
-        size_t depth = path.size() - 1;
-        for (int i = depth - 1; i >= 0; i--) {
-            Node* current = path[i];
-            size_t size = subtreeSize(current);
-            size_t child_size = subtreeSize(path[i+1]);
-            
+    // Walks from the new leaf towards the root using the stored subtree
+    // sizes, so the search costs O(depth). Returns the index of the scapegoat
+    // in path and its subtree size, falling back to the root.
+    size_t findScapegoat(const std::vector<Node*>& path, size_t& scapegoat_size) const {
+        size_t child_size = 1;
+
+        for (size_t i = path.size(); i-- > 0;) {
+            size_t size = path[i]->size;
             if (child_size > alpha_ * size) {
-                return current;
+                scapegoat_size = size;
+                return i;
             }
+            child_size = size;
         }
-        return root_;
+
+        scapegoat_size = child_size;
+        return 0;
     }
 
-    Node* flattenTree(Node* root, Node* tail) {
-        if (root == nullptr) {
-            return tail;
+    // Turns a subtree into a sorted list linked through right pointers by
+    // rotating left children up (the first half of Day-Stout-Warren). Uses
+    // constant extra space regardless of how deep the subtree is.
+    Node* flattenTree(Node* root) {
+        Link head = nullptr;
+        Link* tail = &head;
+        Node* rest = root;
+
+        while (rest != nullptr) {
+            if (rest->left == nullptr) {
+                *tail = rest;
+                tail = &rest->right;
+                rest = rest->right;
+            } else {
+                Node* left_child = rest->left;
+                rest->left = left_child->right;
+                left_child->right = rest;
+                rest = left_child;
+            }
         }
-        root->right = flattenTree(root->right, tail);
-        return flattenTree(root->left, root);
+
+        return head;
     }
 
-    Node* buildBalancedFromLinkedList(Node*& head, size_t size) {
-        if (size == 0) return nullptr;
-        
-        size_t leftSize = size / 2;
-        Node* leftSubtree = buildBalancedFromLinkedList(head, leftSize);
-        
-        Node* root = head;
-        head = head->right;
-        
-        root->left = leftSubtree;
-        
-        root->right = buildBalancedFromLinkedList(head, size - leftSize - 1);
-        
-        return root;
+    // Left-rotates every other node of the first count nodes along the vine,
+    // carrying subtree sizes through each rotation.
+    void compressVine(Link& head, size_t count) {
+        Link* link = &head;
+        for (size_t i = 0; i < count; i++) {
+            Node* child = *link;
+            Node* next = child->right;
+            *link = next;
+            child->right = next->left;
+            next->left = child;
+            link = &next->right;
+
+            next->size = child->size;
+            child->size = 1 + subtreeSize(child->left) + subtreeSize(child->right);
+        }
     }
 
-    void rebuildSubtree(Node* scapegoat, const std::vector<Node*>& path) {
-        Node* parent = nullptr;
-        bool is_left_child = false;
-        
-        for (size_t i = 0; i < path.size(); i++) {
-            if (path[i] == scapegoat && i > 0) {
-                parent = path[i-1];
-                is_left_child = (parent->left == scapegoat);
-                break;
-            }
+    // Folds a right-linked sorted list of size nodes into a complete binary
+    // tree with repeated compression passes, without recursion.
+    Node* buildBalancedFromLinkedList(Link head, size_t size) {
+        size_t suffix = size;
+        for (Node* node = head; node != nullptr; node = node->right) {
+            node->size = suffix--;
         }
-        
-        size_t subtree_size = subtreeSize(scapegoat);
-        
-        Node* list_head = flattenTree(scapegoat, nullptr);
-        
+
+        size_t full = 1;
+        while (full * 2 <= size + 1) {
+            full *= 2;
+        }
+
+        size_t leaves = size + 1 - full;
+        compressVine(head, leaves);
+
+        size_t remaining = size - leaves;
+        while (remaining > 1) {
+            remaining /= 2;
+            compressVine(head, remaining);
+        }
+
+        return head;
+    }
+
+    void rebuildSubtree(const std::vector<Node*>& path, size_t scapegoat_index, size_t subtree_size) {
+        this->rebuilds_++;
+        this->instrumentation_.rebuild(subtree_size);
+        Node* scapegoat = path[scapegoat_index];
+        Node* list_head = flattenTree(scapegoat);
         Node* new_subtree_root = buildBalancedFromLinkedList(list_head, subtree_size);
-        
-        if (parent == nullptr) {
+
+        if (scapegoat_index == 0) {
             root_ = new_subtree_root;
-        } else if (is_left_child) {
-            parent->left = new_subtree_root;
+        } else if (path[scapegoat_index - 1]->left == scapegoat) {
+            path[scapegoat_index - 1]->left = new_subtree_root;
         } else {
-            parent->right = new_subtree_root;
+            path[scapegoat_index - 1]->right = new_subtree_root;
         }
     }
 
     Node* rebuildEntireTree() {
-        size_t tree_size = size_;
-        Node* list_head = flattenTree(root_, nullptr);
-        return buildBalancedFromLinkedList(list_head, tree_size);
+        this->rebuilds_++;
+        this->instrumentation_.rebuild(size_);
+        Node* list_head = flattenTree(root_);
+        return buildBalancedFromLinkedList(list_head, size_);
     }
 
     Node* removeNode(Node* node, const T& value) {
         if (node == nullptr) return nullptr;
         
+        this->instrumentation_.compare();
         if (value < node->key) {
             node->left = removeNode(node->left, value);
         } else if (value > node->key) {
@@ -197,12 +354,12 @@ private:
         } else {            
             if (node->left == nullptr) {
                 Node* temp = node->right;
-                delete node;
+                destroyNode(node);
                 size_--;
                 return temp;
             } else if (node->right == nullptr) {
                 Node* temp = node->left;
-                delete node;
+                destroyNode(node);
                 size_--;
                 return temp;
             }
@@ -215,15 +372,27 @@ private:
             node->key = temp->key;
             node->right = removeNode(node->right, temp->key);
         }
-        
+
+        node->size = 1 + subtreeSize(node->left) + subtreeSize(node->right);
+        return node;
+    }
+
+    Node* createNode(const T& key) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, key);
         return node;
     }
 
+    void destroyNode(Node* node) {
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
     void destroyTree(Node* node) {
         if (node) {
             destroyTree(node->left);
             destroyTree(node->right);
-            delete node;
+            destroyNode(node);
         }
     }
 };
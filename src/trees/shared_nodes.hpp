@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Reference counts for nodes shared between a tree and its snapshots. Copying
+// an AVL or red-black tree is O(1): the copy takes another reference to the
+// root and from then on both trees share every node. A tree that is about to
+// change a shared node copies it first and changes the copy (path copying),
+// so the other tree never observes the write and each write copies at most
+// the O(log n) nodes it touches.
+//
+// A count is the number of links to the node from parent nodes and tree
+// roots. The nodes below a shared node are shared as well even when their
+// own count is one, which is why writers take ownership from the root down:
+// copying a node adds a reference to each of its children.
+//
+// Counts are atomic so that a snapshot can be read and destroyed on another
+// thread while its tree is being written. The allocator has to allow that
+// too; PoolAllocator does not.
+
+using RefCount = std::atomic<uint32_t>;
+
+template <typename Node>
+void retain(Node* node) {
+    if (node != nullptr) {
+        node->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Acquire pairs with the release in dropRef: once the other owner has let
+// go, its reads of the node are finished and the node can change in place.
+template <typename Node>
+bool isShared(const Node* node) {
+    return node->refs.load(std::memory_order_acquire) > 1;
+}
+
+// Drops one reference. True when it was the last one, so the caller has to
+// release the children and free the node.
+template <typename Node>
+bool dropRef(Node* node) {
+    return node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+}
@@ -1,35 +1,128 @@
 #pragma once
 
 #include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "order_statistics.hpp"
+#include "tree_iterator.hpp"
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <vector>
 
-template <typename T>
-class SplayTree final : public BinarySearchTree<T> {
+// How a SplayTree restructures when a search finds its key. Inserts,
+// removes, assign and the order-statistic queries always splay fully.
+//   FULL           splay every hit to the root, the default.
+//   SEMI           semi-splay: at a zig-zig only the parent is rotated and
+//                  the splay carries on from it, so the hit ends up about
+//                  halfway to the root and a zig-zig costs one rotation.
+//   PROBABILISTIC  splay a hit with the given probability.
+//   DEPTH          splay only hits found deeper than depth nodes.
+//   PERIODIC       splay every period-th hit.
+// The last three leave most hits of a well-balanced tree in place, which is
+// what lets the server answer those under a shared lock.
+struct SplayPolicy {
+    enum class Mode : uint8_t {
+        FULL,
+        SEMI,
+        PROBABILISTIC,
+        DEPTH,
+        PERIODIC
+    };
+
+    Mode mode = Mode::FULL;
+    double probability = 1.0;
+    size_t depth = 0;
+    uint64_t period = 1;
+
+    // True when the policy restructures on every hit.
+    bool splaysEveryHit() const {
+        return mode == Mode::FULL || mode == Mode::SEMI;
+    }
+};
+
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class SplayTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
 public:
     struct Node {
+        using Link = typename NodeStorage<Allocator>::template Link<Node>;
+
         T key;
-        Node *left, *right, *parent;
+        Link left, right, parent;
+        typename NodeStorage<Allocator>::Size size;
 
         explicit Node(const T& key) 
-            : key(key), left(nullptr), right(nullptr), parent(nullptr) {}
+            : key(key), left(nullptr), right(nullptr), parent(nullptr), size(1) {}
     };
 
-    SplayTree() : root_(nullptr) {}
+    explicit SplayTree(SplayPolicy policy = {}) : root_(nullptr), policy_(policy) {}
     
     ~SplayTree() {
-        destroyTree(root_);
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            alloc_.release();
+        } else {
+            destroyTree(root_);
+        }
     }
 
     bool search(const T& value) override {
+        return find(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
+        size_t depth = 0;
+        Node* node = findNode(value, &depth);
+        if (node) {
+            if (splayDue(depth)) {
+                restructure(node);
+            }
+            return &node->key;
+        }
+        return nullptr;
+    }
+
+    // Answers a search without restructuring the tree, so calls may run
+    // concurrently with each other and with the const methods. Returns
+    // nullopt when the policy wants this hit splayed; the caller then
+    // finishes it with searchAndSplay() under exclusive access. Misses never
+    // splay.
+    std::optional<bool> searchShared(const T& value) {
+        if (policy_.splaysEveryHit()) {
+            return std::nullopt;
+        }
+        size_t depth = 0;
+        if (!findNode(value, &depth)) {
+            return false;
+        }
+        if (splayDue(depth)) {
+            return std::nullopt;
+        }
+        return true;
+    }
+
+    // A search whose hit is restructured whatever the policy decides, in the
+    // policy's way: semi-splayed under SEMI and splayed otherwise.
+    bool searchAndSplay(const T& value) {
         Node* node = findNode(value);
         if (node) {
-            splay(node);
+            restructure(node);
             return true;
         }
         return false;
     }
 
+    bool assign(const T& value) override {
+        Node* node = findNode(value);
+        if (!node) {
+            return false;
+        }
+        splay(node);
+        node->key = value;
+        return true;
+    }
+
     void insert(const T &value) override {
-        Node* newNode = new Node(value);
+        Node* newNode = createNode(value);
         if (!root_) {
             root_ = newNode;
             return;
@@ -39,13 +132,14 @@ public:
         Node* parent = nullptr;
         
         while (current) {
+            this->instrumentation_.compare();
             parent = current;
             if (value < current->key) {
                 current = current->left;
             } else if (value > current->key) {
                 current = current->right;
             } else {
-                delete newNode;
+                destroyNode(newNode);
                 splay(current);
                 return;
             }
@@ -57,6 +151,10 @@ public:
         } else {
             parent->right = newNode;
         }
+
+        for (Node* node = parent; node != nullptr; node = node->parent) {
+            node->size++;
+        }
         
         splay(newNode);
     }
@@ -74,7 +172,7 @@ public:
         if (leftSubtree) leftSubtree->parent = nullptr;
         if (rightSubtree) rightSubtree->parent = nullptr;
     
-        delete toDelete;
+        destroyNode(toDelete);
         root_ = nullptr;
     
         if (leftSubtree) {
@@ -82,6 +180,7 @@ public:
             Node* maxNode = maximum(root_);
             splay(maxNode);
             root_->right = rightSubtree;
+            root_->size += subtreeSize(rightSubtree);
             if (rightSubtree) {
                 rightSubtree->parent = root_;
             }
@@ -90,24 +189,123 @@ public:
         }
     }
 
+    size_t rank(const T& value) override {
+        return countBelowAndSplay(value, false);
+    }
+
+    T select(size_t k) override {
+        Node* node = selectNode(root_, k);
+        splay(node);
+        return node->key;
+    }
+
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelowAndSplay(hi, true) - countBelowAndSplay(lo, false);
+    }
+
+    size_t size() const override {
+        return subtreeSize(root_);
+    }
+
+    size_t bytesAllocated() const override {
+        return size() * sizeof(Node);
+    }
+
+    size_t searchDepth(const T& value) const override {
+        return searchPathLength(static_cast<const Node*>(root_), value);
+    }
+
+    bool keepsDuplicates() const override {
+        return false;
+    }
+
+    using iterator = TreeIterator<Node>;
+    using const_iterator = TreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    // Both bounds splay the deepest node on their search path, like search
+    // does, before positioning the iterator from the new root.
+    const_iterator lower_bound(const T& value) {
+        countBelowAndSplay(value, false);
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) {
+        countBelowAndSplay(value, true);
+        return const_iterator::upperBound(root_, value);
+    }
+
     Node* getRoot() const {
         return root_;
     }
 
+    const SplayPolicy& policy() const {
+        return policy_;
+    }
+
+    // Searches and rank queries splay the accessed node to the root, unless
+    // the policy lets a search hit stay where it is.
+    static constexpr bool READS_MODIFY_TREE = true;
+
     static std::string name() {
         return "Splay Tree";
     }
 
-    void accept(TreeVisitor<T>& visitor) const override {
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
         visitor.visit(*this);
     }
 
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        std::vector<Node*> stack;
+        Node* current = root_;
+        while (current != nullptr || !stack.empty()) {
+            while (current != nullptr) {
+                stack.push_back(current);
+                current = current->left;
+            }
+            current = stack.back();
+            stack.pop_back();
+            out.push_back(current->key);
+            current = current->right;
+        }
+    }
+
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+        root_ = buildBalanced(values, 0, values.size(), nullptr);
+    }
+
 private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+    NodeAllocator alloc_;
     Node* root_ = nullptr;
+    SplayPolicy policy_;
+    // Search hits the policy has been asked about. Concurrent searchShared
+    // calls bump it with a plain load and store like the instrumentation
+    // counters, so racing hits may draw the same number.
+    std::atomic<uint64_t> hits_{0};
 
-    Node* findNode(const T& value) {
+    // depth, when given, receives the number of nodes visited.
+    Node* findNode(const T& value, size_t* depth = nullptr) {
         Node* current = root_;
         while (current) {
+            this->instrumentation_.compare();
+            if (depth) {
+                ++*depth;
+            }
             if (value < current->key) {
                 current = current->left;
             } else if (value > current->key) {
@@ -119,6 +317,47 @@ private:
         return nullptr;
     }
 
+    // Whether the policy splays a hit found at depth. The probabilistic draw
+    // hashes the hit number, which needs no generator state.
+    bool splayDue(size_t depth) {
+        if (policy_.splaysEveryHit()) {
+            return true;
+        }
+        if (policy_.mode == SplayPolicy::Mode::DEPTH) {
+            return depth > policy_.depth;
+        }
+
+        uint64_t hit = hits_.load(std::memory_order_relaxed);
+        hits_.store(hit + 1, std::memory_order_relaxed);
+        if (policy_.mode == SplayPolicy::Mode::PERIODIC) {
+            return (hit + 1) % policy_.period == 0;
+        }
+        uint64_t z = hit + 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+        return static_cast<double>(z >> 11) * 0x1.0p-53 < policy_.probability;
+    }
+
+    void restructure(Node* node) {
+        if (policy_.mode == SplayPolicy::Mode::SEMI) {
+            semiSplay(node);
+        } else {
+            splay(node);
+        }
+    }
+
+    // Splays the deepest node on the search path so that rank queries keep
+    // the same amortized bound as search.
+    size_t countBelowAndSplay(const T& value, bool inclusive) {
+        Node* last = nullptr;
+        size_t count = countBelow(root_, value, inclusive, &last);
+        if (last != nullptr) {
+            splay(last);
+        }
+        return count;
+    }
+
     Node* maximum(Node* node) {
         while (node->right) {
             node = node->right;
@@ -129,6 +368,7 @@ private:
     void rotateLeft(Node* x) {
         Node* y = x->right;
         if (!y) return;
+        this->instrumentation_.rotate();
         
         x->right = y->left;
         if (y->left) {
@@ -146,11 +386,15 @@ private:
         
         y->left = x;
         x->parent = y;
+
+        y->size = x->size;
+        x->size = 1 + subtreeSize(x->left) + subtreeSize(x->right);
     }
 
     void rotateRight(Node* x) {
         Node* y = x->left;
         if (!y) return;
+        this->instrumentation_.rotate();
         
         x->left = y->right;
         if (y->right) {
@@ -168,10 +412,14 @@ private:
         
         y->right = x;
         x->parent = y;
+
+        y->size = x->size;
+        x->size = 1 + subtreeSize(x->left) + subtreeSize(x->right);
     }
 
     void splay(Node* x) {
         while (x->parent) {
+            this->instrumentation_.splayStep();
             Node* parent = x->parent;
             Node* grandparent = parent->parent;
 
@@ -206,11 +454,75 @@ private:
         }
     }
 
+    // Zig and zig-zag steps are those of splay(). A zig-zig rotates only the
+    // grandparent, lifting the parent over it, and continues from the parent,
+    // which halves the rotations of a long left or right path.
+    void semiSplay(Node* x) {
+        while (x->parent) {
+            this->instrumentation_.splayStep();
+            Node* parent = x->parent;
+            Node* grandparent = parent->parent;
+
+            if (!grandparent) {
+                if (x == parent->left) {
+                    rotateRight(parent);
+                } else {
+                    rotateLeft(parent);
+                }
+                continue;
+            }
+
+            bool isParentLeft = (parent == grandparent->left);
+            bool isXLeft = (x == parent->left);
+
+            if (isParentLeft == isXLeft) {
+                if (isXLeft) {
+                    rotateRight(grandparent);
+                } else {
+                    rotateLeft(grandparent);
+                }
+                x = parent;
+            } else if (isXLeft) {
+                rotateRight(parent);
+                rotateLeft(grandparent);
+            } else {
+                rotateLeft(parent);
+                rotateRight(grandparent);
+            }
+        }
+    }
+
+    Node* buildBalanced(const std::vector<T>& values, size_t begin, size_t end, Node* parent) {
+        if (begin == end) {
+            return nullptr;
+        }
+
+        size_t mid = begin + (end - begin) / 2;
+        Node* node = createNode(values[mid]);
+        node->parent = parent;
+        node->size = end - begin;
+
+        node->left = buildBalanced(values, begin, mid, node);
+        node->right = buildBalanced(values, mid + 1, end, node);
+        return node;
+    }
+
+    Node* createNode(const T& key) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, key);
+        return node;
+    }
+
+    void destroyNode(Node* node) {
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
     void destroyTree(Node* node) {
         if (node) {
             destroyTree(node->left);
             destroyTree(node->right);
-            delete node;
+            destroyNode(node);
         }
     }
 };
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// A string key that keeps its first PREFIX_BYTES bytes inline as a
+// big-endian integer next to the string. Two keys that differ within the
+// prefix compare with one integer comparison, without touching the
+// characters of either string; only keys sharing the whole prefix fall back
+// to comparing the strings. Shorter strings are padded with zero bytes, so
+// "ab" and "ab\0" tie on the prefix and are told apart by the full compare.
+class StringKey {
+public:
+    static constexpr size_t PREFIX_BYTES = sizeof(uint64_t);
+
+    StringKey() = default;
+
+    StringKey(std::string text) : prefix_(packPrefix(text)), text_(std::move(text)) {}
+
+    StringKey(const char* text) : StringKey(std::string(text)) {}
+
+    const std::string& str() const {
+        return text_;
+    }
+
+    size_t size() const {
+        return text_.size();
+    }
+
+    friend bool operator==(const StringKey& a, const StringKey& b) {
+        return a.prefix_ == b.prefix_ && a.text_ == b.text_;
+    }
+
+    friend std::strong_ordering operator<=>(const StringKey& a, const StringKey& b) {
+        if (a.prefix_ != b.prefix_) {
+            return a.prefix_ <=> b.prefix_;
+        }
+        return a.text_.compare(b.text_) <=> 0;
+    }
+
+    // std::string compares as unsigned bytes, which the big-endian packing
+    // preserves.
+    static uint64_t packPrefix(const std::string& text) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < PREFIX_BYTES; i++) {
+            prefix <<= 8;
+            if (i < text.size()) {
+                prefix |= static_cast<unsigned char>(text[i]);
+            }
+        }
+        return prefix;
+    }
+
+private:
+    uint64_t prefix_ = 0;
+    std::string text_;
+};
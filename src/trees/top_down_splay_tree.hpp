@@ -0,0 +1,360 @@
+#pragma once
+
+#include "binary_search_tree.h"
+#include "pool_allocator.hpp"
+#include "compact_allocator.hpp"
+#include "order_statistics.hpp"
+#include "tree_iterator.hpp"
+#include <vector>
+
+// A splay tree that splays on the way down (Sleator and Tarjan's top-down
+// splay). The search path is cut into a left tree of the keys below the
+// target and a right tree of the keys above it, with zig-zig steps rotated
+// as they are passed, and the three pieces are joined under the last node
+// reached. Nodes need no parent pointer, so they are one link smaller than
+// SplayTree's, and a splay writes each node on the path about once instead
+// of fixing parent links at every rotation. Insert and remove split and
+// join at the root. Like SplayTree it keeps at most one copy of a key.
+template <typename T, typename Allocator = std::allocator<T>, typename Instrumentation = NoInstrumentation>
+class TopDownSplayTree final : public BinarySearchTree<T, Allocator, Instrumentation> {
+public:
+    struct Node {
+        using Link = typename NodeStorage<Allocator>::template Link<Node>;
+
+        T key;
+        Link left, right;
+        typename NodeStorage<Allocator>::Size size;
+
+        explicit Node(const T& key)
+            : key(key), left(nullptr), right(nullptr), size(1) {}
+    };
+
+    TopDownSplayTree() : root_(nullptr) {}
+
+    ~TopDownSplayTree() {
+        if constexpr (BulkReleasable<NodeAllocator, Node>) {
+            alloc_.release();
+        } else {
+            destroyTree(root_);
+        }
+    }
+
+    bool search(const T& value) override {
+        return find(value) != nullptr;
+    }
+
+    const T* find(const T& value) override {
+        root_ = splay(root_, value);
+        if (root_ && root_->key == value) {
+            return &root_->key;
+        }
+        return nullptr;
+    }
+
+    bool assign(const T& value) override {
+        root_ = splay(root_, value);
+        if (root_ && root_->key == value) {
+            root_->key = value;
+            return true;
+        }
+        return false;
+    }
+
+    // After the splay the root is the key or one of its neighbours, so the
+    // new node takes the root's subtree on one side and the root on the other.
+    void insert(const T &value) override {
+        if (!root_) {
+            root_ = createNode(value);
+            return;
+        }
+
+        root_ = splay(root_, value);
+        if (root_->key == value) {
+            return;
+        }
+
+        Node* node = createNode(value);
+        node->size = root_->size + 1;
+        if (value < root_->key) {
+            node->left = root_->left;
+            node->right = root_;
+            root_->left = nullptr;
+            root_->size -= subtreeSize(node->left);
+        } else {
+            node->right = root_->right;
+            node->left = root_;
+            root_->right = nullptr;
+            root_->size -= subtreeSize(node->right);
+        }
+        root_ = node;
+    }
+
+    // Splaying the left subtree for the removed key brings its largest key to
+    // the top, which leaves it a free right link for the right subtree.
+    void remove(const T &value) override {
+        if (!root_) return;
+
+        root_ = splay(root_, value);
+        if (root_->key != value) return;
+
+        Node* toDelete = root_;
+        Node* rightSubtree = root_->right;
+
+        if (root_->left) {
+            root_ = splay(root_->left, value);
+            root_->right = rightSubtree;
+            root_->size += subtreeSize(rightSubtree);
+        } else {
+            root_ = rightSubtree;
+        }
+        destroyNode(toDelete);
+    }
+
+    // The splay leaves the key or a neighbour of it at the root, so the
+    // count is read off the root and its left subtree.
+    size_t rank(const T& value) override {
+        return countBelowAndSplay(value, false);
+    }
+
+    T select(size_t k) override {
+        Node* node = selectNode(root_, k);
+        T key = node->key;
+        root_ = splay(root_, key);
+        return key;
+    }
+
+    size_t countRange(const T& lo, const T& hi) override {
+        if (hi < lo) {
+            return 0;
+        }
+        return countBelowAndSplay(hi, true) - countBelowAndSplay(lo, false);
+    }
+
+    size_t size() const override {
+        return subtreeSize(root_);
+    }
+
+    size_t bytesAllocated() const override {
+        return size() * sizeof(Node);
+    }
+
+    size_t searchDepth(const T& value) const override {
+        return searchPathLength(static_cast<const Node*>(root_), value);
+    }
+
+    bool keepsDuplicates() const override {
+        return false;
+    }
+
+    using iterator = TreeIterator<Node>;
+    using const_iterator = TreeIterator<Node>;
+
+    const_iterator begin() const {
+        return const_iterator::first(root_);
+    }
+
+    const_iterator end() const {
+        return const_iterator(root_);
+    }
+
+    const_iterator lower_bound(const T& value) {
+        root_ = splay(root_, value);
+        return const_iterator::lowerBound(root_, value);
+    }
+
+    const_iterator upper_bound(const T& value) {
+        root_ = splay(root_, value);
+        return const_iterator::upperBound(root_, value);
+    }
+
+    Node* getRoot() const {
+        return root_;
+    }
+
+    // Searches and rank queries splay the accessed key to the root.
+    static constexpr bool READS_MODIFY_TREE = true;
+
+    static std::string name() {
+        return "Top-Down Splay Tree";
+    }
+
+    void accept(TreeVisitor<T, Allocator, Instrumentation>& visitor) const override {
+        visitor.visit(*this);
+    }
+
+protected:
+    void appendKeys(std::vector<T>& out) const override {
+        std::vector<Node*> stack;
+        Node* current = root_;
+        while (current != nullptr || !stack.empty()) {
+            while (current != nullptr) {
+                stack.push_back(current);
+                current = current->left;
+            }
+            current = stack.back();
+            stack.pop_back();
+            out.push_back(current->key);
+            current = current->right;
+        }
+    }
+
+    void buildFromSorted(const std::vector<T>& values) override {
+        destroyTree(root_);
+        root_ = buildBalanced(values, 0, values.size());
+    }
+
+private:
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeAllocatorTraits = std::allocator_traits<NodeAllocator>;
+
+    NodeAllocator alloc_;
+    Node* root_ = nullptr;
+
+    // Negative, zero or positive as value sorts before, at or after the key.
+    int compare(const T& value, const Node* node) {
+        this->instrumentation_.compare();
+        if (value < node->key) {
+            return -1;
+        }
+        return value > node->key ? 1 : 0;
+    }
+
+    size_t countBelowAndSplay(const T& value, bool inclusive) {
+        root_ = splay(root_, value);
+        if (!root_) {
+            return 0;
+        }
+        bool rootBelow = root_->key < value || (inclusive && !(value < root_->key));
+        return subtreeSize(root_->left) + (rootBelow ? 1 : 0);
+    }
+
+    // Splays the subtree t for value and returns its new root: the node
+    // holding value, or the last node on its search path when it is missing.
+    // Each node on the path is compared once. Nodes linked into the left and
+    // right trees only get their sizes after the descent, in one walk down
+    // each tree's inner spine, as their final subtrees are not known before.
+    Node* splay(Node* t, const T& value) {
+        if (!t) {
+            return nullptr;
+        }
+
+        // The left tree grows down its right spine and the right tree down
+        // its left spine; leftMax and rightMin are the ends of those spines.
+        Node* leftRoot = nullptr;
+        Node* leftMax = nullptr;
+        Node* rightRoot = nullptr;
+        Node* rightMin = nullptr;
+        size_t leftSize = 0;
+        size_t rightSize = 0;
+
+        int cmp = compare(value, t);
+        while (cmp != 0) {
+            if (cmp < 0) {
+                Node* child = t->left;
+                if (!child) break;
+                this->instrumentation_.splayStep();
+                int childCmp = compare(value, child);
+                if (childCmp < 0) {
+                    this->instrumentation_.rotate();
+                    t->left = child->right;
+                    child->right = t;
+                    t->size = 1 + subtreeSize(t->left) + subtreeSize(t->right);
+                    t = child;
+                    if (!t->left) break;
+                    child = t->left;
+                    childCmp = compare(value, child);
+                }
+                if (rightMin) {
+                    rightMin->left = t;
+                } else {
+                    rightRoot = t;
+                }
+                rightMin = t;
+                rightSize += 1 + subtreeSize(t->right);
+                t = child;
+                cmp = childCmp;
+            } else {
+                Node* child = t->right;
+                if (!child) break;
+                this->instrumentation_.splayStep();
+                int childCmp = compare(value, child);
+                if (childCmp > 0) {
+                    this->instrumentation_.rotate();
+                    t->right = child->left;
+                    child->left = t;
+                    t->size = 1 + subtreeSize(t->left) + subtreeSize(t->right);
+                    t = child;
+                    if (!t->right) break;
+                    child = t->right;
+                    childCmp = compare(value, child);
+                }
+                if (leftMax) {
+                    leftMax->right = t;
+                } else {
+                    leftRoot = t;
+                }
+                leftMax = t;
+                leftSize += 1 + subtreeSize(t->left);
+                t = child;
+                cmp = childCmp;
+            }
+        }
+
+        leftSize += subtreeSize(t->left);
+        rightSize += subtreeSize(t->right);
+        t->size = leftSize + rightSize + 1;
+
+        if (leftMax) {
+            for (Node* node = leftRoot; ; node = node->right) {
+                node->size = leftSize;
+                if (node == leftMax) break;
+                leftSize -= 1 + subtreeSize(node->left);
+            }
+            leftMax->right = t->left;
+            t->left = leftRoot;
+        }
+        if (rightMin) {
+            for (Node* node = rightRoot; ; node = node->left) {
+                node->size = rightSize;
+                if (node == rightMin) break;
+                rightSize -= 1 + subtreeSize(node->right);
+            }
+            rightMin->left = t->right;
+            t->right = rightRoot;
+        }
+        return t;
+    }
+
+    Node* buildBalanced(const std::vector<T>& values, size_t begin, size_t end) {
+        if (begin == end) {
+            return nullptr;
+        }
+
+        size_t mid = begin + (end - begin) / 2;
+        Node* node = createNode(values[mid]);
+        node->size = end - begin;
+
+        node->left = buildBalanced(values, begin, mid);
+        node->right = buildBalanced(values, mid + 1, end);
+        return node;
+    }
+
+    Node* createNode(const T& key) {
+        Node* node = NodeAllocatorTraits::allocate(alloc_, 1);
+        NodeAllocatorTraits::construct(alloc_, node, key);
+        return node;
+    }
+
+    void destroyNode(Node* node) {
+        NodeAllocatorTraits::destroy(alloc_, node);
+        NodeAllocatorTraits::deallocate(alloc_, node, 1);
+    }
+
+    void destroyTree(Node* node) {
+        if (node) {
+            destroyTree(node->left);
+            destroyTree(node->right);
+            destroyNode(node);
+        }
+    }
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+// Bidirectional in-order iterator shared by every tree. It keeps the path
+// from the root to the current node, so it works for trees without parent
+// pointers and a full traversal touches each edge twice: increments are
+// amortized O(1) and positioning with lowerBound/upperBound is O(height).
+//
+// Like std::set, keys cannot be modified through the iterator. Any change to
+// the tree, including a splay tree search, invalidates it.
+template <typename Node>
+class TreeIterator {
+public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = std::remove_cv_t<decltype(Node::key)>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type*;
+    using reference = const value_type&;
+
+    TreeIterator() = default;
+
+    // The past-the-end iterator. It still needs the root so that it can be
+    // decremented to the largest key.
+    explicit TreeIterator(const Node* root) : root_(root) {}
+
+    static TreeIterator first(const Node* root) {
+        TreeIterator it(root);
+        it.descendLeft(root);
+        return it;
+    }
+
+    // First key not less than value.
+    template <typename T>
+    static TreeIterator lowerBound(const Node* root, const T& value) {
+        return bound(root, [&](const Node* node) { return !(node->key < value); });
+    }
+
+    // First key greater than value.
+    template <typename T>
+    static TreeIterator upperBound(const Node* root, const T& value) {
+        return bound(root, [&](const Node* node) { return value < node->key; });
+    }
+
+    reference operator*() const {
+        return path_.back()->key;
+    }
+
+    pointer operator->() const {
+        return &path_.back()->key;
+    }
+
+    TreeIterator& operator++() {
+        const Node* node = path_.back();
+        if (node->right != nullptr) {
+            descendLeft(node->right);
+            return *this;
+        }
+
+        const Node* child;
+        do {
+            child = path_.back();
+            path_.pop_back();
+        } while (!path_.empty() && path_.back()->right == child);
+        return *this;
+    }
+
+    TreeIterator operator++(int) {
+        TreeIterator copy = *this;
+        ++*this;
+        return copy;
+    }
+
+    TreeIterator& operator--() {
+        if (path_.empty()) {
+            descendRight(root_);
+            return *this;
+        }
+
+        const Node* node = path_.back();
+        if (node->left != nullptr) {
+            descendRight(node->left);
+            return *this;
+        }
+
+        const Node* child;
+        do {
+            child = path_.back();
+            path_.pop_back();
+        } while (!path_.empty() && path_.back()->left == child);
+        return *this;
+    }
+
+    TreeIterator operator--(int) {
+        TreeIterator copy = *this;
+        --*this;
+        return copy;
+    }
+
+    friend bool operator==(const TreeIterator& lhs, const TreeIterator& rhs) {
+        return lhs.current() == rhs.current();
+    }
+
+private:
+    const Node* root_ = nullptr;
+    std::vector<const Node*> path_;
+
+    const Node* current() const {
+        return path_.empty() ? nullptr : path_.back();
+    }
+
+    void descendLeft(const Node* node) {
+        while (node != nullptr) {
+            path_.push_back(node);
+            node = node->left;
+        }
+    }
+
+    void descendRight(const Node* node) {
+        while (node != nullptr) {
+            path_.push_back(node);
+            node = node->right;
+        }
+    }
+
+    // Descends towards the leftmost node satisfying accepts, then trims the
+    // path back to it so that the stack holds exactly its ancestors.
+    template <typename Predicate>
+    static TreeIterator bound(const Node* root, Predicate accepts) {
+        TreeIterator it(root);
+        size_t keep = 0;
+        const Node* node = root;
+        while (node != nullptr) {
+            it.path_.push_back(node);
+            if (accepts(node)) {
+                keep = it.path_.size();
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        it.path_.resize(keep);
+        return it;
+    }
+};
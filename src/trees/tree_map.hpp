@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include "instrumentation.hpp"
+
+// Values of up to this many bytes are kept in the node next to their key.
+constexpr size_t MAP_INLINE_VALUE_BYTES = 16;
+
+// How a map entry holds its value. Small trivially copyable values sit in
+// the node. Anything else is allocated once and shared by every copy of the
+// entry: rebalancing, bulk loads, set operations and snapshots all copy
+// entries around, and those copies then cost a reference count instead of a
+// copy of the value. Assigning a new value swaps the pointer and never
+// writes through it, so a snapshot keeps the value it saw.
+template <typename V>
+class MapValue {
+public:
+    static constexpr bool INLINE = std::is_trivially_copyable_v<V> && sizeof(V) <= MAP_INLINE_VALUE_BYTES;
+
+    MapValue() = default;
+
+    explicit MapValue(const V& value) {
+        if constexpr (INLINE) {
+            value_ = value;
+        } else {
+            value_ = std::make_shared<const V>(value);
+        }
+    }
+
+    // A value-initialized V for an entry added without a value.
+    const V& get() const {
+        if constexpr (INLINE) {
+            return value_;
+        } else {
+            return value_ ? *value_ : EMPTY;
+        }
+    }
+
+    bool inlined() const {
+        return INLINE;
+    }
+
+private:
+    std::conditional_t<INLINE, V, std::shared_ptr<const V>> value_{};
+
+    static inline const V EMPTY{};
+};
+
+// Strings get a small-string layout of their own: up to
+// MAP_INLINE_VALUE_BYTES characters in the node, longer ones shared as
+// above. That is 24 bytes against 32 for a std::string, which only keeps 15
+// characters inline and copies longer ones whenever the entry is copied.
+template <>
+class MapValue<std::string> {
+public:
+    MapValue() : size_(0) {}
+
+    explicit MapValue(std::string_view value) {
+        if (value.size() <= MAP_INLINE_VALUE_BYTES) {
+            std::memcpy(bytes_, value.data(), value.size());
+            size_ = static_cast<uint8_t>(value.size());
+        } else {
+            new (&shared_) std::shared_ptr<const std::string>(std::make_shared<const std::string>(value));
+            size_ = SHARED;
+        }
+    }
+
+    explicit MapValue(const std::string& value) : MapValue(std::string_view(value)) {}
+
+    MapValue(const MapValue& other) {
+        copyFrom(other);
+    }
+
+    MapValue& operator=(const MapValue& other) {
+        if (this != &other) {
+            reset();
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    ~MapValue() {
+        reset();
+    }
+
+    // Empty for an entry added without a value.
+    std::string_view get() const {
+        return size_ == SHARED ? std::string_view(*shared_) : std::string_view(bytes_, size_);
+    }
+
+    bool inlined() const {
+        return size_ != SHARED;
+    }
+
+private:
+    static constexpr uint8_t SHARED = 0xFF;
+
+    union {
+        char bytes_[MAP_INLINE_VALUE_BYTES];
+        std::shared_ptr<const std::string> shared_;
+    };
+    uint8_t size_;
+
+    void copyFrom(const MapValue& other) {
+        size_ = other.size_;
+        if (size_ == SHARED) {
+            new (&shared_) std::shared_ptr<const std::string>(other.shared_);
+        } else {
+            std::memcpy(bytes_, other.bytes_, size_);
+        }
+    }
+
+    void reset() {
+        if (size_ == SHARED) {
+            shared_.~shared_ptr();
+        }
+        size_ = 0;
+    }
+};
+
+// A key and its value, ordered and compared by the key alone. A tree of
+// entries is therefore a map: an entry built from just a key finds the
+// stored entry whatever its value, and the tree's find() and assign() read
+// and replace the value.
+template <typename K, typename V>
+struct MapEntry {
+    K key;
+    MapValue<V> value;
+
+    MapEntry() = default;
+
+    // Implicit, so keys can be passed wherever entries are expected.
+    MapEntry(const K& key) : key(key) {}
+
+    MapEntry(const K& key, const V& value) : key(key), value(value) {}
+
+    friend bool operator==(const MapEntry& a, const MapEntry& b) {
+        return a.key == b.key;
+    }
+
+    friend auto operator<=>(const MapEntry& a, const MapEntry& b) {
+        return a.key <=> b.key;
+    }
+};
+
+// A map from K to V on top of any of the trees, for example
+// TreeMap<AVLTree, StringKey, uint64_t>. Each call is a single traversal of
+// the tree, except insert_or_assign of a key that is not there yet, which
+// goes on to insert it. Unlike the sets, a map never holds a key twice.
+template <template <typename, typename, typename> class Tree, typename K, typename V,
+          typename Allocator = std::allocator<MapEntry<K, V>>, typename Instrumentation = NoInstrumentation>
+class TreeMap {
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using entry_type = MapEntry<K, V>;
+    using tree_type = Tree<entry_type, Allocator, Instrumentation>;
+
+    // Arguments go to the tree, such as the alpha of a scapegoat tree.
+    template <typename... Args>
+    explicit TreeMap(Args&&... args) : tree_(std::forward<Args>(args)...) {}
+
+    // The value of key, or nullptr if key is missing. Good until the next
+    // call on the map.
+    const MapValue<V>* find(const K& key) {
+        const entry_type* entry = tree_.find(entry_type(key));
+        return entry != nullptr ? &entry->value : nullptr;
+    }
+
+    bool contains(const K& key) {
+        return tree_.search(entry_type(key));
+    }
+
+    // Returns true if key was added and false if its value was replaced.
+    bool insert_or_assign(const K& key, const V& value) {
+        entry_type entry(key, value);
+        if (tree_.assign(entry)) {
+            return false;
+        }
+        tree_.insert(entry);
+        return true;
+    }
+
+    // Returns whether key was there.
+    bool erase(const K& key) {
+        size_t before = tree_.size();
+        tree_.remove(entry_type(key));
+        return tree_.size() != before;
+    }
+
+    size_t size() const {
+        return tree_.size();
+    }
+
+    tree_type& tree() {
+        return tree_;
+    }
+
+    const tree_type& tree() const {
+        return tree_;
+    }
+
+private:
+    tree_type tree_;
+};
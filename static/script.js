@@ -242,13 +242,17 @@ document.addEventListener('DOMContentLoaded', function() {
     
     function buildTreeNode(nodeIndex, nodes, treeType, searchValue = null) {
         const node = nodes[nodeIndex];
+        if (node.keys !== undefined) {
+            return buildMultiwayNode(node, nodes, treeType, searchValue);
+        }
+
         const nodeElement = document.createElement('div');
         nodeElement.className = 'tree-node';
         
         const valueElement = document.createElement('div');
         valueElement.className = 'node-value';
         
-        if (treeType === 'red_black' && node.color !== undefined) {
+        if (treeType.endsWith('red_black_tree') && node.color !== undefined) {
             if (node.color === 'RED' || node.color === 'red' || node.color === 0) {
                 valueElement.classList.add('red-node');
             } else {
@@ -293,4 +297,35 @@ document.addEventListener('DOMContentLoaded', function() {
         
         return nodeElement;
     }
+
+    function buildMultiwayNode(node, nodes, treeType, searchValue = null) {
+        const nodeElement = document.createElement('div');
+        nodeElement.className = 'tree-node';
+
+        const valueElement = document.createElement('div');
+        valueElement.className = 'node-value';
+
+        if (searchValue !== null && node.keys.includes(searchValue)) {
+            valueElement.classList.add('highlight');
+        }
+
+        valueElement.textContent = node.keys.join(' | ');
+        nodeElement.appendChild(valueElement);
+
+        if (node.children.length > 0) {
+            const childrenElement = document.createElement('div');
+            childrenElement.className = 'node-children';
+
+            node.children.forEach(childIndex => {
+                const branch = document.createElement('div');
+                branch.className = 'child-branch';
+                branch.appendChild(buildTreeNode(childIndex, nodes, treeType, searchValue));
+                childrenElement.appendChild(branch);
+            });
+
+            nodeElement.appendChild(childrenElement);
+        }
+
+        return nodeElement;
+    }
 });